@@ -29,12 +29,17 @@
 #include "client.h"
 #include "usage.h"
 
+#include <algorithm>
+#include <sstream>
+#include <unordered_map>
+
 #include "queries.h"
 
 #include "support/check.h"
 #include "support/options.h"
 #include "support/progress.h"
 
+#include "core/samplelog.h"
 #include "database/connection.h"
 
 #include "fmt/ostream.h"
@@ -42,10 +47,97 @@
 
 using namespace chopstix;
 
+namespace {
+
+struct SampleKey {
+    uint64_t ip;
+    uint32_t pid;
+    bool operator==(const SampleKey &other) const {
+        return ip == other.ip && pid == other.pid;
+    }
+};
+
+struct SampleKeyHash {
+    size_t operator()(const SampleKey &key) const {
+        return std::hash<uint64_t>()(key.ip ^ ((uint64_t)key.pid << 48));
+    }
+};
+
+// Count the samples of the log per PC, for SQL_GROUP_SAMPLES
+void count_log(Connection &db, const SampleLogReader &log) {
+    std::unordered_map<SampleKey, uint64_t, SampleKeyHash> counts;
+    for (size_t n = 0; n < log.size(); ++n) {
+        auto &rec = log.record(n);
+        ++counts[SampleKey{rec.ip, rec.pid}];
+    }
+    fmt::print("       {} different PCs sampled\n", counts.size());
+
+    auto query = db.query(SQL_INSERT_SAMPLE_COUNT);
+    db.transact([&]() {
+        for (auto &entry : counts) {
+            query.bind(1, (long)entry.first.pid)
+                .bind(2, (long)entry.first.ip)
+                .bind(3, (long)entry.second)
+                .finish();
+            query.clear();
+        }
+    });
+}
+
+// Copy the samples of the log to the sample table
+void import_log(Connection &db, const SampleLogReader &log) {
+    db.exec(SQL_CREATE_SAMPLE);
+    auto cols = db.columns("sample");
+    std::stringstream header;
+    std::stringstream body;
+    for (auto &name : log.events()) {
+        if (std::find(cols.begin(), cols.end(), name) == cols.end()) {
+            db.exec(fmt::format(SQL_ADD_EVENT, name));
+        }
+        header << " ,[" << name << "]";
+        body << " ,?";
+    }
+
+    auto query = db.query(
+        fmt::format(SQL_INSERT_SAMPLE, header.str(), body.str()));
+    db.transact([&]() {
+        for (size_t n = 0; n < log.size(); ++n) {
+            auto &rec = log.record(n);
+            auto *values = log.values(n);
+            query.bind(1, (long)rec.ip)
+                .bind(2, (long)rec.pid)
+                .bind(3, (long)rec.tid)
+                .bind(4, (long)rec.time);
+            for (size_t i = 0; i < log.events().size(); ++i) {
+                query.bind(i + 5, (long)values[i]);
+            }
+            query.finish();
+            query.clear();
+        }
+    });
+}
+
+}  // namespace
+
 int run_count(int argc, char **argv) {
     PARSE_OPTIONS(count, argc, argv);
 
     auto db = Connection::get_default(true);
+    db.exec(SQL_CREATE_SAMPLE_COUNT);
+
+    auto opt_raw = getopt("raw");
+    if (opt_raw.is_set()) {
+        SampleLogReader log(opt_raw.as_string());
+        if (getopt("import").as_bool()) {
+            fmt::print("Importing {} samples from {}\n", log.size(),
+                       opt_raw.as_string());
+            import_log(db, log);
+        } else {
+            fmt::print("Counting {} samples from {}\n", log.size(),
+                       opt_raw.as_string());
+            count_log(db, log);
+        }
+    }
 
     Progress prog(5);
 
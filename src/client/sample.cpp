@@ -29,18 +29,27 @@
 #include "usage.h"
 
 #include <algorithm>
-#include <atomic>
 #include <chrono>
+#include <cstring>
+#include <memory>
 #include <sstream>
 #include <thread>
 
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #include "support/check.h"
 
 #include "core/event.h"
+#include "core/iphistogram.h"
 #include "core/maps.h"
 #include "core/process.h"
+#include "core/samplelog.h"
+#include "core/samplequeue.h"
 #include "database/connection.h"
 
 #include "queries.h"
@@ -55,23 +64,30 @@ static void setup_database(Connection &db, event_list &events) {
     db.exec(SQL_CREATE_SAMPLE);
     db.exec(SQL_CREATE_SESSION);
     db.exec(SQL_CREATE_MAP);
+    db.exec(SQL_CREATE_SAMPLE_HIST);
     auto cols = db.columns("sample");
+    auto hist_cols = db.columns("sample_hist");
     for (auto &evt : events) {
         auto name = evt.name();
         if (std::find(cols.begin(), cols.end(), name) == cols.end()) {
             db.exec(fmt::format(SQL_ADD_EVENT, name));
         }
+        if (std::find(hist_cols.begin(), hist_cols.end(), name) ==
+            hist_cols.end()) {
+            db.exec(fmt::format(SQL_ADD_HIST_EVENT, name));
+        }
     }
 }
 
-static Query prepare_insert_sample(Connection &db, event_list &events) {
+static Query prepare_insert(Connection &db, event_list &events,
+                            const char *sql) {
     std::stringstream header;
     std::stringstream body;
     for (auto &evt : events) {
         header << " ,[" << evt.name() << "]";
         body << " ,?";
     }
-    return db.query(fmt::format(SQL_INSERT_SAMPLE, header.str(), body.str()));
+    return db.query(fmt::format(sql, header.str(), body.str()));
 }
 
 static void setup_events(event_list &events, long pid) {
@@ -90,6 +106,42 @@ static void setup_events(event_list &events, long pid) {
     leader.start_buffering();
 }
 
+static void insert_samples(Connection &db, Query &query,
+                           const SampleBatch &batch,
+                           Sample::value_list &last) {
+    db.transact([&]() {
+        for (size_t n = 0; n < batch.size(); ++n) {
+            query.bind(1, batch.ip[n])
+                .bind(2, batch.pid[n])
+                .bind(3, batch.tid[n])
+                .bind(4, batch.time[n]);
+            for (unsigned i = 0; i < batch.counters.size(); ++i) {
+                query.bind(i + 5, batch.counters[i][n] - last[i]);
+                last[i] = batch.counters[i][n];
+            }
+            query.finish();
+            query.clear();
+        }
+    });
+}
+
+static void insert_histogram(Connection &db, Query &query,
+                             IpHistogram &hist) {
+    log::verbose("chop sample: storing %d sampled addresses", hist.size());
+    db.transact([&]() {
+        hist.for_each([&](uint32_t pid, uint64_t ip, uint64_t count,
+                          const uint64_t *sums) {
+            query.bind(1, pid).bind(2, ip).bind(3, count);
+            for (unsigned i = 0; i < hist.events(); ++i) {
+                query.bind(i + 4, sums[i]);
+            }
+            query.finish();
+            query.clear();
+        });
+    });
+    hist.clear();
+}
+
 static void insert_maps(Connection &db, long pid) {
     auto maps = parse_maps(pid);
     auto query = db.query(SQL_INSERT_MAP);
@@ -118,6 +170,49 @@ void insert_session(Connection &db, long pid, char **argv) {
 }
 
 static void terminate_children() { kill(0, SIGKILL); }
+
+// Batches drained from the ring waiting to be stored
+static const size_t queue_slots = 16;
+
+// Sources waking up the sample loop
+enum { WAKE_SAMPLES, WAKE_EXIT, WAKE_TIMEOUT };
+
+static void watch(int epfd, int fd, int tag) {
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u32 = tag;
+    int ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    check(ret == 0, "chop sample: Unable to watch file descriptor");
+}
+
+// Readable once the process exits, -1 if not supported (Linux < 5.3)
+static int open_pidfd(long pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int open_timeout(double time) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    check(fd != -1, "chop sample: timerfd_create failed");
+    struct itimerspec its = {};
+    long nsec = std::max(1L, (long)(time * 1e9));
+    its.it_value.tv_sec = nsec / 1000000000L;
+    its.it_value.tv_nsec = nsec % 1000000000L;
+    int ret = timerfd_settime(fd, 0, &its, nullptr);
+    check(ret != -1, "chop sample: timerfd_settime failed");
+    return fd;
+}
+
+static double cpu_time() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
 }  // namespace
 
 int run_sample(int argc, char **argv) {
@@ -130,6 +225,10 @@ int run_sample(int argc, char **argv) {
     auto opt_events = getopt("events");
     auto opt_timeout = getopt("timeout");
     auto opt_cpu = getopt("cpu");
+    auto opt_grow = getopt("grow-buffer");
+    auto opt_raw = getopt("raw");
+    auto opt_aggregate = getopt("aggregate");
+    auto opt_flush = getopt("flush");
 
     checkx(opt_db.is_set(), "Database not set");
     checkx(opt_events.is_set(), "Events not set");
@@ -137,10 +236,11 @@ int run_sample(int argc, char **argv) {
     checkx(!opt_pid.is_set() || opt_timeout.is_set(),
            "Option -pid requires -timeout");
     checkx(argc > 0 || opt_pid.is_set(), "No <command> or <pid> provided");
+    checkx(!opt_raw.is_set() || !opt_aggregate.as_bool(),
+           "Options -raw and -aggregate are exclusive");
 
     /* Create/attach to process */
     Process child;
-    std::atomic<bool> running(true);
 
     /* atexit(terminate_children); */
 
@@ -149,8 +249,7 @@ int run_sample(int argc, char **argv) {
     event_list events = Event::parse_all(opt_events.as_string());
 
     setup_database(db, events);
-    auto query = prepare_insert_sample(db, events);
-    std::thread stop_onexit;
+    auto query = prepare_insert(db, events, SQL_INSERT_SAMPLE);
 
     if (opt_cpu.as_int() != -1) {
         /* Pin to a particular CPU */
@@ -193,14 +292,8 @@ int run_sample(int argc, char **argv) {
         log::debug("chop sample: setting events");
         setup_events(events, child.pid());
 
-        child.cont();
-
-        stop_onexit = std::thread([&]() {
-            child.wait(0);
-            running = false;
-            log::debug("chop sample: stop_onexit called");
-        });
-        stop_onexit.detach();
+        // Not traced while sampled, its exit is watched through a pidfd
+        child.detach();
     } else {
         log::debug("chop sample: setting events");
         setup_events(events, child.pid());
@@ -208,41 +301,146 @@ int run_sample(int argc, char **argv) {
         insert_maps(db, child.pid());
     }
 
+    auto &prof = events.front();
+    Sample::value_list last(events.size(), 0);
+
+    // The ring is drained by this thread and the samples stored by the
+    // writer, so that slow commits do not hold up reading the ring
+    // With -raw, samples go to the log, the rest of the session to the
+    // database as usual
+    // With -aggregate, only the samples per address are kept, and stored
+    // every -flush period and at the end
+    std::unique_ptr<IpHistogram> hist;
+    auto hist_query = prepare_insert(db, events, SQL_INSERT_SAMPLE_HIST);
+    double flush = opt_flush.as_time();
+    auto flushed = std::chrono::steady_clock::now();
+    if (opt_aggregate.as_bool()) hist.reset(new IpHistogram(events.size()));
+
+    std::unique_ptr<SampleLogWriter> raw;
+    if (opt_raw.is_set()) {
+        std::vector<std::string> names;
+        for (auto &evt : events) names.push_back(evt.name());
+        raw.reset(new SampleLogWriter(opt_raw.as_string(), names));
+    }
+
+    SampleQueue queue(queue_slots);
+    std::thread writer([&]() {
+        while (SampleBatch *batch = queue.front()) {
+            if (hist) {
+                hist->add(*batch, last);
+                auto now = std::chrono::steady_clock::now();
+                if (flush > 0 &&
+                    std::chrono::duration<double>(now - flushed).count() >=
+                        flush) {
+                    insert_histogram(db, hist_query, *hist);
+                    flushed = now;
+                }
+            } else if (raw) {
+                raw->append(*batch, last);
+            } else {
+                insert_samples(db, query, *batch, last);
+            }
+            queue.pop();
+        }
+        if (hist) insert_histogram(db, hist_query, *hist);
+    });
+
+    long max_pages = opt_grow.as_int();
+    uint64_t lost = 0;
+    auto drain = [&]() {
+        SampleBatch &batch = queue.reserve();
+        batch.clear();
+        if (prof.sample(batch)) queue.commit();
+        if (prof.num_lost() == lost) return;
+        lost = prof.num_lost();
+        if (prof.buf_size() * 2 > max_pages) return;
+        int pages = prof.buf_size() * 2;
+        if (prof.resize_buffer(pages)) {
+            log::info("chop sample: records lost, buffer grown to %d pages",
+                      pages);
+        } else {
+            log::warn("chop sample: records lost, unable to grow buffer to "
+                      "%d pages", pages);
+            max_pages = 0;
+        }
+    };
+
+    // Block until the ring reaches its watermark, the process exits or
+    // the timeout expires, instead of spinning on the ring
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    check(epfd != -1, "chop sample: epoll_create1 failed");
+    watch(epfd, prof.fd(), WAKE_SAMPLES);
+
+    int pid_fd = open_pidfd(child.pid());
+    if (pid_fd != -1) {
+        watch(epfd, pid_fd, WAKE_EXIT);
+    } else {
+        // The event still reports the exit with EPOLLHUP
+        log::verbose("chop sample: pidfd not available: %s", strerror(errno));
+    }
+
+    int timer_fd = -1;
     if (opt_timeout.is_set()) {
         log::debug("chop sample: setting timeout");
-        std::thread stop_ontimeout([&]() {
-            std::this_thread::sleep_for(
-                std::chrono::duration<double>(opt_timeout.as_time()));
-            running = false;
-            log::debug("chop sample: process timed out");
-        });
-        stop_ontimeout.detach();
+        timer_fd = open_timeout(opt_timeout.as_time());
+        watch(epfd, timer_fd, WAKE_TIMEOUT);
     }
 
-    auto &prof = events.front();
-    Sample::value_list last(events.size(), 0);
+    auto start = std::chrono::steady_clock::now();
+    double start_cpu = cpu_time();
 
+    bool running = true;
     while (running) {
-
-        if (prof.poll()) {
-            auto samples = prof.sample();
-
-            db.transact([&]() {
-                for (auto &smp : samples) {
-                    query.bind(1, smp.ip)
-                        .bind(2, smp.pid)
-                        .bind(3, smp.tid)
-                        .bind(4, smp.time);
-                    for (unsigned i = 0; i < smp.data.size(); ++i) {
-                        query.bind(i + 5, smp.data[i] - last[i]);
+        struct epoll_event evs[3];
+        int num = epoll_wait(epfd, evs, 3, -1);
+        if (num == -1 && errno == EINTR) continue;
+        check(num != -1, "chop sample: epoll_wait failed");
+
+        for (int i = 0; i < num; ++i) {
+            switch (evs[i].data.u32) {
+                case WAKE_SAMPLES:
+                    drain();
+                    if (evs[i].events & EPOLLHUP) {
+                        log::debug("chop sample: event hung up");
+                        running = false;
                     }
-                    query.finish();
-                    query.clear();
-                    last = smp.data;
-                }
-            });
+                    break;
+                case WAKE_EXIT:
+                    log::debug("chop sample: process exited");
+                    running = false;
+                    break;
+                case WAKE_TIMEOUT:
+                    log::debug("chop sample: process timed out");
+                    running = false;
+                    break;
+            }
         }
     }
+    // Records below the watermark
+    drain();
+    queue.shutdown();
+    writer.join();
+
+    long wall = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+    long used = (long)((cpu_time() - start_cpu) * 1000);
+    log::info("chop sample: sampler used %d ms of CPU in %d ms (%d%%)",
+              used, wall, wall > 0 ? 100 * used / wall : 0);
+
+    log::info("chop sample: %d batches stored, up to %d of %d queued",
+              queue.committed(), queue.peak(), queue.slots());
+    if (raw) {
+        log::info("chop sample: %d samples written to %s", raw->records(),
+                  opt_raw.as_string());
+    }
+    if (queue.stalls()) {
+        log::info("chop sample: storage held up reading %d times (%d ms)",
+                  queue.stalls(), queue.stall_us() / 1000);
+    }
+
+    if (timer_fd != -1) close(timer_fd);
+    if (pid_fd != -1) close(pid_fd);
+    close(epfd);
 
     if (opt_pid.is_set()) {
         child.abandon();
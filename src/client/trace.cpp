@@ -30,13 +30,47 @@
 #include "support/filesystem.h"
 #include "support/log.h"
 #include "support/options.h"
+#include "trace/statsfmt.h"
 
 #include <climits>
+#include <cstring>
 
 using namespace chopstix;
 
 namespace fs = filesystem;
 
+namespace {
+// Summary of the tracing overhead recorded by the tracing support library
+void print_trace_stats(const std::string &trace_path) {
+    std::string fname = trace_path + "/" CX_STATS_FILE;
+    FILE *fp = fopen(fname.c_str(), "rb");
+    if (fp == NULL) return;
+    cx_stats_header hdr;
+    size_t n = fread(&hdr, sizeof(hdr), 1, fp);
+    if (n != 1 || strncmp(hdr.magic, CX_STATS_MAGIC, sizeof(hdr.magic)) != 0) {
+        log::warn("Invalid tracing statistics in '%s'", fname);
+        fclose(fp);
+        return;
+    }
+    unsigned long unfinished = 0;
+    unsigned long count = std::min<unsigned long>(hdr.traces, hdr.capacity);
+    for (unsigned long i = 0; i < count; ++i) {
+        cx_trace_stats stats;
+        if (fread(&stats, sizeof(stats), 1, fp) != 1) break;
+        if (!(stats.flags & CX_STATS_DONE)) ++unfinished;
+    }
+    fclose(fp);
+
+    const cx_trace_stats &total = hdr.total;
+    log::info("Traces: %d (%d not stopped)", hdr.traces, unfinished);
+    if (hdr.traces == 0) return;
+    log::info("Pages: %d, faults: %d, dumped: %d bytes", total.pages,
+              total.faults, total.bytes);
+    log::info("Time in fault handler: %d us total, %d us per trace",
+              total.handler_ns / 1000, total.handler_ns / 1000 / hdr.traces);
+}
+}  // namespace
+
 int run_trace(int argc, char **argv) {
     PARSE_OPTIONS(trace, argc, argv);
 
@@ -46,8 +80,10 @@ int run_trace(int argc, char **argv) {
 
     CHECK_USAGE(trace,
                 (getopt("begin").is_set() && getopt("end").is_set()) ||
-                (getopt("interval").is_set() && getopt("active").is_set()) ||
-                (getopt("begin").is_set() && getopt("active").is_set()),
+                ((getopt("interval").is_set() || getopt("interval-insts").is_set()) &&
+                 (getopt("active").is_set() || getopt("active-insts").is_set())) ||
+                (getopt("begin").is_set() &&
+                 (getopt("active").is_set() || getopt("active-insts").is_set())),
                 "No tracing parameters (Region of Interest or Temporal-based "
                 "sampling or Region with time)");
 
@@ -58,12 +94,19 @@ int run_trace(int argc, char **argv) {
     trace_options.dump_maps = getopt("maps").as_bool();
     trace_options.dump_info = getopt("info").as_bool();
     trace_options.max_traces = getopt("max-traces").as_int();
+    trace_options.hw_breakpoints = getopt("hw-breakpoints").as_bool();
+    trace_options.in_process = getopt("in-process").as_bool();
+    trace_options.seccomp = getopt("seccomp").as_bool();
+    trace_options.snapshot = getopt("snapshot").as_bool();
     std::string trace_path = getopt("trace-dir").as_string();
     std::string module = getopt("module").as_string();
     double sample_freq = getopt("prob").as_float();
     bool notrace = !getopt("trace").as_bool();
     double tidle = getopt("interval").as_time();
     double tsample = getopt("active").as_time();
+    long insts_idle = getopt("interval-insts").as_int();
+    long insts_sample = getopt("active-insts").as_int();
+    bool windowed = tsample || insts_sample;
     int max_pages = getopt("max-pages").as_int();
     int group_iter = getopt("group").as_int();
     auto addr_begin = getopt("begin").as_hex_vec();
@@ -71,6 +114,56 @@ int run_trace(int argc, char **argv) {
     auto indices = getopt("indices").as_int_vec();
     bool with_region = addr_begin.size() > 0;
 
+    if (trace_options.hw_breakpoints &&
+        (addr_begin.size() > 4 || addr_end.size() > 4)) {
+        log::warn("More than 4 begin/end addresses, hardware breakpoints "
+                  "disabled");
+        trace_options.hw_breakpoints = false;
+    }
+
+    if (trace_options.in_process && (!with_region || windowed)) {
+        log::warn("-in-process needs -begin and -end, ignored");
+        trace_options.in_process = false;
+        // Read by the tracing support library as well
+        setenv("CHOPSTIX_OPT_IN_PROCESS", "no", 1);
+    }
+
+    if (trace_options.snapshot && (!with_region || windowed)) {
+        log::warn("-snapshot needs -begin and -end, ignored");
+        trace_options.snapshot = false;
+        setenv("CHOPSTIX_OPT_SNAPSHOT", "no", 1);
+    }
+
+    if (trace_options.snapshot) {
+        // Perf events are per process, and the copies lack the helper
+        // threads and in-memory state of the tracing support library
+        if (trace_options.hw_breakpoints || trace_options.in_process) {
+            log::warn("-hw-breakpoints and -in-process are not supported "
+                      "with -snapshot, ignored");
+            trace_options.hw_breakpoints = false;
+            trace_options.in_process = false;
+            setenv("CHOPSTIX_OPT_IN_PROCESS", "no", 1);
+        }
+        if (getopt("async-dump").as_bool() || getopt("page-store").as_bool() ||
+            getopt("page-delta").as_int(0) > 0 ||
+            getopt("page-tracking").as_string() == "uffd") {
+            log::warn("-async-dump, -page-store, -page-delta and "
+                      "-page-tracking uffd are not supported with "
+                      "-snapshot, ignored");
+            setenv("CHOPSTIX_OPT_ASYNC_DUMP", "no", 1);
+            setenv("CHOPSTIX_OPT_PAGE_STORE", "no", 1);
+            setenv("CHOPSTIX_OPT_PAGE_DELTA", "0", 1);
+            setenv("CHOPSTIX_OPT_PAGE_TRACKING", "mprotect", 1);
+        }
+    }
+
+    if (trace_options.seccomp && windowed) {
+        // System calls do not stop the process while it runs for -active
+        log::warn("-seccomp is not supported with -active, ignored");
+        trace_options.seccomp = false;
+        setenv("CHOPSTIX_OPT_SECCOMP", "no", 1);
+    }
+
     checkx(!fs::exists(trace_path), "Output trace directory path '%s' already exists!", trace_path);
     fs::mkdir(trace_path);
 
@@ -95,20 +188,37 @@ int run_trace(int argc, char **argv) {
     }
 
     TracerState *prolog, *roi, *epilog;
-    if (with_region && tsample) {
+    if (with_region && windowed) {
         log::info("Tracing for executiong time when reaching the specified region");
         prolog = new TracerRangedTimedPrologState(tracer, addr_begin, tsample);
-        roi = new TracerTimedRegionOfInterestState(tracer, tsample);
+        if (insts_sample) {
+            roi = new TracerInstsRegionOfInterestState(tracer, insts_sample);
+        } else {
+            roi = new TracerTimedRegionOfInterestState(tracer, tsample);
+        }
         epilog = new TracerEpilogState(tracer);
     } else if (with_region) {
         log::info("Tracing specified region of interest");
-        prolog = new TracerRangedPrologState(tracer, addr_begin, addr_end);
+        if (trace_options.in_process) {
+            prolog = new TracerInProcessPrologState(tracer, addr_begin,
+                                                    addr_end);
+        } else {
+            prolog = new TracerRangedPrologState(tracer, addr_begin, addr_end);
+        }
         roi = new TracerRangedRegionOfInterestState(tracer, addr_end);
         epilog = new TracerEpilogState(tracer);
     } else {
         log::info("Tracing specified execution time interval");
-        prolog = new TracerTimedPrologState(tracer, tidle);
-        roi = new TracerTimedRegionOfInterestState(tracer, tsample);
+        if (insts_idle) {
+            prolog = new TracerInstsPrologState(tracer, insts_idle);
+        } else {
+            prolog = new TracerTimedPrologState(tracer, tidle);
+        }
+        if (insts_sample) {
+            roi = new TracerInstsRegionOfInterestState(tracer, insts_sample);
+        } else {
+            roi = new TracerTimedRegionOfInterestState(tracer, tsample);
+        }
         epilog = new TracerEpilogState(tracer);
     }
 
@@ -118,6 +228,8 @@ int run_trace(int argc, char **argv) {
 
     tracer->start(prolog, argc, argv);
 
+    print_trace_stats(trace_path);
+
     if (getopt("gzip").as_bool()) {
         log::info("run_trace:: compressing trace directory");
         char cmd[PATH_MAX];
@@ -0,0 +1,92 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : core/breakpoint.cpp
+ * DESCRIPTION : Breakpoints set in the traced process
+ ******************************************************************************/
+
+#include "breakpoint.h"
+
+#include <algorithm>
+
+using namespace chopstix;
+
+namespace {
+size_t slot_of(long addr, size_t mask) {
+    return ((unsigned long)addr * 0x9e3779b97f4a7c15UL >> 32) & mask;
+}
+}  // namespace
+
+Breakpoint *BreakpointTable::find(long addr) {
+    if (used_ == 0) return nullptr;
+    size_t mask = slots_.size() - 1;
+    for (size_t i = slot_of(addr, mask);; i = (i + 1) & mask) {
+        Breakpoint &bp = slots_[i];
+        if (bp.addr == addr) return &bp;
+        if (bp.addr == 0) return nullptr;
+    }
+}
+
+Breakpoint &BreakpointTable::insert(long addr) {
+    if ((used_ + 1) * 4 > slots_.size() * 3) grow();
+    size_t mask = slots_.size() - 1;
+    for (size_t i = slot_of(addr, mask);; i = (i + 1) & mask) {
+        Breakpoint &bp = slots_[i];
+        if (bp.addr == addr) return bp;
+        if (bp.addr == 0) {
+            bp.addr = addr;
+            ++used_;
+            return bp;
+        }
+    }
+}
+
+Breakpoint *BreakpointTable::find_covering(long addr, long size) {
+    for (long offset = 0; offset <= size; ++offset) {
+        Breakpoint *bp = find(addr - offset);
+        if (bp != nullptr && bp->enabled) return bp;
+    }
+    return nullptr;
+}
+
+std::vector<Breakpoint *> BreakpointTable::sorted() {
+    std::vector<Breakpoint *> all;
+    all.reserve(used_);
+    for (auto &bp : slots_) {
+        if (bp.addr != 0) all.push_back(&bp);
+    }
+    std::sort(all.begin(), all.end(),
+              [](const Breakpoint *a, const Breakpoint *b) {
+                  return a->addr < b->addr;
+              });
+    return all;
+}
+
+void BreakpointTable::grow() {
+    std::vector<Breakpoint> old;
+    old.swap(slots_);
+    slots_.resize(old.empty() ? 64 : old.size() * 2);
+    used_ = 0;
+    for (auto &bp : old) {
+        if (bp.addr != 0) insert(bp.addr) = bp;
+    }
+}
@@ -0,0 +1,78 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : core/breakpoint.h
+ * DESCRIPTION : Breakpoints set in the traced process
+ ******************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace chopstix {
+
+// Passed to the tracing library (mailbox or _breakpoints), so it can
+// restore the original contents in the dumped pages
+typedef struct {
+    long addr;
+    long original_content;
+} BreakpointInformation;
+
+enum BreakpointRole {
+    BREAK_BEGIN = 0x1,  // Region of interest starts here
+    BREAK_END = 0x2,    // Region of interest ends here
+};
+
+struct Breakpoint {
+    long addr = 0;               // Absolute address, 0 for a free slot
+    long original = 0;           // Word at addr before it was first patched
+    bool saved = false;          // Original was read
+    bool enabled = false;        // Currently patched
+    unsigned int roles = 0;      // BreakpointRole bits
+    unsigned long hits = 0;      // Stops at addr
+    unsigned long fixups = 0;    // Stops inside the patched bytes
+    int fd = -1;                 // Hardware breakpoint (perf event), if any
+};
+
+// Breakpoints by absolute address, so that classifying a stop is a single
+// lookup however many region marks there are
+class BreakpointTable {
+  public:
+    Breakpoint *find(long addr);
+    // Existing breakpoint at addr or a new one
+    Breakpoint &insert(long addr);
+    // Enabled breakpoint at addr, or at most size bytes before it
+    Breakpoint *find_covering(long addr, long size);
+
+    // All breakpoints, by address
+    std::vector<Breakpoint *> sorted();
+    size_t size() const { return used_; }
+
+  private:
+    void grow();
+
+    std::vector<Breakpoint> slots_;
+    size_t used_ = 0;
+};
+
+}  // namespace chopstix
@@ -295,8 +295,25 @@ void Event::start_buffering() {
     }
 
     check(buf_ != MAP_FAILED, "Unable to map buffer to memory");
-    pfd_.fd = fd();
-    pfd_.events = POLLIN;
+}
+
+bool Event::resize_buffer(int pages) {
+    checkx(is_buffering(), "Event '%s' is not buffering", name_);
+    checkx(pages > 0 && (pages & (pages - 1)) == 0,
+           "Buffer size must be a power of two pages");
+    // Records still in the ring, and the ones until it is mapped again,
+    // are dropped by the kernel
+    int old_pages = buf_size_;
+    stop_buffering();
+    buf_size_ = pages;
+    buf_ = mmap(nullptr, map_size(), PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd(), 0);
+    if (buf_ != MAP_FAILED) return true;
+    log::debug("Event::resize_buffer: %d pages: %s", pages, strerror(errno));
+    buf_ = nullptr;
+    buf_size_ = old_pages;
+    start_buffering();
+    return false;
 }
 
 void Event::stop_buffering() {
@@ -307,22 +324,6 @@ void Event::stop_buffering() {
     buf_ = nullptr;
 }
 
-bool Event::poll(int timeout) {
-
-    // log::debug("Event poll");
-    if (!is_buffering()) {
-        // log::debug("Event poll : not buffered");
-        return false;
-    }
-    int ret = ::poll(&pfd_, 1, timeout);
-    if (ret < 0 && errno == EINTR) {
-        // log::debug("Event poll : < 0 or EINTR %d", timeout);
-        return false;
-    }
-    // log::debug("Event poll : OK %d", timeout);
-    return true;
-}
-
 void Event::set_buf_size(int pages) {
     checkx(pages > 0, "Attempt to set negative number of pages");
     buf_size_ = pages;
@@ -337,77 +338,14 @@ uint64_t Event::overflow() const {
     return attr_.watermark ? 0 : attr_.wakeup_events;
 }
 
-void Event::read_buffer(void *bf, size_t sz) {
+size_t Event::sample(SampleBatch &batch) {
     check(is_buffering(), "No buffer available");
-    check(avail() >= sz, "No data available");
     static const size_t page_size = sysconf(_SC_PAGESIZE);
-    static const size_t page_mask = buf_size_ * page_size - 1;
-    auto *hdr = page();
-    char *dat = (char *)hdr + page_size;
-    unsigned long tail;
-    size_t part_sz, left_sz;
-
-    // position of tail
-    tail = hdr->data_tail & page_mask;
-
-    // size till end of buffer
-    left_sz = page_mask + 1 - tail;
-    part_sz = std::min(left_sz, sz);
-
-    // copy beginning
-    memcpy(bf, dat + tail, part_sz);
-    // copy wrapped around leftover
-    if (sz > part_sz) {
-        memcpy((char *)bf + part_sz, dat, sz - part_sz);
-    }
-
-    // update header
-    hdr->data_tail += sz;
-}
-
-void Event::skip_buffer(size_t sz) {
-    auto *hdr = page();
-    if ((hdr->data_tail + sz) > hdr->data_head) {
-        sz = hdr->data_head - hdr->data_tail;
-    }
-    hdr->data_tail += sz;
-}
-
-std::vector<Sample> Event::sample() {
-    std::vector<Sample> samples;
-    for (;;) {
-        if (avail() < sizeof(header_type)) {
-            break;
-        }
-
-        header_type hdr;
-        read_buffer(&hdr);
-
-        if (hdr.type == PERF_RECORD_SAMPLE) {
-            Sample smp;
-            read_buffer(&smp, Sample::header_size);
-            uint64_t nr;
-            read_buffer(&nr);
-            smp.data.resize(nr);
-            uint64_t timing[2];
-            read_buffer(&timing, 2 * sizeof(uint64_t));
-            read_buffer(smp.data.data(), nr * sizeof(uint64_t));
-            for (auto &dat : smp.data) {
-                dat *= timing[0] / timing[1];
-            }
-            num_samples_ += 1;
-            samples.push_back(smp);
-        } else if (hdr.type == PERF_RECORD_LOST) {
-            uint64_t lost;
-            skip_buffer(sizeof(uint64_t));  // id;
-            read_buffer(&lost);
-            skip_buffer(hdr.size - sizeof(hdr) - 2 * sizeof(uint64_t));
-            num_lost_ += lost;
-        } else {
-            skip_buffer(hdr.size - sizeof(hdr));
-        }
-    }
-    return samples;
+    uint64_t lost = batch.lost;
+    size_t count = batch.decode(buf_, buf_size_ * page_size);
+    num_samples_ += count;
+    num_lost_ += batch.lost - lost;
+    return count;
 }
 
 std::vector<Event> Event::parse_all(const std::string &desc) {
@@ -31,7 +31,6 @@
 
 // System headers
 #include <perfmon/pfmlib_perf_event.h>
-#include <poll.h>
 
 // Private headers
 #include "sample.h"
@@ -74,10 +73,13 @@ class Event {
 
     void start_buffering();
     void stop_buffering();
+    // Map the buffer again with another size, keeping the old one if the
+    // new one cannot be mapped (e.g. over the perf_event_mlock_kb limit)
+    bool resize_buffer(int pages);
     bool is_buffering() const { return buf_ != nullptr; }
 
-    bool poll(int timeout = 0);
-    std::vector<Sample> sample();
+    // Append the buffered samples to batch, returns how many
+    size_t sample(SampleBatch &batch);
 
     // Helpers
     void set_freq(uint64_t);
@@ -100,15 +102,6 @@ class Event {
     std::string repr() const { return info(); }
     std::string str() const { return name(); }
 
-    template <typename T>
-    void read_buffer(T *bf) {
-        return read_buffer(bf, sizeof(T));
-    }
-    void read_buffer(void *, size_t);
-    void skip_buffer(size_t);
-    page_type *page() const { return (page_type *)buf_; }
-    size_t avail() const { return page()->data_head - page()->data_tail; }
-
     static std::vector<Event> parse_all(const std::string &);
 
   private:
@@ -119,7 +112,6 @@ class Event {
     std::string info_;
 
     void *buf_ = nullptr;
-    struct pollfd pfd_;
 
     uint64_t num_lost_ = 0;
     uint64_t num_samples_ = 0;
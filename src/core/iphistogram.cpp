@@ -0,0 +1,102 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : core/iphistogram.cpp
+ * DESCRIPTION : Samples counted per instruction address while sampling
+ ******************************************************************************/
+
+#include "iphistogram.h"
+
+// Language headers
+#include <algorithm>
+
+// Application headers
+#include "support/check.h"
+
+using namespace chopstix;
+
+IpHistogram::IpHistogram(size_t events, size_t capacity)
+    : events_(events),
+      stride_(SUMS + events),
+      capacity_(capacity),
+      table_(capacity * stride_),
+      deltas_(events) {
+    checkx(capacity > 0 && (capacity & (capacity - 1)) == 0,
+           "IpHistogram:: capacity must be a power of two");
+}
+
+uint64_t *IpHistogram::find(uint32_t pid, uint64_t ip) {
+    // Addresses are mostly aligned and close together, mix the bits first
+    uint64_t key = (ip ^ ((uint64_t)pid << 40)) * 0x9e3779b97f4a7c15ULL;
+    size_t mask = capacity_ - 1;
+    size_t i = (key >> 32) & mask;
+    for (;;) {
+        uint64_t *e = &table_[i * stride_];
+        if (!e[COUNT] || (e[IP] == ip && e[PID] == pid)) return e;
+        i = (i + 1) & mask;
+    }
+}
+
+void IpHistogram::add(uint32_t pid, uint64_t ip, const uint64_t *values) {
+    uint64_t *e = find(pid, ip);
+    if (!e[COUNT]) {
+        // Keep the load under a half so that probes stay short
+        if (2 * (size_ + 1) > capacity_) {
+            grow();
+            e = find(pid, ip);
+        }
+        e[IP] = ip;
+        e[PID] = pid;
+        ++size_;
+    }
+    ++e[COUNT];
+    for (size_t i = 0; i < events_; ++i) e[SUMS + i] += values[i];
+}
+
+void IpHistogram::add(const SampleBatch &batch, Sample::value_list &last) {
+    for (size_t n = 0; n < batch.size(); ++n) {
+        for (size_t i = 0; i < events_; ++i) {
+            uint64_t value =
+                i < batch.counters.size() ? batch.counters[i][n] : 0;
+            deltas_[i] = value - last[i];
+            last[i] = value;
+        }
+        add(batch.pid[n], batch.ip[n], deltas_.data());
+    }
+}
+
+void IpHistogram::clear() {
+    std::fill(table_.begin(), table_.end(), 0);
+    size_ = 0;
+}
+
+void IpHistogram::grow() {
+    std::vector<uint64_t> old(2 * capacity_ * stride_);
+    old.swap(table_);
+    capacity_ *= 2;
+
+    for (const uint64_t *e = old.data(); e != old.data() + old.size();
+         e += stride_) {
+        if (!e[COUNT]) continue;
+        std::copy(e, e + stride_, find((uint32_t)e[PID], e[IP]));
+    }
+}
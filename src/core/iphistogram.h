@@ -0,0 +1,79 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : core/iphistogram.h
+ * DESCRIPTION : Samples counted per instruction address while sampling
+ ******************************************************************************/
+
+#pragma once
+
+// Language headers
+#include <cstdint>
+#include <vector>
+
+// Private headers
+#include "sample.h"
+
+namespace chopstix {
+
+// Open addressing (linear probing) table of (pid, ip) to the number of
+// samples and the sum of each counter over them. It only grows with the
+// number of distinct addresses, not with the samples added.
+class IpHistogram {
+  public:
+    explicit IpHistogram(size_t events, size_t capacity = 4096);
+
+    // Counters are added as the increase over last, which is updated
+    void add(const SampleBatch &batch, Sample::value_list &last);
+    void add(uint32_t pid, uint64_t ip, const uint64_t *values);
+
+    size_t events() const { return events_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    // Drop the entries, keeping the table allocated
+    void clear();
+
+    template <typename Fn>
+    void for_each(Fn fn) const {
+        const uint64_t *end = table_.data() + table_.size();
+        for (const uint64_t *e = table_.data(); e != end; e += stride_) {
+            if (e[COUNT]) fn((uint32_t)e[PID], e[IP], e[COUNT], e + SUMS);
+        }
+    }
+
+  private:
+    // Each entry is ip, pid, number of samples (0 if free), then the sums,
+    // so a lookup touches a single place in memory
+    enum { IP, PID, COUNT, SUMS };
+
+    uint64_t *find(uint32_t pid, uint64_t ip);
+    void grow();
+
+    size_t events_;
+    size_t stride_;
+    size_t capacity_;
+    size_t size_ = 0;
+    std::vector<uint64_t> table_;
+    std::vector<uint64_t> deltas_;
+};
+
+}  // namespace chopstix
@@ -71,8 +71,47 @@ static long search_module(const std::string &module, const std::string &name) {
     return -1;
 }
 
+static bool module_function_at(const std::string &module, long addr,
+                               long base) {
+    if (!fs::exists(module)) return false;
+
+    Popen readelf(fmt::format("readelf -Ws {}", module));
+
+    std::string line;
+    std::stringstream ss;
+    ss << readelf;
+
+    while (std::getline(ss, line)) {
+        auto words = string::splitg(line, " \t");
+        if (words.size() < 8) continue;
+        if (!::isdigit(words[0].front())) continue;
+        if (words[3] != "FUNC") continue;
+        long value = std::stol(words[1], 0, 16);
+        if (value == addr || (base != 0 && value + base == addr)) return true;
+    }
+
+    return false;
+}
+
 }  // namespace
 
+bool Location::function_start(long pid, long addr) {
+    auto maps = parse_maps(pid);
+    for (auto &entry : maps) {
+        if (!entry.contains(addr)) continue;
+        // Symbol values are relative to the first mapping of shared objects
+        long base = 0;
+        for (auto &first : maps) {
+            if (first.path == entry.path && first.offset == 0) {
+                base = first.addr[0];
+                break;
+            }
+        }
+        return module_function_at(entry.path, addr, base);
+    }
+    return false;
+}
+
 long Location::get_addr() {
     return symbol_.empty() ? get_addr_module() : get_addr_symbol();
 }
@@ -63,6 +63,10 @@ class Location {
         return loc;
     }
 
+    // Whether addr is the entry of a function in the symbol table of the
+    // module mapped there
+    static bool function_start(long pid, long addr);
+
   private:
     long get_addr();
     long get_addr_symbol();
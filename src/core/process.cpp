@@ -31,13 +31,29 @@
 #include "support/check.h"
 #include "support/log.h"
 
+#include <elf.h>
+#include <fcntl.h>
+#include <linux/hw_breakpoint.h>
+#include <linux/limits.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/ioctl.h>
 #include <sys/ptrace.h>
 #include <sys/signal.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/personality.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
+#include <algorithm>
 #include <chrono>
+#include <climits>
 #include <thread>
 
 using namespace chopstix;
@@ -50,24 +66,39 @@ Process::~Process() {
         log::debug("Process:: active, wait for it");
         wait(0);
     }
+    close_mem();
+    if (insts_fd_ != -1) close(insts_fd_);
     // checkx(exited() || signaled(), "Process did not exit");
     //
     log::debug("Process:: destructor end");
 }
 
-Process::Process(Process &&other) : pid_(other.pid_), status_(other.status_) {
+Process::Process(Process &&other)
+    : pid_(other.pid_), status_(other.status_), mem_fd_(other.mem_fd_),
+      insts_fd_(other.insts_fd_), options_(other.options_),
+      mainmodule_(other.mainmodule_) {
     log::debug("Process:: constructor start");
     other.pid_ = -1;
     other.status_ = 0;
+    other.mem_fd_ = -1;
+    other.insts_fd_ = -1;
     log::debug("Process:: constructor end");
 }
 
 Process &Process::operator=(Process &&other) {
     if (this != &other) {
+        close_mem();
+        if (insts_fd_ != -1) close(insts_fd_);
         pid_ = other.pid_;
         status_ = other.status_;
+        mem_fd_ = other.mem_fd_;
+        insts_fd_ = other.insts_fd_;
+        options_ = other.options_;
+        mainmodule_ = other.mainmodule_;
         other.pid_ = -1;
         other.status_ = 0;
+        other.mem_fd_ = -1;
+        other.insts_fd_ = -1;
     }
     return *this;
 }
@@ -97,13 +128,21 @@ void Process::exec(char **argv, int argc) {
     pid_ = fork();
     check(pid_ != -1, "Process:: exec: Unable to spawn process");
     if (pid_ != 0) {
-        ptrace(PTRACE_SETOPTIONS, pid_, 0, PTRACE_O_EXITKILL);
+        // Seized rather than PTRACE_TRACEME, so it can be interrupted
+        // (timeout). The child stops itself until then.
+        int status;
+        pid_t pid = waitpid(pid_, &status, WUNTRACED);
+        check(pid == pid_, "Process:: exec: Unable to wait for process");
+        options_ = PTRACE_O_EXITKILL | PTRACE_O_TRACEEXEC;
+        long ret = ptrace(PTRACE_SEIZE, pid_, 0, options_);
+        check(ret != -1, "Process:: exec: ptrace_seize failed");
+        kill(pid_, SIGCONT);
         log::debug("Process:: exec end");
         return;
     }
 
     log::debug("Process:: exec child");
-    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
 
     int persona = personality(0xffffffff);
     if (persona == -1)
@@ -208,6 +247,16 @@ void Process::exec_wait(char **argv, int argc) {
 void Process::ready() {
     log::debug("Process:: ready: start");
     wait(0);
+    // Stops of the seize and the SIGCONT, before the exec
+    while (stopped() && !exec_stop()) {
+        cont();
+        wait(0);
+    }
+    if (exec_stop()) {
+        // Until the exit of execve, as a traced process would stop
+        syscall();
+        wait(0);
+    }
     checkx(stopped(), "Process:: ready: The provided command failed");
     checkx(stop_sig() == SIGTRAP, "Process:: ready: The provided command failed");
     log::debug("Process:: ready: end");
@@ -215,9 +264,11 @@ void Process::ready() {
 
 void Process::abandon() {
     log::debug("Process:: abandon");
+    close_mem();
     pid_ = -1;
 }
 void Process::copy(long pid) {
+    close_mem();
     pid_ = pid;
 }
 
@@ -267,6 +318,15 @@ void Process::waitfor(int which) {
             log::debug("Process:: waitfor: not stopped");
             return;
         }
+        if (seccomp_stop()) {
+            log::debug("Process:: waitfor: filtered system call, continue");
+            cont();
+            continue;
+        }
+        if (event_stop()) {
+            cont_event();
+            continue;
+        }
         int sig = stop_sig();
         log::debug("Process:: waitfor: signal %s received", strsignal(sig));
         if (sig == which) {
@@ -381,18 +441,58 @@ void Process::step(int sig) {
     check(ret != -1, "Process: step: ptrace_singlestep failed");
 }
 
+namespace {
+// Entry point of the main executable, as set up by the kernel (relocated
+// if it is position independent)
+long auxv_entry(long pid) {
+    char fname[PATH_MAX];
+    snprintf(fname, sizeof(fname), "/proc/%ld/auxv", pid);
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) return 0;
+    unsigned long auxv[2];
+    long entry = 0;
+    while (read(fd, auxv, sizeof(auxv)) == sizeof(auxv) && auxv[0] != AT_NULL) {
+        if (auxv[0] == AT_ENTRY) entry = auxv[1];
+    }
+    close(fd);
+    return entry;
+}
+
+// Same, from the ELF header. Position independent executables are relocated
+// to base (start of their first mapping).
+long elf_entry(long pid, long base) {
+    char fname[PATH_MAX];
+    snprintf(fname, sizeof(fname), "/proc/%ld/exe", pid);
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) return 0;
+    Elf64_Ehdr ehdr;
+    ssize_t ret = read(fd, &ehdr, sizeof(ehdr));
+    close(fd);
+    if (ret != sizeof(ehdr) || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
+        return 0;
+    }
+    if (ehdr.e_type == ET_DYN) return base + ehdr.e_entry;
+    return ehdr.e_entry;
+}
+}  // namespace
+
 void Process::step_to_main_module() {
     log::debug("Process:: step to main module: start");
 
     long main_module_start = 0xdeadbeef;
     long main_module_end = 0xdeadbeef;
+    long main_module_base = 0;
     const char* cmodule;
 
     auto maps = parse_maps(pid());
     for (auto &entry : maps) {
-        if(entry.perm[2] != 'x') continue;
         cmodule = basename(entry.path.c_str());
         if(strncmp(mainmodule_, cmodule, strlen(mainmodule_)) != 0) continue;
+        if (main_module_base == 0 && entry.offset == 0) {
+            main_module_base = entry.addr[0];
+        }
+        if(entry.perm[2] != 'x') continue;
         main_module_start = entry.addr[0];
         main_module_end = entry.addr[1];
     }
@@ -403,32 +503,77 @@ void Process::step_to_main_module() {
         check(false, "Process:: step_to_main_module : unable to compute address");
     }
 
-    while(1) {
-        long pc = Arch::current()->get_pc(pid());
-        log::debug("Step: PC = 0x%x", pc);
-        if ((pc >= main_module_start) && (pc < main_module_end)) break;
-        Process::step(0);
+    // Statically linked, or the main module is the loader itself
+    long pc = Arch::current()->get_pc(pid());
+    if ((pc >= main_module_start) && (pc < main_module_end)) {
+        log::debug("Process:: step to main module: already there");
+        return;
+    }
+
+    // Run the dynamic loader at full speed up to a temporary breakpoint at
+    // the entry point, instead of single-stepping through it
+    long entry = auxv_entry(pid());
+    if ((entry < main_module_start) || (entry >= main_module_end)) {
+        log::debug("Process:: step to main module: entry 0x%x from auxv not "
+                   "in main module", entry);
+        entry = elf_entry(pid(), main_module_base);
+    }
+    if ((entry < main_module_start) || (entry >= main_module_end)) {
+        log::warn("Process:: step to main module: unable to find entry "
+                  "point, single-stepping");
+        while(1) {
+            pc = Arch::current()->get_pc(pid());
+            log::debug("Step: PC = 0x%x", pc);
+            if ((pc >= main_module_start) && (pc < main_module_end)) break;
+            Process::step(0);
+            wait(0);
+        }
+        log::debug("Process:: step to main module: end");
+        return;
+    }
+
+    log::debug("Process:: step to main module: entry point at 0x%x", entry);
+    long contents = peek(entry);
+#if defined(CHOPSTIX_X86_SUPPORT)
+    // Zeroed bytes are a valid instruction, use int3
+    poke(entry, (contents & ~0xffL) | 0xcc);
+    int trap = SIGTRAP;
+#else
+    poke(entry, contents & Arch::current()->get_breakpoint_mask());
+    int trap = SIGILL;
+#endif
+    cont(0);
+    while (1) {
         wait(0);
+        checkx(active() && stopped(),
+               "Process:: step to main module: process ended before reaching "
+               "main module");
+        pc = Arch::current()->get_pc(pid());
+        int sig = stop_sig();
+#if defined(CHOPSTIX_X86_SUPPORT)
+        if (sig == trap && pc == entry + 1) {
+            Arch::current()->set_pc(pid(), entry);
+            break;
+        }
+#else
+        if (sig == trap && pc == entry) break;
+#endif
+        // Not ours, deliver it
+        log::debug("Process:: step to main module: signal %s at 0x%x",
+                   strsignal(sig), pc);
+        cont(sig);
     }
+    poke(entry, contents);
     log::debug("Process:: step to main module: end");
 }
 
-void Process::set_break(long addr) {
-    log::debug("Process:: set break: address %x", addr);
-    auto it = breaks_.find(addr);
-    long addr_content = peek(addr);
-    if (it == breaks_.end()) breaks_[addr] = addr_content;
-    long mask = Arch::current()->get_breakpoint_mask();
-    addr_content &= mask;
-    log::debug("Process:: set break: break contents are %x", addr_content);
-    poke(addr, addr_content);
-}
-
-void Process::set_break_size(long addr, long size) {
-    log::debug("Process:: set break size: address %x size %d", addr, size);
-    auto it = breaks_.find(addr);
-    long addr_content = peek(addr);
-    if (it == breaks_.end()) breaks_[addr] = addr_content;
+void Process::set_break_size(Breakpoint &bp, long size) {
+    log::debug("Process:: set break size: address %x size %d", bp.addr, size);
+    long addr_content = peek(bp.addr);
+    if (!bp.saved) {
+        bp.original = addr_content;
+        bp.saved = true;
+    }
     long mask;
 	switch(Arch::current()->get_breakpoint_size()) {
         case BreakpointSize::HALF_WORD:
@@ -444,13 +589,199 @@ void Process::set_break_size(long addr, long size) {
     }
     addr_content &= mask;
     log::debug("Process:: set break size: break contents are %x", addr_content);
-    poke(addr, addr_content);
+    poke(bp.addr, addr_content);
+    bp.enabled = true;
+}
+
+void Process::remove_break(Breakpoint &bp) {
+    log::debug("Process:: remove_break: address %x", bp.addr);
+    if (bp.saved) poke(bp.addr, bp.original);
+    bp.enabled = false;
+}
+
+namespace {
+// Bytes overwritten by a breakpoint: the first ones at its address, for
+// either endianness (see Arch::get_breakpoint_mask)
+size_t breakpoint_bytes() {
+    switch (Arch::current()->get_breakpoint_size()) {
+        case BreakpointSize::HALF_WORD:
+            return 2;
+        case BreakpointSize::WORD:
+            return 4;
+        default:
+        case BreakpointSize::DOUBLE_WORD:
+            return 8;
+    }
+}
+}  // namespace
+
+void Process::set_breaks(const std::vector<Breakpoint *> &bps) {
+    log::debug("Process:: set breaks: %d addresses", bps.size());
+    if (bps.empty()) return;
+    std::vector<long> addrs;
+    addrs.reserve(bps.size());
+    for (auto bp : bps) addrs.push_back(bp->addr);
+    std::vector<long> words(addrs.size());
+    read_words(addrs, words.data());
+    for (size_t i = 0; i < bps.size(); ++i) {
+        // Only what is written below, not neighbouring breakpoints
+        if (!bps[i]->saved) {
+            bps[i]->original = words[i];
+            bps[i]->saved = true;
+        }
+    }
+
+    static const char zeros[sizeof(long)] = {};
+    size_t size = breakpoint_bytes();
+    for (auto addr : addrs) write_mem(addr, zeros, size);
+
+    read_words(addrs, words.data());
+    for (size_t i = 0; i < bps.size(); ++i) {
+        check(memcmp(&words[i], zeros, size) == 0,
+              "Process: set_breaks: wrote wrong data at 0x%x", addrs[i]);
+        bps[i]->enabled = true;
+    }
+}
+
+void Process::remove_breaks(const std::vector<Breakpoint *> &bps) {
+    log::debug("Process:: remove breaks: %d addresses", bps.size());
+    std::vector<Breakpoint *> patched;
+    std::vector<long> addrs;
+    size_t size = breakpoint_bytes();
+    for (auto bp : bps) {
+        bp->enabled = false;
+        if (!bp->saved) continue;
+        write_mem(bp->addr, &bp->original, size);
+        patched.push_back(bp);
+        addrs.push_back(bp->addr);
+    }
+    if (patched.empty()) return;
+
+    std::vector<long> words(addrs.size());
+    read_words(addrs, words.data());
+    for (size_t i = 0; i < patched.size(); ++i) {
+        check(memcmp(&words[i], &patched[i]->original, size) == 0,
+              "Process: remove_breaks: wrote wrong data at 0x%x", addrs[i]);
+    }
+}
+
+// One word per address, with as few process_vm_readv calls as possible.
+// Whatever it can not read (e.g. not supported) is peeked one by one.
+void Process::read_words(const std::vector<long> &addrs, long *words) {
+    size_t done = 0;
+    std::vector<struct iovec> local;
+    std::vector<struct iovec> remote;
+    while (done < addrs.size()) {
+        size_t count = std::min(addrs.size() - done, (size_t)IOV_MAX);
+        local.resize(count);
+        remote.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            local[i].iov_base = &words[done + i];
+            local[i].iov_len = sizeof(long);
+            remote[i].iov_base = (void *)addrs[done + i];
+            remote[i].iov_len = sizeof(long);
+        }
+        ssize_t ret = process_vm_readv(pid_, local.data(), count,
+                                       remote.data(), count, 0);
+        if (ret <= 0) {
+            log::debug("Process:: read_words: process_vm_readv failed: %s",
+                       strerror(errno));
+            break;
+        }
+        // Stops at the first address it can not read
+        done += ret / sizeof(long);
+        if ((size_t)ret < count * sizeof(long)) break;
+    }
+    for (; done < addrs.size(); ++done) words[done] = peek(addrs[done]);
+}
+
+// Write through /proc/<pid>/mem, which (as ptrace) ignores the protection of
+// text pages, unlike process_vm_writev
+void Process::write_mem(long addr, const void *data, size_t size) {
+    if (mem_fd_ == -1) {
+        char fname[PATH_MAX];
+        snprintf(fname, sizeof(fname), "/proc/%d/mem", pid_);
+        mem_fd_ = open(fname, O_RDWR | O_CLOEXEC);
+        if (mem_fd_ == -1) {
+            log::debug("Process:: write_mem: Unable to open %s: %s", fname,
+                       strerror(errno));
+        }
+    }
+    if (mem_fd_ != -1) {
+        ssize_t ret = pwrite(mem_fd_, data, size, addr);
+        check(ret == (ssize_t)size, "Process:: write_mem: Unable to write %d "
+              "bytes at 0x%x", size, addr);
+        return;
+    }
+    long word = peek(addr);
+    memcpy(&word, data, size);
+    poke(addr, word);
+}
+
+void Process::close_mem() {
+    if (mem_fd_ == -1) return;
+    close(mem_fd_);
+    mem_fd_ = -1;
+}
+
+#ifndef TRAP_PERF
+#define TRAP_PERF 6
+#endif
+
+bool Process::set_hw_break(Breakpoint &bp) {
+    log::debug("Process:: set hw break: address %x", bp.addr);
+    if (bp.fd == -1) {
+#ifdef PERF_ATTR_SIZE_VER7
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_BREAKPOINT;
+        attr.size = sizeof(attr);
+        attr.bp_type = HW_BREAKPOINT_X;
+        attr.bp_addr = bp.addr;
+        attr.bp_len = sizeof(long);
+        attr.sample_period = 1;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // Synchronous SIGTRAP to the tracee, seen by us as a signal stop
+        attr.sigtrap = 1;
+        attr.remove_on_exec = 1;
+        attr.sig_data = bp.addr;
+        bp.fd = ::syscall(SYS_perf_event_open, &attr, pid_, -1, -1,
+                          PERF_FLAG_FD_CLOEXEC);
+        if (bp.fd == -1) {
+            log::debug("Process:: set hw break: perf_event_open: %s",
+                       strerror(errno));
+            return false;
+        }
+#else
+        log::debug("Process:: set hw break: no perf_event sigtrap support");
+        return false;
+#endif
+    }
+    check(ioctl(bp.fd, PERF_EVENT_IOC_ENABLE, 0) == 0,
+          "Process:: set hw break: Unable to enable breakpoint at 0x%x",
+          bp.addr);
+    bp.enabled = true;
+    return true;
+}
+
+void Process::remove_hw_break(Breakpoint &bp) {
+    log::debug("Process:: remove hw break: address %x", bp.addr);
+    if (bp.fd != -1) {
+        check(ioctl(bp.fd, PERF_EVENT_IOC_DISABLE, 0) == 0,
+              "Process:: remove hw break: Unable to disable breakpoint at 0x%x",
+              bp.addr);
+    }
+    bp.enabled = false;
 }
 
-void Process::remove_break(long addr) {
-    log::debug("Process:: remove_break: address %x", addr);
-    auto it = breaks_.find(addr);
-    if (it != breaks_.end()) poke(addr, it->second);
+bool Process::hw_break_stop() {
+    if (!stopped() || stop_sig() != SIGTRAP) return false;
+    siginfo_t siginfo;
+    long ret = ptrace(PTRACE_GETSIGINFO, pid_, NULL, &siginfo);
+    check(ret != -1, "Process:: hw_break_stop: ptrace_getsiginfo failed");
+    return siginfo.si_code == TRAP_PERF;
 }
 
 void *Process::get_segfault_addr() {
@@ -476,6 +807,12 @@ void Process::dyn_call(long addr, Arch::regbuf_type &regs, long sp, std::vector<
     cont();
     wait(0);
     while (stopped() || signaled()) {
+        if (seccomp_stop()) {
+            // System calls of the routine not done by the tracing library
+            cont();
+            wait(0);
+            continue;
+        }
         if (stopped()) {
             sig = stop_sig();
         } else {
@@ -539,14 +876,179 @@ void Process::dyn_call(long addr, Arch::regbuf_type &regs, long sp, std::vector<
     log::debug("Process::dyn_call: End");
 }
 
+void Process::trace_seccomp() {
+    log::debug("Process:: trace_seccomp");
+    options_ |= PTRACE_O_TRACESECCOMP;
+    long ret = ptrace(PTRACE_SETOPTIONS, pid_, 0, options_);
+    check(ret != -1, "Process:: trace_seccomp: ptrace_setoptions failed");
+}
+
+bool Process::seccomp_stop() {
+    return stopped() &&
+           (status_ >> 8) == (SIGTRAP | (PTRACE_EVENT_SECCOMP << 8));
+}
+
+long Process::snapshot(long addr, Arch::regbuf_type &regs, long sp) {
+    log::debug("Process::snapshot: Start");
+    long ret = ptrace(PTRACE_SETOPTIONS, pid_, 0, options_ | PTRACE_O_TRACEFORK);
+    check(ret != -1, "Process:: snapshot: ptrace_setoptions failed");
+
+    Arch::current()->read_regs(pid(), regs);
+    Arch::current()->set_pc(pid(), addr);
+    Arch::current()->set_sp(pid(), sp);
+    cont();
+
+    // Same as dyn_call, the routine ends with an illegal instruction
+    long copy = -1;
+    while (active()) {
+        wait(0);
+        checkx(stopped(), "Process::snapshot: Expected stop signal");
+        if ((status_ >> 16) == PTRACE_EVENT_FORK) {
+            unsigned long msg;
+            ret = ptrace(PTRACE_GETEVENTMSG, pid_, 0, &msg);
+            check(ret != -1, "Process:: snapshot: ptrace_geteventmsg failed");
+            copy = msg;
+            cont();
+        } else if (seccomp_stop()) {
+            cont();
+        } else if (stop_sig() == SIGSEGV) {
+            cont(SIGSEGV);
+        } else {
+            break;
+        }
+    }
+    checkx(stopped() && stop_sig() == SIGILL,
+           "Process::snapshot: Expected Illegal Instruction, found %s",
+           strsignal(stop_sig()));
+    Arch::current()->write_regs(pid(), regs);
+    ret = ptrace(PTRACE_SETOPTIONS, pid_, 0, options_);
+    check(ret != -1, "Process:: snapshot: ptrace_setoptions failed");
+
+    if (copy == -1) {
+        log::debug("Process::snapshot: No copy created");
+        return -1;
+    }
+
+    // The copy is seized from its start, stopped before returning from the
+    // fork. It continues from the registers saved above instead.
+    int status;
+    pid_t pid = waitpid(copy, &status, 0);
+    check(pid == copy, "Process:: snapshot: Unable to wait for copy");
+    checkx(WIFSTOPPED(status), "Process:: snapshot: Copy did not stop");
+    Arch::current()->write_regs(copy, regs);
+    ret = ptrace(PTRACE_SETOPTIONS, copy, 0, options_);
+    check(ret != -1, "Process:: snapshot: ptrace_setoptions failed");
+    log::debug("Process::snapshot: End (copy %d)", copy);
+    return copy;
+}
+
+bool Process::exec_stop() {
+    return stopped() && (status_ >> 16) == PTRACE_EVENT_EXEC;
+}
+
+void Process::interrupt() {
+    log::debug("Process:: interrupt");
+    long ret = ptrace(PTRACE_INTERRUPT, pid_, 0, 0);
+    check(ret != -1, "Process:: interrupt: ptrace_interrupt failed");
+}
+
+bool Process::event_stop() {
+    return stopped() && (status_ >> 16) == PTRACE_EVENT_STOP;
+}
+
+void Process::cont_event() {
+    if (stop_sig() == SIGTRAP) {
+        // Stop requested with PTRACE_INTERRUPT
+        cont();
+        return;
+    }
+    // Group stop (e.g. SIGSTOP or SIGTSTP): the child stays stopped until
+    // it gets a SIGCONT, which is then reported as any other signal
+    log::debug("Process:: cont_event: group stop (%s)", strsignal(stop_sig()));
+    status_ = 0;
+    long ret = ptrace(PTRACE_LISTEN, pid_, 0, 0);
+    check(ret != -1, "Process:: cont_event: ptrace_listen failed");
+}
+
+bool Process::pending() {
+    siginfo_t info;
+    info.si_pid = 0;
+    int ret = waitid(P_PID, pid_, &info, WEXITED | WSTOPPED | WNOHANG | WNOWAIT);
+    check(ret != -1, "Process:: pending: waitid failed");
+    return info.si_pid != 0;
+}
+
+void Process::forward() {
+    if (seccomp_stop()) {
+        // Filtered system call
+        cont();
+    } else if (event_stop()) {
+        cont_event();
+    } else {
+        log::debug("Process:: forward: signal %s", strsignal(stop_sig()));
+        cont(stop_sig());
+    }
+}
+
 void Process::timeout(double time) {
     log::debug("Process::timeout: Start");
-    detach();
-    std::this_thread::sleep_for(std::chrono::duration<double>(time));
-    touch();
-    if (!active()) return;
-    attach();
-    waitfor(SIGSTOP);
+    checkx(pid_ != -1, "Process:: timeout: No child process");
+
+    // Stops of the child raise SIGCHLD, read from a signalfd along with the
+    // timer. Its signals are forwarded while it runs.
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    int sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    check(sig_fd != -1, "Process:: timeout: signalfd failed");
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    check(timer_fd != -1, "Process:: timeout: timerfd_create failed");
+
+    struct itimerspec its = {};
+    long nsec = std::max(1L, (long)(time * 1e9));
+    its.it_value.tv_sec = nsec / 1000000000L;
+    its.it_value.tv_nsec = nsec % 1000000000L;
+    int ret = timerfd_settime(timer_fd, 0, &its, nullptr);
+    check(ret != -1, "Process:: timeout: timerfd_settime failed");
+
+    cont();
+    bool running = true;
+    bool expired = false;
+    while (running && !expired) {
+        struct pollfd fds[2] = {{timer_fd, POLLIN, 0}, {sig_fd, POLLIN, 0}};
+        ret = poll(fds, 2, -1);
+        if (ret == -1 && errno == EINTR) continue;
+        check(ret != -1, "Process:: timeout: poll failed");
+
+        struct signalfd_siginfo info;
+        while (read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+        }
+        // SIGCHLD is not queued, check the child itself
+        while (pending()) {
+            wait(0);
+            if (!active() || !stopped()) {
+                running = false;
+                break;
+            }
+            forward();
+        }
+        expired = fds[0].revents & POLLIN;
+    }
+
+    if (running) {
+        // Signals reported before the interrupt are still delivered
+        interrupt();
+        while (active()) {
+            wait(0);
+            if (!stopped() || (event_stop() && stop_sig() == SIGTRAP)) break;
+            forward();
+        }
+    }
+
+    close(timer_fd);
+    close(sig_fd);
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
     log::debug("Process::timeout: End");
 }
 
@@ -569,3 +1071,47 @@ void Process::steps(long steps) {
     }
     log::debug("Process:: steps: end");
 }
+
+void Process::run_insts(long insts) {
+    log::debug("Process::run_insts: Start (%d instructions)", insts);
+    checkx(pid_ != -1, "Process:: run_insts: No child process");
+    if (insts_fd_ == -1) {
+#ifdef PERF_ATTR_SIZE_VER7
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.sample_period = insts;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // Synchronous SIGTRAP on overflow, as the hardware breakpoints
+        attr.sigtrap = 1;
+        attr.remove_on_exec = 1;
+        insts_fd_ = ::syscall(SYS_perf_event_open, &attr, pid_, -1, -1,
+                              PERF_FLAG_FD_CLOEXEC);
+#else
+        errno = ENOTSUP;
+#endif
+        check(insts_fd_ != -1,
+              "Process:: run_insts: Unable to count instructions");
+    }
+    __u64 period = insts;
+    check(ioctl(insts_fd_, PERF_EVENT_IOC_PERIOD, &period) == 0 &&
+          ioctl(insts_fd_, PERF_EVENT_IOC_RESET, 0) == 0 &&
+          ioctl(insts_fd_, PERF_EVENT_IOC_ENABLE, 0) == 0,
+          "Process:: run_insts: Unable to start counting instructions");
+
+    cont();
+    while (active()) {
+        wait(0);
+        if (!stopped()) break;
+        // The counter is the only perf event sending SIGTRAP while it runs
+        if (hw_break_stop()) break;
+        forward();
+    }
+
+    ioctl(insts_fd_, PERF_EVENT_IOC_DISABLE, 0);
+    log::debug("Process::run_insts: End");
+}
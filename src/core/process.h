@@ -28,23 +28,19 @@
 
 #include <functional>
 #include <map>
+#include <vector>
 
 #include "core/arch.h"
+#include "core/breakpoint.h"
 #include "core/location.h"
 
 namespace chopstix {
 
-typedef struct {
-    long addr;
-    long original_content;
-} BreakpointInformation;
-
 class Process {
   public:
     // using callback_fn = std::function<void(void)>;
     // using break_map = std::map<long, long>;
     // using callback_map = std::map<long, callback_fn>;
-    using breakpoint_cache = std::map<long, long>;
 
     Process(int pid = -1) : pid_(pid), status_(0) {}
     ~Process();
@@ -88,13 +84,49 @@ class Process {
     long peek(long addr);
     void poke(long addr, long data);
 
-    void set_break(long addr);
-    void set_break_size(long addr, long size);
-    void remove_break(long addr);
-
+    // Breakpoints are kept by the caller, these save the original contents
+    // on first use and update the enabled state
+    void set_break_size(Breakpoint &bp, long size);
+    void remove_break(Breakpoint &bp);
+
+    // Reading, patching and verifying the whole set in bulk
+    void set_breaks(const std::vector<Breakpoint *> &bps);
+    void remove_breaks(const std::vector<Breakpoint *> &bps);
+
+    // Execute breakpoints in the debug registers (perf_event), which leave
+    // the text untouched and stop with a SIGTRAP. set_hw_break returns false
+    // if the kernel or the hardware cannot provide one.
+    bool set_hw_break(Breakpoint &bp);
+    void remove_hw_break(Breakpoint &bp);
+    bool hw_break_stop();
+
+    // Stop at the system calls a seccomp filter of the child sends to the
+    // tracer (SECCOMP_RET_TRACE). Without it, they fail with ENOSYS.
+    // waitfor continues these stops.
+    void trace_seccomp();
+    bool seccomp_stop();
+
+    // Let the child run for time seconds and interrupt it (PTRACE_INTERRUPT,
+    // it is seized), forwarding its signals meanwhile. Returns with the
+    // child stopped, unless it finished.
     void timeout(double time);
+    void interrupt();
+    bool event_stop();
+    // Resume an event stop: interrupts continue, group stops are kept
+    // (PTRACE_LISTEN) until the child is continued with SIGCONT
+    void cont_event();
+    bool exec_stop();
+
+    // Same as timeout, for insts instructions retired by the child in user
+    // space (perf_event overflow, stopping it with a SIGTRAP). The counter
+    // may overshoot by a few instructions (skid).
+    void run_insts(long insts);
 
     void dyn_call(long addr, Arch::regbuf_type &regs, long sp, std::vector<unsigned long> &args);
+    // Fork the child by calling addr, as dyn_call. The copy is traced as
+    // well and left stopped with the registers the child had before the
+    // call. Returns its pid, or -1 if the fork failed.
+    long snapshot(long addr, Arch::regbuf_type &regs, long sp);
 
     Location find_symbol(const std::string &name) const {
         return Location::Symbol(pid(), name);
@@ -108,20 +140,21 @@ class Process {
         return Location::Module(pid(), name);
     }
 
-    std::vector<BreakpointInformation> get_breakpoint_info() {
-        std::vector<BreakpointInformation> infos;
-        for (auto brk : this->breaks_)
-            infos.push_back({brk.first, brk.second});
-        return infos;
-    }
-
     void *get_segfault_addr();
 
   private:
+    bool pending();
+    void forward();
+    void read_words(const std::vector<long> &addrs, long *words);
+    void write_mem(long addr, const void *data, size_t size);
+    void close_mem();
+
     int pid_;
     int status_;
+    int mem_fd_ = -1;  // /proc/<pid>/mem, opened on first bulk write
+    int insts_fd_ = -1;  // Instruction counter of run_insts
+    long options_ = 0;   // ptrace options set
 
-    breakpoint_cache breaks_;
     char* mainmodule_;
 };
 }  // namespace chopstix
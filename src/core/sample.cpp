@@ -25,6 +25,14 @@
  ******************************************************************************/
 
 #include "sample.h"
+
+// Language headers
+#include <cstring>
+
+// System headers
+#include <linux/perf_event.h>
+#include <unistd.h>
+
 #include "support/check.h"
 
 #include "fmt/format.h"
@@ -32,3 +40,70 @@
 using namespace chopstix;
 
 std::string Sample::repr() const { return fmt::format("<Sample @{:x}>", ip); }
+
+void SampleBatch::clear() {
+    ip.clear();
+    pid.clear();
+    tid.clear();
+    time.clear();
+    for (auto &col : counters) col.clear();
+}
+
+void SampleBatch::append(const uint64_t *rec) {
+    // ip, pid/tid, time, nr, time_enabled, time_running, values[nr]
+    uint32_t ids[2];
+    memcpy(ids, &rec[1], sizeof(ids));
+    ip.push_back(rec[0]);
+    pid.push_back(ids[0]);
+    tid.push_back(ids[1]);
+    time.push_back(rec[2]);
+    uint64_t nr = rec[3];
+    uint64_t scale = rec[5] ? rec[4] / rec[5] : 1;
+    if (counters.size() < nr) {
+        counters.resize(nr);
+        for (auto &col : counters) col.resize(ip.size() - 1);
+    }
+    for (uint64_t i = 0; i < nr; ++i) {
+        counters[i].push_back(rec[6 + i] * scale);
+    }
+}
+
+size_t SampleBatch::decode(void *ring, size_t size) {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    auto *page = (struct perf_event_mmap_page *)ring;
+    const char *data = (const char *)ring + page_size;
+    size_t mask = size - 1;
+    size_t count = 0;
+
+    // Pairs with the kernel writing the records before moving the head
+    uint64_t head = __atomic_load_n(&page->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = page->data_tail;
+
+    // Records are 8-byte aligned, so a header never crosses the end
+    while (head - tail >= sizeof(struct perf_event_header)) {
+        size_t offset = tail & mask;
+        auto *hdr = (const struct perf_event_header *)(data + offset);
+        if (hdr->size == 0 || head - tail < hdr->size) break;
+
+        const uint64_t *rec = (const uint64_t *)(hdr + 1);
+        if (offset + hdr->size > size) {
+            size_t part = size - offset;
+            wrapped_.resize(hdr->size / sizeof(uint64_t));
+            memcpy(wrapped_.data(), data + offset, part);
+            memcpy((char *)wrapped_.data() + part, data, hdr->size - part);
+            rec = wrapped_.data() + 1;
+        }
+
+        if (hdr->type == PERF_RECORD_SAMPLE) {
+            append(rec);
+            ++count;
+        } else if (hdr->type == PERF_RECORD_LOST) {
+            lost += rec[1];  // id, lost
+        }
+        tail += hdr->size;
+    }
+
+    // Done reading the records before the kernel may overwrite them
+    __atomic_store_n(&page->data_tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
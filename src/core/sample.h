@@ -27,6 +27,7 @@
 #pragma once
 
 // Language headers
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -47,4 +48,30 @@ struct Sample {
     std::string repr() const;
 };
 
+// Samples of an event group as columns, reused across reads of the ring
+// so that no memory is allocated once it has grown to the usual batch.
+// Records are expected in the layout Event::setup asks for (ip, pid/tid,
+// time, and a group read with the enabled/running times).
+struct SampleBatch {
+    std::vector<uint64_t> ip;
+    std::vector<uint32_t> pid;
+    std::vector<uint32_t> tid;
+    std::vector<uint64_t> time;
+    std::vector<std::vector<uint64_t>> counters;  // [event][sample]
+    uint64_t lost = 0;                            // Records lost, as reported
+
+    size_t size() const { return ip.size(); }
+    bool empty() const { return ip.empty(); }
+    void clear();
+
+    // Parse the records between the tail and the head of a perf ring
+    // (header page followed by size bytes of data) in place, and release
+    // them to the kernel. Returns the number of samples added.
+    size_t decode(void *ring, size_t size);
+
+  private:
+    void append(const uint64_t *rec);
+    std::vector<uint64_t> wrapped_;  // Copy of a record across the ring end
+};
+
 }  // namespace chopstix
@@ -0,0 +1,186 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : core/samplelog.cpp
+ * DESCRIPTION : Binary sample log (see samplelogfmt.h)
+ ******************************************************************************/
+
+#include "samplelog.h"
+
+// Language headers
+#include <cstring>
+
+// System headers
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Application headers
+#include "support/check.h"
+#include "support/log.h"
+#include "support/safestring.h"
+
+using namespace chopstix;
+
+namespace {
+
+size_t header_size(size_t events) {
+    return sizeof(cx_sample_log_header) + events * CX_SAMPLE_LOG_NAME;
+}
+
+size_t record_size(size_t events) {
+    return sizeof(cx_sample_record) + events * sizeof(uint64_t);
+}
+
+void check_header(const cx_sample_log_header &hdr, const std::string &path) {
+    checkx(strncmp(hdr.magic, CX_SAMPLE_LOG_MAGIC, sizeof(hdr.magic)) == 0,
+           "%s: not a sample log", path);
+    checkx(hdr.version == CX_SAMPLE_LOG_VERSION,
+           "%s: unsupported sample log version %d", path, hdr.version);
+    checkx(hdr.header_size == header_size(hdr.events) &&
+               hdr.record_size == record_size(hdr.events),
+           "%s: corrupted sample log header", path);
+}
+
+}  // namespace
+
+SampleLogWriter::SampleLogWriter(const std::string &path,
+                                 const std::vector<std::string> &events)
+    : events_(events.size()) {
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    check(fd_ != -1, "Unable to open sample log '%s'", path);
+
+    struct stat st;
+    check(fstat(fd_, &st) == 0, "Unable to stat sample log '%s'", path);
+
+    std::vector<char> head(header_size(events_), 0);
+    auto *hdr = (cx_sample_log_header *)head.data();
+    char *names = head.data() + sizeof(*hdr);
+
+    if (st.st_size == 0) {
+        safe_strncpy(hdr->magic, CX_SAMPLE_LOG_MAGIC, sizeof(hdr->magic));
+        hdr->version = CX_SAMPLE_LOG_VERSION;
+        hdr->events = events_;
+        hdr->header_size = head.size();
+        hdr->record_size = record_size(events_);
+        for (size_t i = 0; i < events_; ++i) {
+            checkx(events[i].size() < CX_SAMPLE_LOG_NAME,
+                   "Event name too long for the sample log: %s", events[i]);
+            strcpy(names + i * CX_SAMPLE_LOG_NAME, events[i].c_str());
+        }
+        ssize_t ret = write(fd_, head.data(), head.size());
+        check(ret == (ssize_t)head.size(), "Unable to write sample log '%s'",
+              path);
+        return;
+    }
+
+    // Appending to a previous session
+    ssize_t ret = pread(fd_, head.data(), sizeof(*hdr), 0);
+    checkx(ret == sizeof(*hdr), "%s: not a sample log", path);
+    check_header(*hdr, path);
+    checkx(hdr->events == events_,
+           "%s: sample log written for other events", path);
+    ret = pread(fd_, names, head.size() - sizeof(*hdr), sizeof(*hdr));
+    check(ret == (ssize_t)(head.size() - sizeof(*hdr)),
+          "Unable to read sample log '%s'", path);
+    for (size_t i = 0; i < events_; ++i) {
+        checkx(events[i] == names + i * CX_SAMPLE_LOG_NAME,
+               "%s: sample log written for other events", path);
+    }
+
+    // Drop a record cut short (e.g. chop was killed)
+    size_t tail = (st.st_size - head.size()) % hdr->record_size;
+    if (tail) {
+        log::warn("%s: dropping an incomplete record", path);
+        check(ftruncate(fd_, st.st_size - tail) == 0,
+              "Unable to truncate sample log '%s'", path);
+    }
+}
+
+SampleLogWriter::~SampleLogWriter() {
+    if (fd_ != -1) close(fd_);
+}
+
+void SampleLogWriter::append(const SampleBatch &batch,
+                             Sample::value_list &last) {
+    size_t words = record_size(events_) / sizeof(uint64_t);
+    buf_.resize(batch.size() * words);
+
+    uint64_t *rec = buf_.data();
+    for (size_t n = 0; n < batch.size(); ++n, rec += words) {
+        rec[0] = batch.ip[n];
+        uint32_t ids[2] = {batch.pid[n], batch.tid[n]};
+        memcpy(&rec[1], ids, sizeof(ids));
+        rec[2] = batch.time[n];
+        for (size_t i = 0; i < events_; ++i) {
+            uint64_t value = i < batch.counters.size() ? batch.counters[i][n] : 0;
+            rec[3 + i] = value - last[i];
+            last[i] = value;
+        }
+    }
+
+    const char *data = (const char *)buf_.data();
+    size_t left = buf_.size() * sizeof(uint64_t);
+    while (left > 0) {
+        ssize_t ret = write(fd_, data, left);
+        if (ret == -1 && errno == EINTR) continue;
+        check(ret > 0, "Unable to write sample log");
+        data += ret;
+        left -= ret;
+    }
+    records_ += batch.size();
+}
+
+SampleLogReader::SampleLogReader(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    check(fd != -1, "Unable to open sample log '%s'", path);
+    struct stat st;
+    check(fstat(fd, &st) == 0, "Unable to stat sample log '%s'", path);
+    checkx((size_t)st.st_size >= sizeof(cx_sample_log_header),
+           "%s: not a sample log", path);
+
+    map_size_ = st.st_size;
+    map_ = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    check(map_ != MAP_FAILED, "Unable to map sample log '%s'", path);
+    madvise(map_, map_size_, MADV_SEQUENTIAL);
+
+    auto *hdr = (const cx_sample_log_header *)map_;
+    check_header(*hdr, path);
+    checkx(map_size_ >= hdr->header_size, "%s: truncated sample log", path);
+
+    const char *names = (const char *)map_ + sizeof(*hdr);
+    for (size_t i = 0; i < hdr->events; ++i) {
+        const char *name = names + i * CX_SAMPLE_LOG_NAME;
+        events_.emplace_back(name, strnlen(name, CX_SAMPLE_LOG_NAME));
+    }
+
+    records_ = (const char *)map_ + hdr->header_size;
+    record_size_ = hdr->record_size;
+    // A record cut short is ignored
+    size_ = (map_size_ - hdr->header_size) / record_size_;
+}
+
+SampleLogReader::~SampleLogReader() {
+    if (map_ != nullptr && map_ != MAP_FAILED) munmap(map_, map_size_);
+}
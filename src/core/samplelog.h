@@ -0,0 +1,90 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : core/samplelog.h
+ * DESCRIPTION : Binary sample log (see samplelogfmt.h)
+ ******************************************************************************/
+
+#pragma once
+
+// Language headers
+#include <string>
+#include <vector>
+
+// Private headers
+#include "sample.h"
+#include "samplelogfmt.h"
+
+namespace chopstix {
+
+// Appends samples to a log, creating it if needed. An existing log must
+// have been written for the same events.
+class SampleLogWriter {
+  public:
+    SampleLogWriter(const std::string &path,
+                    const std::vector<std::string> &events);
+    ~SampleLogWriter();
+
+    SampleLogWriter(const SampleLogWriter &) = delete;
+    SampleLogWriter &operator=(const SampleLogWriter &) = delete;
+
+    // Counters are stored as the increase over last, which is updated
+    void append(const SampleBatch &batch, Sample::value_list &last);
+
+    uint64_t records() const { return records_; }
+
+  private:
+    int fd_ = -1;
+    size_t events_;
+    std::vector<uint64_t> buf_;  // Records of the batch being written
+    uint64_t records_ = 0;
+};
+
+// Maps a log read-only. Records are accessed in place.
+class SampleLogReader {
+  public:
+    explicit SampleLogReader(const std::string &path);
+    ~SampleLogReader();
+
+    SampleLogReader(const SampleLogReader &) = delete;
+    SampleLogReader &operator=(const SampleLogReader &) = delete;
+
+    const std::vector<std::string> &events() const { return events_; }
+    size_t size() const { return size_; }
+
+    const cx_sample_record &record(size_t n) const {
+        return *(const cx_sample_record *)(records_ + n * record_size_);
+    }
+    const uint64_t *values(size_t n) const {
+        return (const uint64_t *)(&record(n) + 1);
+    }
+
+  private:
+    void *map_ = nullptr;
+    size_t map_size_ = 0;
+    const char *records_ = nullptr;
+    size_t record_size_ = 0;
+    size_t size_ = 0;
+    std::vector<std::string> events_;
+};
+
+}  // namespace chopstix
@@ -0,0 +1,57 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : core/samplelogfmt.h
+ * DESCRIPTION : Layout of the binary sample log written by 'chop sample -raw'
+ *               and read by 'chop count -raw'. Records have a fixed size
+ *               and are appended as they are drained, so the log can be
+ *               mapped and scanned in place. Plain C for other readers.
+ *
+ *               header, 'events' names of CX_SAMPLE_LOG_NAME bytes (NUL
+ *               terminated), then records of 'record_size' bytes each: a
+ *               cx_sample_record followed by one uint64_t per event (the
+ *               increase of its counter since the previous sample, as in
+ *               the sample table).
+ ******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+#define CX_SAMPLE_LOG_MAGIC "CXSMPL"
+#define CX_SAMPLE_LOG_VERSION 1
+#define CX_SAMPLE_LOG_NAME 64
+
+struct cx_sample_log_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t events;       // Counters per record
+    uint32_t header_size;  // Bytes before the first record
+    uint32_t record_size;
+};
+
+struct cx_sample_record {
+    uint64_t ip;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t time;
+};
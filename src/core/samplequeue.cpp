@@ -0,0 +1,116 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : core/samplequeue.cpp
+ * DESCRIPTION : Bounded queue of sample batches between the thread draining
+ *               the perf ring and the one storing them
+ ******************************************************************************/
+
+#include "samplequeue.h"
+
+// Language headers
+#include <chrono>
+
+// System headers
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Application headers
+#include "support/check.h"
+
+using namespace chopstix;
+
+SampleQueue::SampleQueue(size_t slots) : batches_(slots) {
+    checkx(slots > 0, "SampleQueue:: queue needs at least one slot");
+}
+
+SampleBatch &SampleQueue::reserve() {
+    unsigned long head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= slots()) {
+        // Queue full: the ring is not drained until the consumer catches up
+        ++stalls_;
+        auto start = std::chrono::steady_clock::now();
+        do {
+            sleep(freed_, tail_, head - slots());
+        } while (head - tail_.load(std::memory_order_acquire) >= slots());
+        stall_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    }
+    return batches_[head % slots()];
+}
+
+void SampleQueue::commit() {
+    unsigned long head = head_.load(std::memory_order_relaxed) + 1;
+    head_.store(head, std::memory_order_seq_cst);
+    wake(filled_);
+    ++committed_;
+    unsigned long used = head - tail_.load(std::memory_order_relaxed);
+    if (used > peak_) peak_ = used;
+}
+
+SampleBatch *SampleQueue::front() {
+    unsigned long tail = tail_.load(std::memory_order_relaxed);
+    while (tail == head_.load(std::memory_order_acquire)) {
+        if (stop_.load(std::memory_order_acquire)) {
+            // Batches committed before the shut down are still consumed
+            if (tail == head_.load(std::memory_order_acquire)) return nullptr;
+            break;
+        }
+        sleep(filled_, head_, tail);
+    }
+    return &batches_[tail % slots()];
+}
+
+void SampleQueue::pop() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_seq_cst);
+    wake(freed_);
+}
+
+void SampleQueue::shutdown() {
+    stop_.store(true, std::memory_order_seq_cst);
+    wake(filled_);
+}
+
+void SampleQueue::sleep(std::atomic<int> &signal,
+                        const std::atomic<unsigned long> &index,
+                        unsigned long value) {
+    // Reset the signal before the last look at the index: either the other
+    // side sees the reset and wakes us, or we see its update and return
+    signal.store(0, std::memory_order_seq_cst);
+    if (index.load(std::memory_order_seq_cst) != value ||
+        stop_.load(std::memory_order_seq_cst)) {
+        return;
+    }
+    // Returns straight away if a wake up was posted after the reset
+    syscall(SYS_futex, reinterpret_cast<int *>(&signal), FUTEX_WAIT_PRIVATE,
+            0, nullptr, nullptr, 0);
+}
+
+void SampleQueue::wake(std::atomic<int> &signal) {
+    if (signal.exchange(1, std::memory_order_seq_cst) == 0) {
+        syscall(SYS_futex, reinterpret_cast<int *>(&signal),
+                FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+}
@@ -0,0 +1,88 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : core/samplequeue.h
+ * DESCRIPTION : Bounded queue of sample batches between the thread draining
+ *               the perf ring and the one storing them
+ ******************************************************************************/
+
+#pragma once
+
+// Language headers
+#include <atomic>
+#include <vector>
+
+// Private headers
+#include "sample.h"
+
+namespace chopstix {
+
+// Single-producer/single-consumer ring of SampleBatch slots, allocated once
+// and reused. The producer waits while the ring is full, which is reported
+// in the statistics as backpressure from the consumer.
+class SampleQueue {
+  public:
+    explicit SampleQueue(size_t slots);
+
+    SampleQueue(const SampleQueue &) = delete;
+    SampleQueue &operator=(const SampleQueue &) = delete;
+
+    // Producer side. Returns the next free batch, published on commit.
+    SampleBatch &reserve();
+    void commit();
+
+    // Consumer side. Returns the oldest batch, waiting for one, or nullptr
+    // once the queue is shut down and empty. The batch is freed on pop.
+    SampleBatch *front();
+    void pop();
+
+    void shutdown();
+
+    size_t slots() const { return batches_.size(); }
+    unsigned long committed() const { return committed_; }
+    unsigned long stalls() const { return stalls_; }
+    unsigned long stall_us() const { return stall_us_; }
+    unsigned long peak() const { return peak_; }
+
+  private:
+    // Sleeps until index is no longer value or the queue is shut down
+    void sleep(std::atomic<int> &signal,
+               const std::atomic<unsigned long> &index, unsigned long value);
+    static void wake(std::atomic<int> &signal);
+
+    std::vector<SampleBatch> batches_;
+
+    // head_ is only written by the producer, tail_ by the consumer
+    alignas(64) std::atomic<unsigned long> head_{0};
+    alignas(64) std::atomic<unsigned long> tail_{0};
+    alignas(64) std::atomic<int> filled_{0};  // Wakes the consumer
+    alignas(64) std::atomic<int> freed_{0};   // Wakes the producer
+    std::atomic<bool> stop_{false};
+
+    // Producer statistics
+    unsigned long committed_ = 0;
+    unsigned long stalls_ = 0;
+    unsigned long stall_us_ = 0;
+    unsigned long peak_ = 0;
+};
+
+}  // namespace chopstix
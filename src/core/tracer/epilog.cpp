@@ -9,6 +9,7 @@ namespace chopstix {
 void TracerEpilogState::execute(Process &child) {
     log::debug("TracerEpilogState:: execute start");
     tracer->stop_trace();
+    tracer->drop_snapshot();
     change_state();
     log::debug("TracerEpilogState:: execute end");
 }
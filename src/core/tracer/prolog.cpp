@@ -40,63 +40,126 @@ void TracerTimedPrologState::execute(Process &child) {
     log::debug("TracerTimedProlog:: execute end");
 }
 
+void TracerInstsPrologState::execute(Process &child) {
+    log::debug("TracerInstsProlog:: execute start");
+    log::verbose("TracerInstsProlog:: wait interval (%d instructions)", insts);
+    child.run_insts(insts);
+    if (!check_finished(child) && tracer->should_trace()) {
+        change_state();
+    }
+    log::debug("TracerInstsProlog:: execute end");
+}
+
 void TracerRangedPrologState::on_state_start(Process &child) {
     log::debug("TracerRangedProlog:: on_start_start: setting start break points of region");
-    tracer->set_breakpoint(start, true);
+    tracer->set_breakpoint(start, true, BREAK_BEGIN);
 }
 
 void TracerRangedPrologState::on_state_finish(Process &child) {
     log::debug("TracerRangedProlog:: on_state_finish: removing start break points of region");
-    tracer->set_breakpoint(start, false);
+    tracer->set_breakpoint(start, false, BREAK_BEGIN);
 }
 
 void TracerRangedPrologState::execute(Process &child) {
-    log::debug("TracerRangedProlog:: execute: continuing until Illegal instruction");
+    if (skip_region) {
+        // Back from the snapshot, still at the begin of the region
+        log::verbose("TracerRangedProlog:: execute: region traced in a snapshot, skip");
+        skip_region = false;
+        tracer->set_breakpoint(start, false, BREAK_BEGIN);
+        tracer->set_breakpoint(end, true, BREAK_END);
+        child.cont();
+        child.waitfor(tracer->breakpoint_signal());
+        tracer->set_breakpoint(end, false, BREAK_END);
+        tracer->set_breakpoint(start, true, BREAK_BEGIN);
+        return;
+    }
+    log::debug("TracerRangedProlog:: execute: continuing until breakpoint");
     child.cont();
-    child.waitfor(SIGILL);
+    child.waitfor(tracer->breakpoint_signal());
     if (!check_finished(child)) {
         long cur_pc = Arch::current()->get_pc(child.pid());
         log::debug("TracerRangedProlog:: Stop at PC: %x", cur_pc);
 
-        if (tracer->check_breakpoint(start)) {
+        if (tracer->check_breakpoint(BREAK_BEGIN)) {
             if (tracer->should_trace()) {
                 log::verbose("TracerRangedProlog:: execute: start region hit, start tracing");
+                skip_region = tracer->take_snapshot();
                 change_state();
                 log::debug("TracerRangedProlog:: Restarting at PC: %x" , cur_pc);
-                child.syscall(0);
+                resume(child);
             } else {
                 log::verbose("TracerRangedProlog:: execute: start region hit, skip");
-                tracer->set_breakpoint(start, false);
-                tracer->set_breakpoint(end, true);
+                tracer->set_breakpoint(start, false, BREAK_BEGIN);
+                tracer->set_breakpoint(end, true, BREAK_END);
                 child.cont();
-                child.waitfor(SIGILL);
-                tracer->set_breakpoint(end, false);
-                tracer->set_breakpoint(start, true);
+                child.waitfor(tracer->breakpoint_signal());
+                tracer->set_breakpoint(end, false, BREAK_END);
+                tracer->set_breakpoint(start, true, BREAK_BEGIN);
             }
         } else {
             // Restore contents and continue executing
-            tracer->fix_breakpoint(start);
+            tracer->fix_breakpoint(BREAK_BEGIN);
             child.cont();
-            child.waitfor(SIGILL);
+            child.waitfor(tracer->breakpoint_signal());
         }
     }
     log::debug("TracerRangedProlog:: execute end");
 }
 
+void TracerInProcessPrologState::on_state_start(Process &child) {
+    if (!tracer->trampolines_ready()) {
+        TracerRangedPrologState::on_state_start(child);
+        return;
+    }
+    log::debug("TracerInProcessProlog:: on_start_start: arming trampolines");
+    tracer->arm_trampolines(true);
+}
+
+void TracerInProcessPrologState::on_state_finish(Process &child) {
+    if (!tracer->trampolines_ready()) {
+        TracerRangedPrologState::on_state_finish(child);
+        return;
+    }
+    log::debug("TracerInProcessProlog:: on_state_finish: disarming trampolines");
+    tracer->arm_trampolines(false);
+}
+
+void TracerInProcessPrologState::execute(Process &child) {
+    if (!tracer->trampolines_ready()) {
+        TracerRangedPrologState::execute(child);
+        return;
+    }
+    log::debug("TracerInProcessProlog:: execute: continuing until invocation to trace");
+    child.cont(pending_signal);
+    pending_signal = 0;
+    child.waitfor(SIGILL);
+    if (!check_finished(child)) {
+        if (tracer->trampoline_hit()) {
+            log::verbose("TracerInProcessProlog:: execute: start region hit, start tracing");
+            change_state();
+            resume(child);
+        } else {
+            // Not raised by a trampoline, deliver it on the next continue
+            pending_signal = SIGILL;
+        }
+    }
+    log::debug("TracerInProcessProlog:: execute end");
+}
+
 void TracerRangedTimedPrologState::on_state_start(Process &child) {
     log::debug("TracerRangedTimedProlog:: on_start_start: setting start break points of region");
-    tracer->set_breakpoint(start, true);
+    tracer->set_breakpoint(start, true, BREAK_BEGIN);
 }
 
 void TracerRangedTimedPrologState::on_state_finish(Process &child) {
     log::debug("TracerRangedTimedProlog:: on_state_finish: removing start break points of region");
-    tracer->set_breakpoint(start, false);
+    tracer->set_breakpoint(start, false, BREAK_BEGIN);
 }
 
 void TracerRangedTimedPrologState::execute(Process &child) {
-    log::debug("TracerRangedTimedProlog:: execute: continuing until Illegal instruction");
+    log::debug("TracerRangedTimedProlog:: execute: continuing until breakpoint");
     child.cont();
-    child.waitfor(SIGILL);
+    child.waitfor(tracer->breakpoint_signal());
     if (!check_finished(child)) {
         long cur_pc = Arch::current()->get_pc(child.pid());
         log::debug("TracerRangedTimedProlog:: Stop at PC: %x", cur_pc);
@@ -107,11 +170,11 @@ void TracerRangedTimedPrologState::execute(Process &child) {
             log::debug("TracerRangedTimedProlog:: Restarting at PC: %x" , cur_pc);
         } else {
             log::verbose("TracerRangedTimedProlog:: execute: start region hit, skip");
-            tracer->set_breakpoint(start, false);
+            tracer->set_breakpoint(start, false, BREAK_BEGIN);
             child.steps(10);
-            tracer->set_breakpoint(start, true);
+            tracer->set_breakpoint(start, true, BREAK_BEGIN);
             child.cont();
-            child.waitfor(SIGILL);
+            child.waitfor(tracer->breakpoint_signal());
         }
     }
     log::debug("TracerRangedTimedProlog:: execute end");
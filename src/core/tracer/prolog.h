@@ -26,6 +26,18 @@ class TracerTimedPrologState : public TracerPrologState {
     double time;
 };
 
+// Same as the timed prolog, in instructions retired by the child
+// (-interval-insts)
+class TracerInstsPrologState : public TracerPrologState {
+  public:
+    TracerInstsPrologState(Tracer *tracer, long insts) :
+        TracerPrologState(tracer), insts(insts) {}
+
+    virtual void execute(Process &child);
+  private:
+    long insts;
+};
+
 class TracerRangedPrologState : public TracerPrologState {
   public:
     TracerRangedPrologState(Tracer *tracer,
@@ -39,6 +51,26 @@ class TracerRangedPrologState : public TracerPrologState {
   private:
     std::vector<long> &start;
     std::vector<long> &end;
+    // The region was traced in a snapshot (-snapshot), the child still has
+    // to run it
+    bool skip_region = false;
+};
+
+// Same as the ranged prolog, but the begin addresses are detected by the
+// child itself (-in-process) and it only stops at the invocations to trace.
+// Uses breakpoints if the trampolines are not available.
+class TracerInProcessPrologState : public TracerRangedPrologState {
+  public:
+    TracerInProcessPrologState(Tracer *tracer,
+                               std::vector<long> &start,
+                               std::vector<long> &end) :
+       TracerRangedPrologState(tracer, start, end) {}
+
+    virtual void execute(Process &child);
+    virtual void on_state_start(Process &child);
+    virtual void on_state_finish(Process &child);
+  private:
+    int pending_signal = 0;
 };
 
 class TracerRangedTimedPrologState : public TracerPrologState {
@@ -57,9 +57,10 @@ void TracerRegionOfInterestState::handle_signal(Process &child, int signal) {
                    (long) child.get_segfault_addr());
         tracer->save_page();
         log::debug("TracerRegionOfInterestState:: forward signal SIGSEGV");
-        child.syscall(signal);
-    } else if (signal == SIGTRAP) {
-        // enter syscall
+        resume(child, signal);
+    } else if (signal == SIGTRAP &&
+               (!tracer->syscall_filter() || child.seccomp_stop())) {
+        // enter syscall (or filtered syscall, not entered yet)
         log::debug("TracerRegionOfInterestState:: catching signal SIGTRAP");
         auto tmp_regs = Arch::current()->create_regs();
         Arch::current()->read_regs(child.pid(), tmp_regs);
@@ -111,7 +112,7 @@ void TracerRegionOfInterestState::handle_signal(Process &child, int signal) {
                 log::debug("TracerRegionOfInterestState:: in support / in_vdso");
             }
             // continue
-            child.syscall(0);
+            resume(child);
         } else {
             log::debug("TracerRegionOfInterestState:: child exited with %d",
                          child.exit_status());
@@ -121,7 +122,7 @@ void TracerRegionOfInterestState::handle_signal(Process &child, int signal) {
     } else {
         // forward signal
         log::debug("TracerRegionOfInterestState:: forward signal: %d", signal);
-        child.syscall(signal);
+        resume(child, signal);
     }
 }
 
@@ -130,27 +131,27 @@ void TracerRangedRegionOfInterestState::on_state_start(Process &child) {
     // dumped
     //
     log::debug("TracerRangedRegionOfInterestState:: on_state_start start");
-    tracer->set_breakpoint(end, true);
+    tracer->set_breakpoint(end, true, BREAK_END);
     TracerRegionOfInterestState::on_state_start(child);
     log::debug("TracerRangedRegionOfInterestState:: on_state_start end");
 }
 
 void TracerRangedRegionOfInterestState::on_state_finish(Process &child) {
     log::debug("TracerRangedRegionOfInterestState:: removing end break point of region");
-    tracer->set_breakpoint(end, false);
+    tracer->set_breakpoint(end, false, BREAK_END);
 }
 
 void TracerRangedRegionOfInterestState::handle_signal(Process &child,
                                                       int signal) {
 
     log::debug("TracerRangedRegionOfInterestState:: handle signal start");
-    if (signal == SIGILL) {
-        if (tracer->check_breakpoint(end)) {
+    if (tracer->breakpoint_stop(signal)) {
+        if (tracer->check_breakpoint(BREAK_END)) {
             change_state();
         } else {
             // Restore contents and continue executing
-            tracer->fix_breakpoint(end);
-            child.syscall(0);
+            tracer->fix_breakpoint(BREAK_END);
+            resume(child);
         }
     } else {
         TracerRegionOfInterestState::handle_signal(child, signal);
@@ -161,14 +162,21 @@ void TracerRangedRegionOfInterestState::handle_signal(Process &child,
 void TracerTimedRegionOfInterestState::execute(Process &child) {
     log::verbose("TracerTimedRegionOfInterestState:: execute: tracing for %s seconds",
                  std::to_string(time));
-    //The following timeout performs a wait, but it is for a specific signal
-    //(SIGSTOP). This potentially means that we might miss out on some other
-    //signals while we do so (e.g. syscalls, etc). An improvement might
-    //be removing the internal wait in Process::timeout?
+    // The child keeps running traced, its signals (e.g. the page faults
+    // handled by the tracing library) are forwarded until it is interrupted
     child.timeout(time);
     change_state();
     log::debug("TracerTimedRegionOfInterestState:: execute: end tracing for %s seconds",
                  std::to_string(time));
 }
 
+void TracerInstsRegionOfInterestState::execute(Process &child) {
+    log::verbose("TracerInstsRegionOfInterestState:: execute: tracing for %d instructions",
+                 insts);
+    child.run_insts(insts);
+    change_state();
+    log::debug("TracerInstsRegionOfInterestState:: execute: end tracing for %d instructions",
+                 insts);
+}
+
 }
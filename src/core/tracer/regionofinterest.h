@@ -39,4 +39,16 @@ class TracerTimedRegionOfInterestState : public TracerRegionOfInterestState {
     double time;
 };
 
+// Same as the timed region, in instructions retired by the child
+// (-active-insts)
+class TracerInstsRegionOfInterestState : public TracerRegionOfInterestState {
+  public:
+    TracerInstsRegionOfInterestState(Tracer *tracer, long insts) :
+        TracerRegionOfInterestState(tracer), insts(insts) {}
+
+    virtual void execute(Process &child);
+  private:
+    long insts;
+};
+
 }
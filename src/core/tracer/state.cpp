@@ -1,5 +1,6 @@
 #include "state.h"
 #include "core/tracer/tracer.h"
+#include "core/process.h"
 
 namespace chopstix {
 
@@ -9,4 +10,12 @@ void TracerState::change_state() {
     log::debug("TracerState:: change_state end");
 }
 
+void TracerState::resume(Process &child, int sig) {
+    if (tracer->syscall_filter()) {
+        child.cont(sig);
+    } else {
+        child.syscall(sig);
+    }
+}
+
 }
@@ -16,6 +16,9 @@ public:
     virtual void on_state_finish(Process &child) {}
 protected:
     void change_state();
+    // Continue the child, stopping at its system calls (only the filtered
+    // ones with -seccomp)
+    void resume(Process &child, int sig = 0);
 
     Tracer *tracer;
     TracerState *next_state;
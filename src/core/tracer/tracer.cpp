@@ -5,10 +5,17 @@
 #include "../../support/check.h"
 #include "../../support/log.h"
 #include "../../support/filesystem.h"
+#include "../../support/safestring.h"
+#include "../../trace/mailboxfmt.h"
+#include "../../trace/trampfmt.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
+#include <linux/futex.h>
 #include <linux/limits.h>
 #include <sys/mman.h>
 #include <sys/ptrace.h>
@@ -57,12 +64,18 @@ Tracer::Tracer(std::string module, std::string trace_path, bool dryrun, TraceOpt
     this->module = module;
     tracing_enabled = !dryrun;
     this->trace_options = trace_options;
+    hw_breakpoints = trace_options.hw_breakpoints;
     log::debug("Tracer:: contructor end");
 }
 
 Tracer::~Tracer() {
     log::debug("Tracer:: destructor start");
     free(regs);
+    for (auto bp : breakpoints.sorted()) {
+        if (bp->fd != -1) close(bp->fd);
+    }
+    if (trampolines != nullptr) munmap(trampolines, sizeof(cx_tramp_header));
+    if (mailbox != nullptr) munmap(mailbox, sizeof(cx_mailbox));
     log::debug("Tracer:: destructor end");
 }
 
@@ -83,7 +96,15 @@ void Tracer::start(TracerState *initial_state, int argc, char **argv) {
         child.send(SIGKILL);
         child.abandon();
     }
+    if (origin.active()) {
+        origin.send(SIGKILL);
+        origin.abandon();
+    }
 
+    if (trampolines != nullptr) {
+        log::info("Region begin reached %d times", trampolines->hits);
+    }
+    save_breakpoint_stats();
     log::info("Tracer captured %d traces", trace_id);
     log::debug("Tracer:: start end");
 }
@@ -201,6 +222,11 @@ void Tracer::track_mmap() {
 
         child.syscall(0);
         child.wait(0);
+        if (child.seccomp_stop()) {
+            // Filtered call, once the filter is installed (-seccomp)
+            child.syscall(0);
+            child.wait(0);
+        }
         checkx(child.stopped(), "Tracer:: track_mmap: Child did not stop");
         sig = child.stop_sig();
         checkx(sig == SIGTRAP, "Tracer:: track_mmap: Expected trap/breakpoint B, found %s",
@@ -251,17 +277,41 @@ void Tracer::init(int argc, char **argv) {
     setenv("LD_BIND_NOW", "1", 1);
     preload(library_path());
     log::debug("Tracer:: preload set");
+    if (tracing_enabled) create_mailbox();
     child.exec(argv, argc);
     child.ready();
+    // Before the tracing library installs the filter
+    if (trace_options.seccomp && mailbox != nullptr) child.trace_seccomp();
     unsetenv("LD_PRELOAD");
+    if (mailbox_fd != -1) {
+        unsetenv("CHOPSTIX_OPT_MAILBOX_FD");
+        close(mailbox_fd);
+        mailbox_fd = -1;
+    }
 
     log::debug("Tracer:: Spawned child process %d", child.pid());
     track_mmap();
 
+    if (mailbox != nullptr &&
+        !__atomic_load_n(&mailbox->ready, __ATOMIC_ACQUIRE)) {
+        log::verbose("Tracer:: Mailbox not used by the tracing library, "
+                     "using dynamic calls");
+        munmap(mailbox, sizeof(cx_mailbox));
+        mailbox = nullptr;
+    }
+
+    if (trace_options.seccomp && mailbox == nullptr) {
+        log::warn("System call filtering not available, stopping at every "
+                  "system call");
+        trace_options.seccomp = false;
+    }
+
     child.step_to_main_module();
 
     if (module != "main") compute_module_offset();
 
+    if (trace_options.in_process) map_trampolines();
+
     alt_stack = read_alt_stack();
 
     log::debug("Tracer:: init end");
@@ -317,21 +367,42 @@ void Tracer::start_trace(bool isInvocationStart) {
         running = false;
     } else if (tracing_enabled) {
         log::debug("Tracer::start_trace tracing enabled");
+        arm_syscall_filter();
         capture_trace();
 
         // Pass breakpoint information to tracee
-        auto breakpoints = child.get_breakpoint_info();
+        std::vector<BreakpointInformation> infos;
+        for (auto bp : breakpoints.sorted()) {
+            if (!bp->saved) continue;
+            log::debug("Tracer:: start_trace: Breakpoint address: 0x%x Contents: 0x%x", bp->addr, bp->original);
+            infos.push_back({bp->addr, bp->original});
+        }
 
-        for(auto & elem : breakpoints)
-        {
-            log::debug("Tracer:: start_trace: Breakpoint address: 0x%x Contents: 0x%x", elem.addr, elem.original_content);
+        // Read from the mailbox by a snapshot as well, which has no control
+        // thread
+        if (mailbox != nullptr) {
+            checkx(infos.size() <= CX_MAILBOX_MAX_BREAKPOINTS,
+                   "Tracer:: start_trace: Too many breakpoints enabled");
+            for (unsigned i = 0; i < infos.size(); ++i) {
+                mailbox->breakpoints[i].addr = infos[i].addr;
+                mailbox->breakpoints[i].original = infos[i].original_content;
+            }
+            mailbox->breakpoint_count = infos.size();
+            mailbox->trace_id = trace_id;
+            mailbox->new_invocation = isInvocationStart ? 1 : 0;
+        }
+
+        if (mailbox != nullptr && !origin.active()) {
+            log::debug("Tracer::start_trace : mailbox start command");
+            mailbox_call(CX_MAILBOX_START);
+            log::debug("Tracer::start_trace end");
+            return;
         }
 
         char fname[PATH_MAX];
         sfmt::format(fname, sizeof(fname), "%s/_breakpoints", trace_path);
         FILE *fp = fopen(fname, "wb");
-        fwrite(breakpoints.data(), sizeof(BreakpointInformation),
-               breakpoints.size(), fp);
+        fwrite(infos.data(), sizeof(BreakpointInformation), infos.size(), fp);
         fclose(fp);
 
         // Invoke trace start routine
@@ -350,7 +421,10 @@ void Tracer::stop_trace() {
     log::debug("Tracer:: stop_trace start");
     log::verbose("Stop capturing trace %d", trace_id);
     trace_id++;
-    if (tracing_enabled) {
+    if (tracing_enabled && mailbox != nullptr && !origin.active()) {
+        log::debug("Tracer::stop_trace : mailbox stop command");
+        mailbox_call(CX_MAILBOX_STOP);
+    } else if (tracing_enabled) {
         log::debug("Tracer::stop_trace : dyn_call to chopstix_stop_trace");
         static std::vector<unsigned long> args;
         dyn_call("chopstix_stop_trace", args);
@@ -377,44 +451,253 @@ Location& Tracer::get_symbol(std::string name) {
     return location->second;
 }
 
+bool Tracer::take_snapshot() {
+    if (!trace_options.snapshot || !tracing_enabled) return false;
+    if (mailbox == nullptr) {
+        // The trace count is kept in the mailbox
+        log::verbose("Tracer:: take_snapshot: no mailbox, tracing in place");
+        return false;
+    }
+    // Before the fork, so the copies inherit it
+    arm_syscall_filter();
+    long pid = child.snapshot(get_symbol("chopstix_snapshot"), regs, alt_stack);
+    if (pid == -1) {
+        log::warn("Unable to fork the traced process, tracing in place");
+        return false;
+    }
+    log::verbose("Tracer:: take_snapshot: tracing in copy %d", pid);
+    origin = std::move(child);
+    child.copy(pid);
+    return true;
+}
+
+void Tracer::drop_snapshot() {
+    if (!origin.active()) return;
+    log::verbose("Tracer:: drop_snapshot: back to process %d", origin.pid());
+    if (child.active()) {
+        child.send(SIGKILL);
+        child.wait(0);
+        child.abandon();
+    }
+    child = std::move(origin);
+}
+
+void Tracer::arm_syscall_filter() {
+    // Once, at the first region of interest: the system calls before it do
+    // not stop the child. A seccomp filter cannot be removed afterwards.
+    if (!trace_options.seccomp || syscall_filter_armed) return;
+    syscall_filter_armed = true;
+    static std::vector<unsigned long> args;
+    dyn_call("chopstix_filter_syscalls", args);
+    seccomp = __atomic_load_n(&mailbox->syscall_filter, __ATOMIC_ACQUIRE);
+    if (!seccomp) {
+        log::warn("System call filtering not available, stopping at every "
+                  "system call");
+    }
+}
+
 void Tracer::dyn_call(std::string symbol, std::vector<unsigned long> &args) {
     log::debug("Tracer:: dyn_call: dynamic call to: %s", symbol);
     child.dyn_call(get_symbol(symbol), regs, alt_stack, args);
 }
 
+void Tracer::create_mailbox() {
+#ifdef SYS_memfd_create
+    int fd = syscall(SYS_memfd_create, CX_MAILBOX_NAME, 0);
+#else
+    int fd = -1;
+#endif
+    void *mem = MAP_FAILED;
+    if (fd != -1 && ftruncate(fd, sizeof(cx_mailbox)) == 0) {
+        mem = mmap(nullptr, sizeof(cx_mailbox), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    }
+    if (mem == MAP_FAILED) {
+        log::verbose("Tracer:: Unable to create mailbox, using dynamic calls");
+        if (fd != -1) close(fd);
+        return;
+    }
+    mailbox = (cx_mailbox *)mem;
+    safe_strncpy(mailbox->magic, CX_MAILBOX_MAGIC, sizeof(mailbox->magic));
+    mailbox->version = CX_MAILBOX_VERSION;
+    // Inherited by the child, which finds it in the option
+    mailbox_fd = fd;
+    setenv("CHOPSTIX_OPT_MAILBOX_FD", std::to_string(fd).c_str(), 1);
+}
+
+void Tracer::mailbox_call(unsigned int command) {
+    // The traced thread stays stopped while the control thread of the
+    // tracing library runs the command
+    mailbox->command = command;
+    uint32_t request = mailbox->request + 1;
+    __atomic_store_n(&mailbox->request, request, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &mailbox->request, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+
+    uint32_t done;
+    while ((done = __atomic_load_n(&mailbox->done, __ATOMIC_ACQUIRE)) !=
+           request) {
+        // Check the child is still there every now and then
+        struct timespec ts = {0, 100000000};
+        long ret = syscall(SYS_futex, &mailbox->done, FUTEX_WAIT, done, &ts,
+                           nullptr, 0);
+        if (ret == -1 && errno == ETIMEDOUT) {
+            child.touch();
+            checkx(child.active() && !child.signaled(),
+                   "Tracer:: mailbox_call: Traced process terminated");
+        }
+    }
+}
+
 bool Tracer::symbol_contains(std::string symname, long addr) {
     return get_symbol(symname).entry().contains(addr);
 }
 
-void Tracer::set_breakpoint(std::vector<long> address, bool state) {
+void Tracer::set_breakpoint(std::vector<long> address, bool state,
+                            unsigned int role) {
     log::debug("Tracer:: set_breakpoint start");
+    // Insert all first, the table may grow and move its entries
+    for (auto addr : address) {
+        auto &bp = breakpoints.insert(addr + module_offset.addr());
+        bp.roles |= role;
+    }
+    std::vector<Breakpoint *> bps;
+    bps.reserve(address.size());
     for (auto addr : address) {
         auto baddr = addr + module_offset.addr();
-        if(state) {
-            log::debug("Tracer:: set_breakpoint: set_break at 0x%x (0x%x)", addr, baddr);
-            child.set_break(baddr);
+        log::debug("Tracer:: set_breakpoint: %s at 0x%x (0x%x)",
+                   state ? "set_break" : "remove_break", addr, baddr);
+        bps.push_back(breakpoints.find(baddr));
+    }
+    if (hw_breakpoints) {
+        Breakpoint *failed = nullptr;
+        for (auto bp : bps) {
+            if (!state) {
+                child.remove_hw_break(*bp);
+            } else if (!child.set_hw_break(*bp)) {
+                failed = bp;
+                break;
+            }
         }
-        else {
-            log::debug("Tracer:: set_breakpoint: remove_break at 0x%x (0x%x)", addr, baddr);
-            child.remove_break(baddr);
+        if (failed == nullptr) {
+            log::debug("Tracer:: set_breakpoint end");
+            return;
         }
+        log::warn("Hardware breakpoint at 0x%x not available, using "
+                  "software breakpoints",
+                  failed->addr - module_offset.addr());
+        drop_hw_breakpoints();
+    }
+    if (state) {
+        child.set_breaks(bps);
+    } else {
+        child.remove_breaks(bps);
     }
     log::debug("Tracer:: set_breakpoint end");
 }
 
-bool Tracer::check_breakpoint(std::vector<long> address) {
-    log::debug("Tracer:: check_breakpoint start");
+void Tracer::drop_hw_breakpoints() {
+    hw_breakpoints = false;
+    std::vector<Breakpoint *> armed;
+    for (auto bp : breakpoints.sorted()) {
+        if (bp->fd == -1) continue;
+        if (bp->enabled) {
+            child.remove_hw_break(*bp);
+            armed.push_back(bp);
+        }
+        close(bp->fd);
+        bp->fd = -1;
+    }
+    child.set_breaks(armed);
+}
+
+bool Tracer::breakpoint_stop(int signal) {
+    if (!hw_breakpoints) return signal == SIGILL;
+    return signal == SIGTRAP && child.hw_break_stop();
+}
+
+void Tracer::map_trampolines() {
+    char fname[PATH_MAX];
+    sfmt::format(fname, sizeof(fname), "%s/" CX_TRAMP_FILE, trace_path);
+    int fd = ::open(fname, O_RDWR);
+    void *mem = MAP_FAILED;
+    if (fd != -1) {
+        mem = mmap(nullptr, sizeof(cx_tramp_header), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    auto header = (cx_tramp_header *)mem;
+    if (mem == MAP_FAILED ||
+        strncmp(header->magic, CX_TRAMP_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CX_TRAMP_VERSION || header->count == 0) {
+        log::warn("In-process region detection not available, using "
+                  "breakpoints");
+        if (mem != MAP_FAILED) munmap(mem, sizeof(cx_tramp_header));
+        return;
+    }
+    // Code elsewhere may jump into the bytes replaced by a jump, unless the
+    // begin address is a function entry
+    for (unsigned i = 0; i < header->count; ++i) {
+        if (Location::function_start(child.pid(), header->entries[i].addr)) {
+            continue;
+        }
+        log::warn("Begin address 0x%x is not a function entry, using "
+                  "breakpoints", header->entries[i].addr);
+        for (unsigned j = 0; j < header->count; ++j) {
+            auto &entry = header->entries[j];
+            child.poke(entry.addr, entry.original);
+        }
+        munmap(mem, sizeof(cx_tramp_header));
+        return;
+    }
+    // Breakpoints are not set before the main module either
+    header->hits = 0;
+    trampolines = header;
+    log::verbose("Tracer:: %d begin addresses detected in-process",
+                 header->count);
+}
+
+void Tracer::arm_trampolines(bool state) {
+    log::debug("Tracer:: arm_trampolines: %s", state ? "arm" : "disarm");
+    if (state) {
+        long next = next_trace(trampolines->hits);
+        trampolines->countdown =
+            next < 0 ? INT64_MAX : next - (long)trampolines->hits + 1;
+        log::debug("Tracer:: arm_trampolines: next trace at invocation %d",
+                   next);
+    }
+    // Original code while tracing, so dumped pages need no fix
+    for (unsigned i = 0; i < trampolines->count; ++i) {
+        auto &entry = trampolines->entries[i];
+        child.poke(entry.addr, state ? entry.patched : entry.original);
+    }
+}
+
+bool Tracer::trampoline_hit() {
     long cur_pc = Arch::current()->get_pc(child.pid());
-    for (auto addr : address) {
-        auto baddr = addr + module_offset.addr();
-        log::debug("Tracer:: check_breakpoint: check_break at 0x%x (0x%x)", addr, baddr);
-        if (baddr == cur_pc) return true;
+    for (unsigned i = 0; i < trampolines->count; ++i) {
+        auto &entry = trampolines->entries[i];
+        if ((unsigned long)cur_pc != entry.trap) continue;
+        log::debug("Tracer:: trampoline_hit: begin 0x%x", entry.addr);
+        Arch::current()->set_pc(child.pid(), entry.addr);
+        return true;
     }
-    log::debug("Tracer:: check_breakpoint end");
     return false;
 }
 
-void Tracer::fix_breakpoint(std::vector<long> address) {
+bool Tracer::check_breakpoint(unsigned int role) {
+    long cur_pc = Arch::current()->get_pc(child.pid());
+    auto bp = breakpoints.find(cur_pc);
+    if (bp == nullptr || !bp->enabled) {
+        log::debug("Tracer:: check_breakpoint: no breakpoint at 0x%x", cur_pc);
+        return false;
+    }
+    ++bp->hits;
+    log::debug("Tracer:: check_breakpoint: hit 0x%x (roles %d)", cur_pc,
+               bp->roles);
+    return (bp->roles & role) != 0;
+}
+
+void Tracer::fix_breakpoint(unsigned int role) {
     log::debug("Tracer:: fix_breakpoint start");
     long cur_pc = Arch::current()->get_pc(child.pid());
     long mask_size;
@@ -432,18 +715,40 @@ void Tracer::fix_breakpoint(std::vector<long> address) {
             break;
     }
 
-    for (auto addr : address) {
-        auto baddr = addr + module_offset.addr();
-        log::debug("Tracer:: fix_breakpoint: fix_break at 0x%x (0x%x)", addr, baddr);
-        if ((baddr <= cur_pc) && (cur_pc <= (baddr + mask_size))) {
-            child.remove_break(baddr);
-            child.set_break_size(baddr, cur_pc-baddr);
-            break;
-        }
+    // The stop is inside the patched bytes of a breakpoint, at an
+    // instruction that starts after it
+    auto bp = breakpoints.find_covering(cur_pc, mask_size);
+    if (bp != nullptr && bp->fd == -1 && (bp->roles & role)) {
+        log::debug("Tracer:: fix_breakpoint: fix_break at 0x%x (0x%x)",
+                   bp->addr - module_offset.addr(), bp->addr);
+        ++bp->fixups;
+        child.remove_break(*bp);
+        child.set_break_size(*bp, cur_pc - bp->addr);
     }
     log::debug("Tracer:: fix_breakpoint end");
 }
 
+void Tracer::save_breakpoint_stats() {
+    if (breakpoints.size() == 0) return;
+    char fname[PATH_MAX];
+    sfmt::format(fname, sizeof(fname), "%s/breakpoints.txt", trace_path);
+    FILE *fp = fopen(fname, "w");
+    check(fp, "Tracer:: Unable to open %s", fname);
+    fprintf(fp, "# role address absolute hits fixups\n");
+    for (auto bp : breakpoints.sorted()) {
+        const char *role = "-";
+        if (bp->roles == BREAK_BEGIN) role = "begin";
+        if (bp->roles == BREAK_END) role = "end";
+        if (bp->roles == (BREAK_BEGIN | BREAK_END)) role = "begin,end";
+        long addr = bp->addr - module_offset.addr();
+        fprintf(fp, "%s %lx %lx %lu %lu\n", role, addr, bp->addr, bp->hits,
+                bp->fixups);
+        log::verbose("Tracer:: breakpoint %s 0x%x: %d hits, %d fixups", role,
+                     addr, bp->hits, bp->fixups);
+    }
+    fclose(fp);
+}
+
 bool RandomizedTracer::should_trace() {
     log::debug("RandomizedTracer::should_trace");
     double value = ((random() + 0.0) / RAND_MAX);
@@ -455,6 +760,15 @@ bool RandomizedTracer::should_trace() {
     return value < probability;
 }
 
+long RandomizedTracer::next_trace(long invocation) {
+    // Invocations skipped follow a geometric distribution, as if
+    // should_trace was drawn for each of them
+    if (probability <= 0) return -1;
+    if (probability >= 1) return invocation;
+    double value = (random() + 1.0) / (RAND_MAX + 1.0);
+    return invocation + (long)(std::log(value) / std::log1p(-probability));
+}
+
 bool IndexedTracer::should_trace() {
     log::debug("IndexedTracer::should_trace (execution %d)", current_execution);
     if (indices.size() <= current_index) {
@@ -473,4 +787,16 @@ bool IndexedTracer::should_trace() {
     }
 }
 
+long IndexedTracer::next_trace(long invocation) {
+    while (current_index < indices.size() &&
+           indices[current_index] < invocation) {
+        current_index++;
+    }
+    if (current_index == indices.size()) {
+        running = false;
+        return -1;
+    }
+    return indices[current_index];
+}
+
 }
@@ -2,13 +2,21 @@
 
 #include "../process.h"
 #include "../../support/log.h"
+#include <csignal>
 #include <vector>
 
+struct cx_mailbox;
+struct cx_tramp_header;
+
 namespace chopstix {
 
 struct TraceOptions {
     bool dump_registers, dump_maps, dump_info;
     long max_traces;
+    bool hw_breakpoints;
+    bool in_process;
+    bool seccomp;
+    bool snapshot;
 };
 
 class TracerState;
@@ -36,9 +44,30 @@ class Tracer {
     void save_page();
     void dyn_call(std::string symbol, std::vector<unsigned long> &args);
     bool symbol_contains(std::string symbol, long addr);
-    void set_breakpoint(std::vector<long> address, bool state);
-    bool check_breakpoint(std::vector<long> address);
-    void fix_breakpoint(std::vector<long> address);
+    void set_breakpoint(std::vector<long> address, bool state,
+                        unsigned int role);
+    bool check_breakpoint(unsigned int role);
+    void fix_breakpoint(unsigned int role);
+    // Signal stopping the child at a breakpoint, and whether the current
+    // stop is one
+    int breakpoint_signal() const { return hw_breakpoints ? SIGTRAP : SIGILL; }
+    bool breakpoint_stop(int signal);
+    // In-process detection of the begin addresses (-in-process). The child
+    // counts the invocations and only stops, with a SIGILL, at the one
+    // next_trace selected. trampoline_hit moves it back to the begin address.
+    bool trampolines_ready() const { return trampolines != nullptr; }
+    void arm_trampolines(bool state);
+    bool trampoline_hit();
+    // First invocation to trace from invocation on (counting from 0), or -1
+    virtual long next_trace(long invocation) { return invocation; }
+    // System calls of the child stop it on their own (-seccomp), only the
+    // ones not done by the tracing library
+    bool syscall_filter() const { return seccomp; }
+    // Trace the region in a copy of the child (-snapshot), forked at its
+    // begin. drop_snapshot kills the copy and goes back to the child, still
+    // at the begin of the region.
+    bool take_snapshot();
+    void drop_snapshot();
     int trace_id = 0;
     TraceOptions trace_options;
   protected:
@@ -51,9 +80,24 @@ class Tracer {
     long read_alt_stack();
     Location& get_symbol(std::string name);
     void capture_trace();
+    void save_breakpoint_stats();
+    void drop_hw_breakpoints();
+    void map_trampolines();
+    void create_mailbox();
+    void mailbox_call(unsigned int command);
+    void arm_syscall_filter();
 
     TracerState *current_state = nullptr;
     Process child;
+    Process origin;  // Child while a snapshot is traced
+    BreakpointTable breakpoints;
+    bool hw_breakpoints;
+    cx_tramp_header *trampolines = nullptr;
+    // Commands to the tracing library, dyn_call if not available
+    cx_mailbox *mailbox = nullptr;
+    int mailbox_fd = -1;
+    bool seccomp = false;
+    bool syscall_filter_armed = false;
     std::map<std::string, Location> symbols;
     long alt_stack;
     Arch::regbuf_type regs;
@@ -70,6 +114,7 @@ class RandomizedTracer : public Tracer {
         Tracer(module, trace_path, dryrun, trace_options), probability(probability) {}
 
     virtual bool should_trace();
+    virtual long next_trace(long invocation);
   private:
     double probability;
 };
@@ -81,6 +126,7 @@ class IndexedTracer : public Tracer {
         Tracer(module, trace_path, dryrun, trace_options), indices(indices) {}
 
     virtual bool should_trace();
+    virtual long next_trace(long invocation);
   private:
     std::vector<unsigned int> indices;
     unsigned int current_index = 0;
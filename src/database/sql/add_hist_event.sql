@@ -0,0 +1 @@
+ALTER TABLE sample_hist ADD [{}] BIGINT;
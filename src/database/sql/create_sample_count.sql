@@ -0,0 +1,12 @@
+-- Samples counted per PC outside of the sample table (sample logs and
+-- chop sample -aggregate), grouped along with it
+DROP TABLE IF EXISTS _sample_count;
+CREATE TEMP TABLE _sample_count (
+    pid   BIGINT NOT NULL,
+    ip    BIGINT NOT NULL,
+    count BIGINT NOT NULL
+);
+
+@create_sample_hist
+INSERT INTO _sample_count (pid, ip, count)
+SELECT pid, ip, count FROM sample_hist;
@@ -0,0 +1,9 @@
+-- Samples counted per PC by chop sample -aggregate, with the sum of each
+-- event (added as columns). A PC may have a row per flush.
+CREATE TABLE IF NOT EXISTS sample_hist (
+    pid   BIGINT NOT NULL,
+    ip    BIGINT NOT NULL,
+    count BIGINT NOT NULL
+);
+
+CREATE INDEX IF NOT EXISTS sample_hist_pid_index ON sample_hist(pid);
@@ -50,6 +50,20 @@ ON _module_map.pid = sample.pid
 AND sample.ip BETWEEN _module_map.map_begin AND _module_map.map_end
 GROUP BY sample.pid, module_id, sample.ip;
 
+-- Samples already counted elsewhere (e.g. a sample log)
+INSERT INTO _sample_grouped
+SELECT _sample_count.pid         AS pid,
+       module_id                 AS module_id,
+       _sample_count.ip - offset AS addr,
+       _sample_count.ip          AS raw_addr,
+       _module_map.name          AS module_name,
+       _module_map.offset        AS mo,
+       SUM(_sample_count.count)  AS count
+FROM _module_map INNER JOIN _sample_count
+ON _module_map.pid = _sample_count.pid
+AND _sample_count.ip BETWEEN _module_map.map_begin AND _module_map.map_end
+GROUP BY _sample_count.pid, module_id, _sample_count.ip;
+
 CREATE INDEX IF NOT EXISTS _sample_grouped_pid_index ON _sample_grouped(pid);
 CREATE INDEX IF NOT EXISTS _sample_grouped_module_id_index ON _sample_grouped(module_id);
 CREATE INDEX IF NOT EXISTS _sample_grouped_addr_index ON _sample_grouped(addr ASC);
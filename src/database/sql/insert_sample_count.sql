@@ -0,0 +1,2 @@
+INSERT INTO _sample_count (pid, ip, count)
+VALUES                    (?  , ? , ?    );
@@ -0,0 +1,2 @@
+INSERT INTO sample_hist (pid, ip, count {})
+VALUES (?, ?, ? {});
@@ -34,4 +34,23 @@ char *safe_strncpy(char *dest, const char *src, size_t n) {
     for (; i < n; ++i) dest[i] = '\0';
     return dest;
 }
+
+// Keep the compiler from turning the loops back into a libc memcpy call.
+// Used from the SIGSEGV handler, where libc pages might be protected.
+#if defined(__GNUC__) && !defined(__clang__)
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+#endif
+void *safe_memcpy(void *dest, const void *src, size_t n) {
+    char *d = (char *)dest;
+    const char *s = (const char *)src;
+    if ((((unsigned long)d | (unsigned long)s) % sizeof(long)) == 0) {
+        for (; n >= sizeof(long); n -= sizeof(long)) {
+            *(long *)d = *(const long *)s;
+            d += sizeof(long);
+            s += sizeof(long);
+        }
+    }
+    for (; n > 0; --n) *d++ = *s++;
+    return dest;
+}
 }  // namespace chopstix
@@ -28,4 +28,5 @@ char *safe_strchr(const char *s, int c);
 size_t safe_strlen(const char *s);
 char *safe_strncpy(char *dest, const char *src, size_t n);
 char *safe_strstr(const char *haystack, const char *needle);
+void *safe_memcpy(void *dest, const void *src, size_t n);
 }  // namespace chopstix
@@ -0,0 +1,140 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#include "dumpring.h"
+
+#include "support/check.h"
+#include "support/log.h"
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace chopstix;
+
+DumpRing::~DumpRing() {
+    if (headers_ != nullptr) munmap(headers_, map_size_);
+}
+
+void DumpRing::setup(long size_mb, long pagesize) {
+    checkx(size_mb > 0, "DumpRing:: ring size must be positive");
+    pagesize_ = pagesize;
+    nslots_ = (size_mb << 20) / pagesize_;
+    checkx(nslots_ > 0, "DumpRing:: ring smaller than a page");
+
+    // Headers go in the first pages, page contents are kept page aligned
+    unsigned long hdr_size = nslots_ * sizeof(slot_header);
+    hdr_size = (hdr_size + pagesize_ - 1) & ~(pagesize_ - 1);
+    map_size_ = hdr_size + nslots_ * pagesize_;
+
+    // Populate now so the signal handler does not take minor faults on
+    // first use of each slot
+    void *mem = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    check(mem != MAP_FAILED, "DumpRing:: Unable to map %d MiB ring", size_mb);
+    headers_ = (slot_header *)mem;
+    data_ = (char *)mem + hdr_size;
+
+    log::verbose("DumpRing:: %d slots of %d bytes", nslots_, pagesize_);
+}
+
+char *DumpRing::reserve(unsigned long page_addr, unsigned int flags) {
+    unsigned long head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= nslots_) {
+        // Ring full: nothing to do but to let the writer catch up
+        ++stalls_;
+        do {
+            ++stall_waits_;
+            syscall(SYS_sched_yield);
+        } while (head - tail_.load(std::memory_order_acquire) >= nslots_);
+    }
+    unsigned long idx = head % nslots_;
+    headers_[idx].addr = page_addr;
+    headers_[idx].flags = flags;
+    ++pages_;
+    return data_ + idx * pagesize_;
+}
+
+void DumpRing::commit() {
+    unsigned long head = head_.load(std::memory_order_relaxed) + 1;
+    head_.store(head, std::memory_order_seq_cst);
+    unsigned long used = head - tail_.load(std::memory_order_relaxed);
+    if (used > peak_) peak_ = used;
+    // Only enter the kernel if the writer went to sleep on an empty ring
+    if (signal_.load(std::memory_order_seq_cst) != 0 &&
+        signal_.exchange(0, std::memory_order_seq_cst) != 0) {
+        wake();
+    }
+}
+
+bool DumpRing::peek(unsigned long &page_addr, unsigned int &flags,
+                    char *&data) {
+    unsigned long tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;
+    unsigned long idx = tail % nslots_;
+    page_addr = headers_[idx].addr;
+    flags = headers_[idx].flags;
+    data = data_ + idx * pagesize_;
+    return true;
+}
+
+void DumpRing::release() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+}
+
+void DumpRing::wait() {
+    // Announce the sleep before the last look at the ring: either commit
+    // sees the flag and wakes us, or we see its slot and do not sleep
+    signal_.store(1, std::memory_order_seq_cst);
+    if (tail_.load(std::memory_order_relaxed) ==
+            head_.load(std::memory_order_seq_cst) &&
+        !stop_.load(std::memory_order_seq_cst)) {
+        // Returns straight away if the flag was cleared in between
+        syscall(SYS_futex, reinterpret_cast<int *>(&signal_),
+                FUTEX_WAIT_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+    signal_.store(0, std::memory_order_relaxed);
+}
+
+void DumpRing::wake() {
+    syscall(SYS_futex, reinterpret_cast<int *>(&signal_), FUTEX_WAKE_PRIVATE,
+            1, nullptr, nullptr, 0);
+}
+
+void DumpRing::drain() {
+    // The writer does not sleep while there are committed slots
+    while (!empty()) syscall(SYS_sched_yield);
+}
+
+void DumpRing::shutdown() {
+    stop_.store(true, std::memory_order_seq_cst);
+    signal_.store(0, std::memory_order_seq_cst);
+    wake();
+}
+
+void DumpRing::reset_stats() {
+    pages_ = 0;
+    stalls_ = 0;
+    stall_waits_ = 0;
+    peak_ = 0;
+}
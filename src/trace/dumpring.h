@@ -0,0 +1,93 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#pragma once
+
+#include <atomic>
+
+namespace chopstix {
+
+// Single-producer/single-consumer ring of page-sized slots. The producer is
+// the SIGSEGV handler, the consumer the page dump writer thread. Storage is
+// mapped once on setup so the handler never allocates.
+struct DumpRing {
+  public:
+    ~DumpRing();
+
+    void setup(long size_mb, long pagesize);
+
+    // Producer side. Returns a slot of pagesize bytes for page_addr, waiting
+    // for the consumer if the ring is full. The slot is published on commit,
+    // which wakes the consumer if it is sleeping on an empty ring.
+    char *reserve(unsigned long page_addr, unsigned int flags);
+    void commit();
+
+    // Consumer side. Returns false if there is nothing to consume.
+    bool peek(unsigned long &page_addr, unsigned int &flags, char *&data);
+    void release();
+    // Sleep until new slots are committed or the ring is shut down
+    void wait();
+
+    // Wait until the consumer has released every committed slot
+    void drain();
+    void shutdown();
+    bool stopped() const { return stop_.load(std::memory_order_acquire); }
+
+    bool empty() const {
+        return tail_.load(std::memory_order_acquire) ==
+               head_.load(std::memory_order_acquire);
+    }
+
+    unsigned long slots() const { return nslots_; }
+    unsigned long pages() const { return pages_; }
+    unsigned long stalls() const { return stalls_; }
+    unsigned long stall_waits() const { return stall_waits_; }
+    unsigned long peak() const { return peak_; }
+    void reset_stats();
+
+  private:
+    struct slot_header {
+        unsigned long addr;
+        unsigned int flags;
+    };
+
+    void wake();
+
+    long pagesize_ = 0;
+    unsigned long nslots_ = 0;
+    unsigned long map_size_ = 0;
+    slot_header *headers_ = nullptr;
+    char *data_ = nullptr;
+
+    // head_ is only written by the producer, tail_ by the consumer
+    alignas(64) std::atomic<unsigned long> head_{0};
+    alignas(64) std::atomic<unsigned long> tail_{0};
+    alignas(64) std::atomic<int> signal_{0};
+    std::atomic<bool> stop_{false};
+
+    // Producer statistics
+    unsigned long pages_ = 0;
+    unsigned long stalls_ = 0;
+    unsigned long stall_waits_ = 0;
+    unsigned long peak_ = 0;
+};
+
+}  // namespace chopstix
@@ -0,0 +1,82 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#include "mailbox.h"
+
+#include "support/log.h"
+
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace chopstix;
+
+Mailbox::~Mailbox() {
+    if (box_ != nullptr) munmap(box_, sizeof(cx_mailbox));
+}
+
+bool Mailbox::setup(int fd) {
+    void *mem = mmap(nullptr, sizeof(cx_mailbox), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    // Not needed once mapped, and not to be inherited by the application
+    syscall(SYS_close, fd);
+    if (mem == MAP_FAILED) {
+        log::verbose("Mailbox:: Unable to map descriptor %d", fd);
+        return false;
+    }
+    cx_mailbox *box = (cx_mailbox *)mem;
+    if (strncmp(box->magic, CX_MAILBOX_MAGIC, sizeof(box->magic)) != 0 ||
+        box->version != CX_MAILBOX_VERSION) {
+        log::verbose("Mailbox:: Descriptor %d is not a mailbox", fd);
+        munmap(mem, sizeof(cx_mailbox));
+        return false;
+    }
+    box_ = box;
+    served_ = __atomic_load_n(&box_->request, __ATOMIC_ACQUIRE);
+    return true;
+}
+
+void Mailbox::set_ready() {
+    __atomic_store_n(&box_->ready, 1, __ATOMIC_RELEASE);
+}
+
+void Mailbox::set_syscall_filter() {
+    __atomic_store_n(&box_->syscall_filter, 1, __ATOMIC_RELEASE);
+}
+
+unsigned int Mailbox::wait() {
+    // Shared between processes: no private futex operations
+    unsigned int request;
+    while ((request = __atomic_load_n(&box_->request, __ATOMIC_ACQUIRE)) ==
+           served_) {
+        syscall(SYS_futex, &box_->request, FUTEX_WAIT, served_, nullptr,
+                nullptr, 0);
+    }
+    served_ = request;
+    return box_->command;
+}
+
+void Mailbox::complete() {
+    __atomic_store_n(&box_->done, served_, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &box_->done, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
@@ -0,0 +1,56 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#pragma once
+
+#include "mailboxfmt.h"
+
+namespace chopstix {
+
+// Tracee side of the command mailbox (see mailboxfmt.h). Mapped once on
+// setup, before the parent records the restricted regions, so waiting on it
+// and completing commands never faults while tracing.
+struct Mailbox {
+  public:
+    ~Mailbox();
+
+    // Maps the mailbox passed by the tracer. Returns false, leaving the
+    // mailbox disabled, if fd is not one.
+    bool setup(int fd);
+    bool enabled() const { return box_ != nullptr; }
+
+    // Tell the tracer the control thread is waiting for commands
+    void set_ready();
+    // Tell the tracer only filtered system calls stop the traced thread
+    void set_syscall_filter();
+    // Block until the tracer posts a command, and return it
+    unsigned int wait();
+    // Tell the tracer the last command is done
+    void complete();
+
+    const cx_mailbox *box() const { return box_; }
+
+  private:
+    cx_mailbox *box_ = nullptr;
+    unsigned int served_ = 0;
+};
+
+}  // namespace chopstix
@@ -0,0 +1,67 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : trace/mailboxfmt.h
+ * DESCRIPTION : Layout of the command mailbox shared by chop trace and the
+ *               tracing support library. The tracer creates it as a memfd
+ *               and passes the descriptor in CHOPSTIX_OPT_MAILBOX_FD. A
+ *               control thread of the support library waits on it and runs
+ *               the start/stop commands, so the traced thread does not need
+ *               to be hijacked. Both processes map it shared, hence plain C.
+ *
+ *               Protocol: the tracer fills the arguments, increments
+ *               'request' and wakes it (futex). The control thread runs the
+ *               command, sets 'done' to the request served and wakes it.
+ ******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+#define CX_MAILBOX_NAME "chopstix_mailbox"
+#define CX_MAILBOX_MAGIC "CXMBOX"
+#define CX_MAILBOX_VERSION 1
+#define CX_MAILBOX_MAX_BREAKPOINTS 1024
+
+// Commands
+#define CX_MAILBOX_START 1  // chopstix_start_trace
+#define CX_MAILBOX_STOP 2   // chopstix_stop_trace
+
+struct cx_mailbox_breakpoint {
+    uint64_t addr;
+    uint64_t original;
+};
+
+struct cx_mailbox {
+    char magic[8];
+    uint32_t version;
+    uint32_t ready;           // Set once the control thread is running
+    uint32_t syscall_filter;  // Set if system calls are filtered (-seccomp)
+    uint32_t request;         // Futex, incremented for every command
+    uint32_t done;            // Futex, last request served
+    uint32_t command;
+    uint32_t new_invocation;  // START: trace begins a region invocation
+    int32_t trace_id;         // START: trace to capture
+    uint32_t breakpoint_count;
+    // START: breakpoints set, whose original contents go in dumped pages
+    struct cx_mailbox_breakpoint breakpoints[CX_MAILBOX_MAX_BREAKPOINTS];
+};
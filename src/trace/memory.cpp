@@ -20,11 +20,15 @@
 #
 */
 #include "memory.h"
+#include "mailboxfmt.h"
+#include "statsfmt.h"
+#include "trampfmt.h"
 
 #include "support/check.h"
 #include "support/log.h"
 #include "support/options.h"
 
+#include <dlfcn.h>
 #include <fcntl.h>
 #include <malloc.h>
 #include <sys/mman.h>
@@ -54,11 +58,6 @@ static int protect_bits_RWX = PROT_READ;  // Might happen?
 
 #define REGION_SIZE(R) ((R)->addr[1] - (R)->addr[0])
 
-#define REGION_FMT "%lx-%lx %s %lx %x:%x %d %s\n"
-#define REGION_UNWRAP(REG)                                              \
-    REG addr[0], REG addr[1], (char *)REG perm, REG offset, REG dev[0], \
-        REG dev[1], REG inode, (char *)REG path
-
 #define streq(A, B) (strcmp(A, B) == 0)
 
 #define PROTECTALLSYMBOLS
@@ -76,7 +75,8 @@ unsigned long libc_addrs[] = {
 
 #ifdef PROTECTALLSYMBOLS
     (unsigned long)&open,
-    (unsigned long)&syscall,
+    // The library's own syscall() hides libc's (see syscall.h)
+    (unsigned long)dlsym(RTLD_NEXT, "syscall"),
     (unsigned long)&fsync,
     (unsigned long)&fflush,
 
@@ -125,12 +125,54 @@ char const *libc_names[] = {
 int libc_count = (sizeof(libc_addrs) / sizeof(unsigned long))-1;
 
 namespace {
-// TODO Use safe_sscanf
-static int parse_region(char *line, mem_region *region) {
-    //log::debug("Memory:: parse_region : %s", line);
-    int ret = sscanf(line, REGION_FMT, REGION_UNWRAP(&region->));
-    if (region->path[1] == '\0') region->path[0] = '\0';
-    return ret;
+static unsigned long parse_hex(const char *&p) {
+    unsigned long val = 0;
+    for (;; ++p) {
+        if (*p >= '0' && *p <= '9') {
+            val = val * 16 + (*p - '0');
+        } else if (*p >= 'a' && *p <= 'f') {
+            val = val * 16 + (*p - 'a' + 10);
+        } else {
+            return val;
+        }
+    }
+}
+
+static unsigned long parse_dec(const char *&p) {
+    unsigned long val = 0;
+    for (; *p >= '0' && *p <= '9'; ++p) val = val * 10 + (*p - '0');
+    return val;
+}
+
+// Parse one line in /proc/<pid>/maps format:
+//   <start>-<end> <perm> <offset> <dev major>:<dev minor> <inode> [<path>]
+// Returns the beginning of the next line.
+static const char *parse_region(const char *line, mem_region *region) {
+    const char *p = line;
+    region->addr[0] = parse_hex(p);
+    if (*p == '-') ++p;
+    region->addr[1] = parse_hex(p);
+    while (*p == ' ') ++p;
+    int i = 0;
+    for (; i < 4 && *p != ' ' && *p != '\n' && *p != '\0'; ++i) {
+        region->perm[i] = *p++;
+    }
+    region->perm[i] = '\0';
+    while (*p == ' ') ++p;
+    region->offset = parse_hex(p);
+    while (*p == ' ') ++p;
+    region->dev[0] = parse_hex(p);
+    if (*p == ':') ++p;
+    region->dev[1] = parse_hex(p);
+    while (*p == ' ') ++p;
+    region->inode = parse_dec(p);
+    while (*p == ' ') ++p;
+    size_t n = 0;
+    for (; *p != '\n' && *p != '\0'; ++p) {
+        if (n < sizeof(region->path) - 1) region->path[n++] = *p;
+    }
+    region->path[n] = '\0';
+    return *p == '\n' ? p + 1 : p;
 }
 
 static int filter_perm(const char *test, const char *perm) {
@@ -173,6 +215,9 @@ static int filter_region(mem_region *reg, const char *perm,
     if (strstr(reg->path, "/libgcc") != NULL) return 1;
     if (strstr(reg->path, "/libstdc++") != NULL) return 1;
     if (strstr(reg->path, "/libcxtrace.so")) return 0;
+    if (strstr(reg->path, "/" CX_STATS_FILE)) return 0;
+    if (strstr(reg->path, "/" CX_TRAMP_FILE)) return 0;
+    if (strstr(reg->path, "/memfd:" CX_MAILBOX_NAME)) return 0;
     if (strstr(reg->path, "/ld-") != NULL) return 0;
     if (strstr(reg->path, "[v")) return 0;
     return 1;
@@ -252,6 +297,20 @@ Memory::Memory() {
 
     prot_[0].addr[0] = 0;
     prot_[0].addr[1] = 0;
+
+    std::string tracking = getopt("page-tracking").as_string("mprotect");
+    if (tracking == "uffd") {
+        if (!getopt("memory-access-trace").as_bool()) {
+            log::info("Memory:: uffd page tracking only applies to "
+                      "-memory-access-trace, using mprotect");
+        } else if (!uffd_.setup(pagesize_)) {
+            log::warn("Memory:: uffd page tracking not available, using "
+                      "mprotect");
+        }
+    } else {
+        checkx(tracking == "mprotect", "Unknown page tracking backend '%s'",
+               tracking.c_str());
+    }
 }
 
 unsigned long *Memory::restricted_pages() { return libc_addrs; }
@@ -259,16 +318,16 @@ mem_region *Memory::restricted_regions() { return prot_; }
 
 Memory::~Memory() {}
 
-ssize_t readline(int fd, char *buf, size_t siz) {
-    char c;
+// Read the whole file in a few system calls, no allocation
+static size_t read_all(int fd, char *buf, size_t siz) {
     size_t tot = 0;
-    while (syscall(SYS_read, fd, &c, 1) == 1) {
-        buf[tot] = c;
-        ++tot;
-        if (tot == siz - 1) break;
-        if (c == '\n') break;
+    while (tot < siz - 1) {
+        long ret = syscall(SYS_read, fd, buf + tot, siz - 1 - tot);
+        if (ret <= 0) break;
+        tot += ret;
     }
-    buf[tot + 1] = '\0';
+    checkx(tot < siz - 1, "Memory map too large");
+    buf[tot] = '\0';
     return tot;
 }
 
@@ -276,7 +335,20 @@ void Memory::update() {
     log::debug("Memory::update: Memory::update");
     int fd = syscall(SYS_openat, AT_FDCWD, "/proc/self/maps", O_RDONLY);
     check(fd != -1, "Unable to open maps");
-    char line[1024];
+    int next = maps_cur_ ^ 1;
+    size_t len = read_all(fd, maps_[next], MAPS_MAX);
+    syscall(SYS_close, fd);
+
+    // Nothing was mapped, unmapped or protected since the last update: the
+    // region table built from it is still valid
+    if (len == maps_len_[maps_cur_] &&
+        memcmp(maps_[next], maps_[maps_cur_], len) == 0) {
+        log::debug("Memory::update: map unchanged");
+        return;
+    }
+    maps_cur_ = next;
+    maps_len_[next] = len;
+
     size_t n = 0;
     int stack_cnt = 0;
 
@@ -284,9 +356,9 @@ void Memory::update() {
     prot_[prot_siz_].addr[0] = 0;
     prot_[prot_siz_].addr[1] = 0;
 
-    while (readline(fd, line, sizeof(line))) {
+    for (const char *line = maps_[next]; *line != '\0';) {
         checkx(n < REGIONS_MAX, "Too many memory regions");
-        parse_region(line, map_ + n);
+        line = parse_region(line, map_ + n);
         //log::verbose("Memory::update: raw parsed line: %x-%x %s %s",
         //          map_[n].addr[0], map_[n].addr[1], map_[n].perm,
         //           map_[n].path);
@@ -297,21 +369,25 @@ void Memory::update() {
             // TODO Cleanup here
             if (streq(map_[n - 1].path, "")) {
                 for (long i = 0; i < res_siz_; ++i) {
-                    if (res_[i].addr[0] >= map_[n - 1].addr[0] &&
-                        res_[i].addr[0] < map_[n - 1].addr[1]) {
+                    // Restricted mappings may span several regions, e.g.
+                    // thread stacks and their guard page
+                    unsigned long res_begin =
+                        std::max(res_[i].addr[0], map_[n - 1].addr[0]);
+                    unsigned long res_end =
+                        std::min(res_[i].addr[1], map_[n - 1].addr[1]);
+                    if (res_begin < res_end) {
                         //log::debug(
                         //    "Memory::update: overlap maps %x-%x with res %x-%x",
                         //    map_[n - 1].addr[0], map_[n - 1].addr[1],
                         //    res_[i].addr[0], res_[i].addr[1]);
                         // log::debug("anonym region %x", map_[n-1].addr[0]);
                         // Split region
-                        unsigned long res_begin = res_[i].addr[0];
-                        unsigned long res_end = res_[i].addr[1];
                         if (map_[n - 1].addr[0] == res_begin) {
                             // Stack is at beginning of heap
                             map_[n - 1].addr[0] = res_end;
                             if (map_[n - 1].addr[1] == res_end) {
                                 --n;
+                                break;
                             }
                         } else if (map_[n - 1].addr[1] == res_end) {
                             // Stack is at end of heap
@@ -426,7 +502,10 @@ void Memory::update() {
                 // if (map_[n - 1].addr[0] >= map_[n - 1].addr[1]) n -= 1;
             }
         } else {
-            if (!strstr(map_[n].path, "/libcxtrace")) {
+            if (!strstr(map_[n].path, "/libcxtrace") &&
+                !strstr(map_[n].path, "/" CX_STATS_FILE) &&
+                !strstr(map_[n].path, "/" CX_TRAMP_FILE) &&
+                !strstr(map_[n].path, "/memfd:" CX_MAILBOX_NAME)) {
                 //log::debug("Region not protected. Registering for dump");
                 prot_[prot_siz_].addr[0] = map_[n].addr[0];
                 prot_[prot_siz_].addr[1] = map_[n].addr[1];
@@ -444,27 +523,83 @@ void Memory::update() {
     }
     //log::debug("Memory::update: %d stack regions", stack_cnt);
     siz_ = n;
+
+    // Splits above append the upper part, so the table is normally already
+    // sorted. find_region relies on it.
+    auto by_addr = [](const mem_region &a, const mem_region &b) {
+        return a.addr[0] < b.addr[0];
+    };
+    if (!std::is_sorted(begin(), end(), by_addr)) {
+        std::sort(begin(), end(), by_addr);
+    }
+    last_region_ = NULL;
+}
+
+const char *Memory::read_maps() {
+    // Borrow the spare map buffer, update() reads into it anyway
+    char *buf = maps_[maps_cur_ ^ 1];
+    int fd = syscall(SYS_openat, AT_FDCWD, "/proc/self/maps", O_RDONLY);
+    check(fd != -1, "Unable to open maps");
+    read_all(fd, buf, MAPS_MAX);
     syscall(SYS_close, fd);
+    return buf;
+}
+
+unsigned long Memory::module_base(const char *module) {
+    mem_region reg;
+    for (const char *line = read_maps(); *line != '\0';) {
+        line = parse_region(line, &reg);
+        const char *bname = strrchr(reg.path, '/');
+        bname = bname != NULL ? bname + 1 : reg.path;
+        if (reg.perm[2] == 'x' && strncmp(bname, module, strlen(module)) == 0) {
+            return reg.addr[0];
+        }
+    }
+    return 0;
+}
+
+int Memory::mapping_prot(unsigned long addr) {
+    mem_region reg;
+    for (const char *line = read_maps(); *line != '\0';) {
+        line = parse_region(line, &reg);
+        if (addr >= reg.addr[0] && addr < reg.addr[1]) {
+            return decode_perm(reg.perm);
+        }
+    }
+    return -1;
 }
 
 void Memory::restrict_map(int fd) {
-    char line[1024];
     res_siz_ = 0;
     long n = 0;
     log::debug("Memory:: restrict_map: parsing restrict_map");
-    while (readline(fd, line, sizeof(line))) {
+    // Borrow the spare map buffer, update() reads into it anyway
+    char *buf = maps_[maps_cur_ ^ 1];
+    read_all(fd, buf, MAPS_MAX);
+    for (const char *line = buf; *line != '\0';) {
         checkx(n < REGIONS_MAX, "Too many memory regions");
-        parse_region(line, res_ + n);
+        line = parse_region(line, res_ + n);
         ++n;
         res_[n].addr[0] = 0;
         res_[n].addr[1] = 0;
     }
     log::debug("Memory:: restrict_map: parsed restrict_map (%d items)", n);
     res_siz_ = n;
+    // Regions are split around the restricted ones, parse the map again
+    maps_len_[maps_cur_] = 0;
 }
 
 void Memory::protect_all() {
     //log::debug("Memory: proctect_all: protect all. Start.");
+    // Register every region before protecting any: a refused registration
+    // sets errno through libc's GOT, which may already be protected
+    for (auto reg = begin(); reg != end(); ++reg) {
+        // Regions the kernel refuses to write-protect (e.g. file backed on
+        // older kernels) keep the double fault scheme
+        reg->wp = track_writes() && reg->perm[1] == 'w' &&
+                  reg->perm[2] != 'x' &&
+                  uffd_.register_range(reg->addr[0], reg->addr[1]);
+    }
     for (auto reg = begin(); reg != end(); ++reg) {
         //log::debug("Memory::protect_all: protect %x-%x %s %s", reg->addr[0],
         //           reg->addr[1], reg->perm, reg->path);
@@ -476,6 +611,11 @@ void Memory::protect_all() {
 void Memory::unprotect_all() {
     for (auto reg = begin(); reg != end(); ++reg) {
         unprotect_region(reg);
+        if (reg->wp) {
+            uffd_.write_protect(reg->addr[0], REGION_SIZE(reg), false);
+            uffd_.unregister_range(reg->addr[0], reg->addr[1]);
+            reg->wp = 0;
+        }
     }
 }
 
@@ -516,21 +656,32 @@ void Memory::unprotect_region(mem_region *reg) {
 
 mem_region *Memory::find_region(unsigned long page_addr) {
     log::debug("Memory::find_region: Region for address %x", page_addr);
-    for (auto reg = begin(); reg != end(); ++reg) {
-        //log::debug("Memory::find_region: Check region %x-%x %s %s",
-        //    reg->addr[0], reg->addr[1], reg->perm, reg->path);
-
-        if (page_addr < reg->addr[0]) continue;
-        if (page_addr >= reg->addr[1]) continue;
-
-        log::debug("Memory::find_region: Region found: %x-%x %s %s",
-                   reg->addr[0], reg->addr[1], reg->perm, reg->path);
 
-        return reg;
+    // Consecutive faults tend to hit the same region
+    mem_region *reg = last_region_;
+    if (reg == NULL || page_addr < reg->addr[0] || page_addr >= reg->addr[1]) {
+        // Binary search for the last region starting at or below the page.
+        // Regions are sorted and do not overlap.
+        long lo = 0, hi = siz_;
+        while (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            if (map_[mid].addr[0] <= page_addr) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == 0 || page_addr >= map_[lo - 1].addr[1]) {
+            log::debug("Memory::find_region: No region found");
+            return NULL;
+        }
+        reg = map_ + lo - 1;
+        last_region_ = reg;
     }
 
-    log::debug("Memory::find_region: No region found");
-    return NULL;
+    log::debug("Memory::find_region: Region found: %x-%x %s %s",
+               reg->addr[0], reg->addr[1], reg->perm, reg->path);
+    return reg;
 }
 
 void Memory::protect_page(mem_region *reg, unsigned long page_addr) {
@@ -556,6 +707,18 @@ void Memory::unprotect_page(mem_region *reg, unsigned long page_addr) {
 }
 
 void Memory::unprotect_page_for_read(mem_region *reg, unsigned long page_addr) {
+    if (reg->wp) {
+        // Give full access right away, writes are caught by the
+        // userfaultfd write-protection
+        unprotect_page(reg, page_addr);
+        if (!uffd_.wp_unpopulated()) {
+            // Write-protection only applies to populated pages
+            volatile char c = *(volatile char *)page_addr;
+            (void)c;
+        }
+        uffd_.write_protect(page_addr, pagesize_, true);
+        return;
+    }
     char perm[5];
     for (int i=0; i<5;++i) perm[i] = reg->perm[i];
     perm[1] = '-';
@@ -24,7 +24,10 @@
 #include <linux/limits.h>
 #include <signal.h>
 
+#include "uffd.h"
+
 #define REGIONS_MAX 1023
+#define MAPS_MAX (REGIONS_MAX * 256)  // Bytes of /proc/self/maps
 
 namespace chopstix {
 struct mem_region {
@@ -34,6 +37,7 @@ struct mem_region {
     int dev[2];
     int inode;
     char path[PATH_MAX];
+    int wp;  // Writes tracked with userfaultfd
 
     // long size() const { return addr[1] - addr[0]; }
 };
@@ -70,9 +74,19 @@ struct Memory {
     stack_type *alt_stack() { return &alt_stack_; }
     void restrict_map(int fd);
 
+    // Lookups in the current /proc/self/maps. module_base returns the start
+    // of the first executable mapping of module (0 if not found) and
+    // mapping_prot the protection of addr (-1 if not mapped).
+    unsigned long module_base(const char *module);
+    int mapping_prot(unsigned long addr);
+
     static unsigned long *restricted_pages();
     mem_region *restricted_regions();
 
+    // Writes are reported through userfaultfd instead of a second fault
+    bool track_writes() const { return uffd_.enabled(); }
+    UffdTracker &uffd() { return uffd_; }
+
   private:
     Memory();
     ~Memory();
@@ -80,15 +94,21 @@ struct Memory {
     iterator begin() { return map_; }
     iterator end() { return map_ + siz_; }
     void debug_all();
+    const char *read_maps();
 
     long pagesize_;
     char perm_[128];
     mem_region map_[REGIONS_MAX + 1];
     long siz_ = 0;
+    mem_region *last_region_ = NULL;  // Last region found, NULL if stale
+    char maps_[2][MAPS_MAX];  // Last /proc/self/maps parsed and a spare
+    size_t maps_len_[2] = {0, 0};
+    int maps_cur_ = 0;
     mem_region res_[REGIONS_MAX + 1];
     long res_siz_ = 0;
     mem_region prot_[REGIONS_MAX + 1];
     long prot_siz_ = 0;
+    UffdTracker uffd_;
     stack_type alt_stack_;
     char stack_buf_[SIGSTKSZ * 2];
 };
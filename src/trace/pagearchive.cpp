@@ -0,0 +1,282 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#include "pagearchive.h"
+
+#include "support/check.h"
+#include "support/log.h"
+#include "support/safeformat.h"
+#include "support/safestring.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include <sys/syscall.h>
+
+using namespace chopstix;
+
+#define PERM_664 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH
+
+namespace {
+// Word-wide scan, unrolled so the compiler can vectorize it. Returns at the
+// first non-zero 64-byte block, which comes early for most data pages.
+bool is_zero(const char *data, long size) {
+    const uint64_t *w = (const uint64_t *)data;
+    const uint64_t *end = w + size / sizeof(uint64_t);
+    for (; w < end; w += 8) {
+        if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+}  // namespace
+
+PageArchive::~PageArchive() {
+    if (is_open()) {
+        // Trace never stopped (e.g. process exited during the region of
+        // interest). Persist what we have so far.
+        finish();
+    }
+}
+
+void PageArchive::setup(const char *trace_root, long pagesize,
+                        bool use_store, long delta_interval) {
+    safe_strncpy(trace_root_, trace_root, sizeof(trace_root_));
+    pagesize_ = pagesize;
+    checkx(pagesize_ <= buf_size, "PageArchive:: page size too large");
+
+    use_store_ = use_store;
+    if (use_store_) {
+        store_.setup(store_size);
+        char fpath[PATH_MAX];
+        sfmt::format(fpath, sizeof(fpath), "%s/pages.store", trace_root_);
+        data_fd_ = syscall(SYS_openat, AT_FDCWD, fpath,
+                           O_WRONLY | O_CREAT | O_TRUNC, PERM_664);
+        check(data_fd_ != -1, "PageArchive:: Unable to open '%s'", fpath);
+        data_off_ = 0;
+    }
+
+    delta_interval_ = delta_interval;
+    if (delta_interval_ > 0 && use_store_) {
+        // Deltas are not content-addressable
+        log::warn("PageArchive:: page deltas not supported with page store");
+        delta_interval_ = 0;
+    }
+    if (delta_interval_ > 0) delta_.setup(delta_size, pagesize_);
+}
+
+void PageArchive::start_trace(int trace_id) {
+    char fpath[PATH_MAX];
+    if (!use_store_) {
+        sfmt::format(fpath, sizeof(fpath), "%s/pages.%d.data", trace_root_,
+                     trace_id);
+        data_fd_ = syscall(SYS_openat, AT_FDCWD, fpath,
+                           O_WRONLY | O_CREAT | O_TRUNC, PERM_664);
+        check(data_fd_ != -1, "PageArchive:: Unable to open '%s'", fpath);
+        data_off_ = 0;
+    }
+
+    sfmt::format(fpath, sizeof(fpath), "%s/pages.%d.idx", trace_root_,
+                 trace_id);
+    index_fd_ = syscall(SYS_openat, AT_FDCWD, fpath,
+                        O_WRONLY | O_CREAT | O_TRUNC, PERM_664);
+    check(index_fd_ != -1, "PageArchive:: Unable to open '%s'", fpath);
+
+    // Header is rewritten with the final count on stop_trace
+    cx_page_header hdr = {};
+    ssize_t w = syscall(SYS_write, index_fd_, &hdr, sizeof(hdr));
+    check(w == sizeof(hdr), "PageArchive:: Unable to write index header");
+
+    pos_ = 0;
+    index_pos_ = 0;
+    index_count_ = 0;
+    index_flags_ = 0;
+    shared_ = 0;
+    zero_ = 0;
+
+    if (delta_interval_ > 0) {
+        // Full trace every delta_interval_, readers never need to go back
+        // further than that
+        base_ = traces_ % delta_interval_ == 0 ? -1 : trace_id_;
+        delta_pages_ = 0;
+        delta_saved_ = 0;
+    }
+    trace_id_ = trace_id;
+    ++traces_;
+}
+
+void PageArchive::stop_trace(int trace_id) {
+    log::debug("PageArchive:: stop_trace: %d pages in trace %d (%d zero)",
+               index_count_ + index_pos_, trace_id, zero_);
+    if (use_store_) {
+        log::verbose("PageArchive:: stop_trace: %d pages already in store, "
+                     "%d unique pages stored so far",
+                     shared_, store_.unique());
+        if (store_.full() > 0) {
+            log::warn("PageArchive:: page store table full, %d pages not "
+                      "deduplicated", store_.full());
+        }
+    }
+    if (delta_interval_ > 0) {
+        log::verbose("PageArchive:: stop_trace: %d pages encoded against "
+                     "trace %d, %d bytes saved",
+                     delta_pages_, base_, delta_saved_);
+        if (delta_.full() > 0) {
+            log::warn("PageArchive:: page delta table full, %d pages not "
+                      "delta encoded", delta_.full());
+        }
+    }
+    finish();
+}
+
+void PageArchive::finish() {
+    write_back();
+    write_index();
+
+    cx_page_header hdr = {};
+    safe_strncpy(hdr.magic, CX_PAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CX_PAGE_VERSION;
+    hdr.page_size = pagesize_;
+    hdr.count = index_count_;
+    hdr.flags = index_flags_;
+    hdr.base = base_ >= 0 ? base_ : 0;
+    ssize_t w = syscall(SYS_pwrite64, index_fd_, &hdr, sizeof(hdr), 0);
+    check(w == sizeof(hdr), "PageArchive:: Unable to write index header");
+
+    // The store stays open across traces
+    if (!use_store_) {
+        syscall(SYS_close, data_fd_);
+        data_fd_ = -1;
+    }
+    syscall(SYS_close, index_fd_);
+    index_fd_ = -1;
+}
+
+char *PageArchive::append(unsigned long page_addr, unsigned int flags) {
+    if (pos_ + pagesize_ > buf_size) write_back();
+    if (index_pos_ == index_size) {
+        // Spill a sorted chunk, readers will need to merge them
+        write_index();
+        index_flags_ |= CX_PAGE_INDEX_UNSORTED;
+    }
+
+    cx_page_entry &entry = index_[index_pos_++];
+    entry.addr = page_addr;
+    entry.offset = data_off_;
+    entry.size = pagesize_;
+    entry.flags = flags;
+
+    char *page = buf_ + pos_;
+    pos_ += pagesize_;
+    data_off_ += pagesize_;
+    return page;
+}
+
+void PageArchive::commit() {
+    cx_page_entry &entry = index_[index_pos_ - 1];
+    char *page = buf_ + pos_ - pagesize_;
+    bool zero = is_zero(page, pagesize_);
+    if (delta_interval_ > 0) {
+        // Always recorded, the next trace is encoded against this one
+        long len = delta_.update(entry.addr, page, trace_id_,
+                                 zero ? -1 : base_);
+        if (len >= 0) {
+            safe_memcpy(page, delta_.encoded(), len);
+            entry.size = len;
+            entry.flags |= CX_PAGE_DELTA;
+            pos_ -= pagesize_ - len;
+            data_off_ -= pagesize_ - len;
+            ++delta_pages_;
+            delta_saved_ += pagesize_ - len;
+            return;
+        }
+    }
+    if (zero) {
+        // Only the index entry is kept
+        entry.offset = 0;
+        entry.flags |= CX_PAGE_ZERO;
+        pos_ -= pagesize_;
+        data_off_ -= pagesize_;
+        ++zero_;
+        return;
+    }
+    if (!use_store_) return;
+    entry.flags |= CX_PAGE_STORED;
+    uint64_t found;
+    if (store_.lookup_or_insert(buf_ + pos_ - pagesize_, pagesize_,
+                                entry.offset, found)) {
+        // Already in the store: reference it and drop the copy
+        entry.offset = found;
+        pos_ -= pagesize_;
+        data_off_ -= pagesize_;
+        ++shared_;
+    }
+}
+
+void PageArchive::discard() {
+    if (index_pos_ == 0) return;
+    --index_pos_;
+    pos_ -= pagesize_;
+    data_off_ -= pagesize_;
+}
+
+void PageArchive::write_back() {
+    if (pos_ == 0) return;
+    ssize_t w = syscall(SYS_write, data_fd_, buf_, pos_);
+    check(w == pos_, "PageArchive:: Unable to write page data");
+    pos_ = 0;
+}
+
+void PageArchive::write_index() {
+    if (index_pos_ == 0) return;
+    // Sort a permutation so that entries of the same page keep their append
+    // order (offsets are not monotonic when pages come from the store)
+    for (long i = 0; i < index_pos_; ++i) order_[i] = i;
+    std::sort(order_, order_ + index_pos_,
+              [this](unsigned int a, unsigned int b) {
+                  return index_[a].addr < index_[b].addr ||
+                         (index_[a].addr == index_[b].addr && a < b);
+              });
+
+    // A page dumped twice keeps its latest contents
+    cx_page_entry out[256];
+    long n = 0;
+    for (long i = 0; i < index_pos_; ++i) {
+        const cx_page_entry &entry = index_[order_[i]];
+        if (i + 1 < index_pos_ && index_[order_[i + 1]].addr == entry.addr) {
+            continue;
+        }
+        out[n++] = entry;
+        if (n == 256 || i + 1 == index_pos_) {
+            ssize_t size = n * sizeof(cx_page_entry);
+            ssize_t w = syscall(SYS_write, index_fd_, out, size);
+            check(w == size, "PageArchive:: Unable to write page index");
+            index_count_ += n;
+            n = 0;
+        }
+    }
+    index_pos_ = 0;
+}
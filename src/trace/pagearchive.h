@@ -0,0 +1,95 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#pragma once
+
+#include <linux/limits.h>
+
+#include "pagedelta.h"
+#include "pagefmt.h"
+#include "pagestore.h"
+
+namespace chopstix {
+
+struct PageArchive {
+  public:
+    ~PageArchive();
+
+    // With use_store, page contents go to the shared content-addressed
+    // pages.store and each trace only keeps references. With a
+    // delta_interval, pages are encoded against the previous trace, and
+    // every delta_interval traces one is written in full.
+    void setup(const char *trace_root, long pagesize, bool use_store = false,
+               long delta_interval = 0);
+
+    void start_trace(int trace_id);
+    void stop_trace(int trace_id);
+
+    // Reserve room for a page in the archive. The caller fills the returned
+    // pagesize bytes and then calls commit (or discard) before the next call.
+    char *append(unsigned long page_addr, unsigned int flags);
+    void commit();
+    // Drop the page returned by the last append
+    void discard();
+    void write_back();
+
+    bool is_open() const { return index_fd_ != -1; }
+
+  private:
+    static constexpr long buf_size = 1 << 20;
+    static constexpr long index_size = 1 << 16;
+    static constexpr long store_size = 1 << 20;
+    static constexpr long delta_size = 1 << 15;
+
+    void write_index();
+    void finish();
+
+    char trace_root_[PATH_MAX];
+    long pagesize_ = 0;
+
+    char buf_[buf_size] __attribute__((aligned(64)));
+    long pos_ = 0;
+    unsigned long data_off_ = 0;
+
+    cx_page_entry index_[index_size];
+    long index_pos_ = 0;
+    unsigned long index_count_ = 0;
+    unsigned int index_flags_ = 0;
+    unsigned int order_[index_size];
+
+    bool use_store_ = false;
+    PageStore store_;
+    unsigned long shared_ = 0;
+    unsigned long zero_ = 0;
+
+    long delta_interval_ = 0;
+    PageDelta delta_;
+    long traces_ = 0;
+    int trace_id_ = -1;
+    int base_ = -1;
+    unsigned long delta_pages_ = 0;
+    unsigned long delta_saved_ = 0;
+
+    int data_fd_ = -1;
+    int index_fd_ = -1;
+};
+
+}  // namespace chopstix
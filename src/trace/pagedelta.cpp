@@ -0,0 +1,126 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#include "pagedelta.h"
+#include "pagefmt.h"
+
+#include "support/check.h"
+#include "support/log.h"
+#include "support/safestring.h"
+
+#include <sys/mman.h>
+
+using namespace chopstix;
+
+namespace {
+// XOR/run-length encode page against base (see cx_page_delta_apply). Gives
+// up with -1 once the encoding reaches limit bytes.
+long encode(const char *page, const char *base, long size, char *out,
+            long limit) {
+    const uint64_t *p = (const uint64_t *)page;
+    const uint64_t *b = (const uint64_t *)base;
+    long n = size / sizeof(uint64_t);
+    long i = 0;
+    long len = 0;
+    while (i < n) {
+        cx_page_delta_run run = {0, 0};
+        while (i < n && p[i] == b[i] && run.skip < UINT16_MAX) {
+            ++run.skip;
+            ++i;
+        }
+        // Trailing unchanged words need no run
+        if (i == n) break;
+        long start = i;
+        while (i < n && p[i] != b[i] && run.words < UINT16_MAX) {
+            ++run.words;
+            ++i;
+        }
+        long run_len = sizeof(run) + run.words * sizeof(uint64_t);
+        if (len + run_len >= limit) return -1;
+        safe_memcpy(out + len, &run, sizeof(run));
+        len += sizeof(run);
+        for (long j = start; j < i; ++j) {
+            uint64_t x = p[j] ^ b[j];
+            safe_memcpy(out + len, &x, sizeof(x));
+            len += sizeof(x);
+        }
+    }
+    return len;
+}
+}  // namespace
+
+PageDelta::~PageDelta() {
+    if (table_ == nullptr) return;
+    munmap(table_, capacity_ * sizeof(slot));
+    munmap(contents_, (capacity_ + 1) * pagesize_);
+}
+
+void PageDelta::setup(unsigned long capacity, long pagesize) {
+    checkx((capacity & (capacity - 1)) == 0,
+           "PageDelta:: capacity must be a power of 2");
+    checkx(pagesize / sizeof(uint64_t) <= UINT16_MAX,
+           "PageDelta:: page size too large");
+    capacity_ = capacity;
+    pagesize_ = pagesize;
+    // Untouched slots and pages cost nothing, no need to populate
+    void *mem = mmap(nullptr, capacity_ * sizeof(slot), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    check(mem != MAP_FAILED, "PageDelta:: Unable to map hash table");
+    table_ = (slot *)mem;
+    mem = mmap(nullptr, (capacity_ + 1) * pagesize_, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    check(mem != MAP_FAILED, "PageDelta:: Unable to map page contents");
+    contents_ = (char *)mem;
+    scratch_ = contents_ + capacity_ * pagesize_;
+    log::verbose("PageDelta:: %d entries", capacity_);
+}
+
+long PageDelta::update(unsigned long page_addr, const char *page, int trace,
+                       int base) {
+    unsigned long mask = capacity_ - 1;
+    uint64_t hash = (page_addr / pagesize_) * 0x9e3779b97f4a7c15ULL;
+    for (unsigned long i = (hash >> 32) & mask;; i = (i + 1) & mask) {
+        slot &s = table_[i];
+        char *prev = contents_ + i * pagesize_;
+        if (s.addr == 0) {
+            // Keep a quarter of the table free to bound probe lengths
+            if (used_ >= capacity_ - capacity_ / 4) {
+                ++full_;
+                return -1;
+            }
+            s.addr = page_addr;
+            s.trace = trace;
+            safe_memcpy(prev, page, pagesize_);
+            ++used_;
+            return -1;
+        }
+        if (s.addr == page_addr) {
+            long len = -1;
+            if (base >= 0 && s.trace == base) {
+                // Not worth it (nor the dependency on base) past half a page
+                len = encode(page, prev, pagesize_, scratch_, pagesize_ / 2);
+            }
+            s.trace = trace;
+            if (len != 0) safe_memcpy(prev, page, pagesize_);
+            return len;
+        }
+    }
+}
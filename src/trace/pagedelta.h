@@ -0,0 +1,64 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#pragma once
+
+#include <stdint.h>
+
+namespace chopstix {
+
+// Latest contents of every page dumped, so the next dump of the same page
+// can be encoded as a difference against them. Storage is mapped on setup
+// (before tracing starts) and never grows: once the table is too loaded, new
+// pages are always dumped in full.
+struct PageDelta {
+  public:
+    ~PageDelta();
+
+    void setup(unsigned long capacity, long pagesize);
+
+    // Record page as the contents of page_addr in trace. If the page was
+    // last recorded in trace base, encode it against those contents and
+    // return the size of the encoding (0 if unchanged), available at
+    // encoded(). Returns -1 if the page has to be dumped in full.
+    long update(unsigned long page_addr, const char *page, int trace,
+                int base);
+    const char *encoded() const { return scratch_; }
+
+    unsigned long pages() const { return used_; }
+    unsigned long full() const { return full_; }
+
+  private:
+    struct slot {
+        uint64_t addr;
+        int64_t trace;
+    };
+
+    slot *table_ = nullptr;
+    char *contents_ = nullptr;  // One page per slot
+    char *scratch_ = nullptr;
+    unsigned long capacity_ = 0;
+    unsigned long used_ = 0;
+    unsigned long full_ = 0;
+    long pagesize_ = 0;
+};
+
+}  // namespace chopstix
@@ -0,0 +1,137 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : trace/pagefmt.h
+ * DESCRIPTION : On-disk layout of the per-trace page archive. Shared between
+ *               the tracing support library (writer) and the post-processing
+ *               tools (readers), hence plain C.
+ *
+ *               pages.<trace>.data : page contents, appended in fault order
+ *               pages.<trace>.idx  : header followed by one entry per page,
+ *                                    sorted by page address
+ *               pages.store        : unique page contents shared by all the
+ *                                    traces (-page-store). Entries flagged
+ *                                    CX_PAGE_STORED point into it.
+ *
+ *               Pages that are entirely zero have no contents in either
+ *               file, their entry is flagged CX_PAGE_ZERO.
+ *
+ *               With -page-delta, entries flagged CX_PAGE_DELTA hold the
+ *               difference against the same page in trace header.base
+ *               (see cx_page_delta_apply). That page may be a delta itself.
+ ******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define CX_PAGE_MAGIC "CXPAGES"
+#define CX_PAGE_VERSION 4
+
+// Index header flags
+#define CX_PAGE_INDEX_UNSORTED 0x1  // Entries not globally sorted
+
+// Index entry flags
+#define CX_PAGE_RESTRICTED 0x1  // Unprotected page dumped at end of trace
+#define CX_PAGE_STORED 0x2      // Offset refers to pages.store
+#define CX_PAGE_ZERO 0x4        // All zero, no contents stored (since v3)
+#define CX_PAGE_DELTA 0x8       // Difference against trace base (since v4)
+
+struct cx_page_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t count;
+    uint32_t flags;
+    uint32_t base;  // Trace CX_PAGE_DELTA entries refer to
+};
+
+struct cx_page_entry {
+    uint64_t addr;
+    uint64_t offset;  // Offset of contents in the data file
+    uint32_t size;
+    uint32_t flags;
+};
+
+// 128-bit hash of page contents used to address pages.store. Not
+// cryptographic, but wide enough that accidental collisions between page
+// contents are not a concern. Self-contained so it can run in the tracing
+// signal handler.
+static inline void cx_page_hash(const void *data, uint64_t size,
+                                uint64_t hash[2]) {
+    const uint64_t *w = (const uint64_t *)data;
+    uint64_t n = size / sizeof(uint64_t);
+    uint64_t h1 = 0x9e3779b97f4a7c15ULL ^ size;
+    uint64_t h2 = 0xc2b2ae3d27d4eb4fULL;
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t k = w[i] * 0x87c37b91114253d5ULL;
+        k = (k << 31) | (k >> 33);
+        h1 ^= k * 0x4cf5ad432745937fULL;
+        h1 = ((h1 << 27) | (h1 >> 37)) + h2;
+        h1 = h1 * 5 + 0x52dce729;
+        h2 ^= w[i] * 0xff51afd7ed558ccdULL;
+        h2 = ((h2 << 33) | (h2 >> 31)) + h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+    h1 ^= h1 >> 33;
+    h1 *= 0xc4ceb9fe1a85ec53ULL;
+    h1 ^= h1 >> 33;
+    h2 ^= h2 >> 29;
+    h2 *= 0xff51afd7ed558ccdULL;
+    h2 ^= h2 >> 32;
+    hash[0] = h1 + h2;
+    hash[1] = h2 + hash[0];
+}
+
+// A delta is a sequence of runs, in units of 64-bit words: skip words that
+// did not change, then words XORed with the previous contents. Unchanged
+// pages have an empty delta.
+struct cx_page_delta_run {
+    uint16_t skip;
+    uint16_t words;
+};
+
+// Apply a delta to page, which holds the previous contents. Returns 0 if the
+// delta does not fit in the page.
+static inline int cx_page_delta_apply(char *page, uint64_t page_size,
+                                      const char *delta, uint64_t size) {
+    uint64_t pos = 0;
+    uint64_t i = 0;
+    while (i + sizeof(struct cx_page_delta_run) <= size) {
+        struct cx_page_delta_run run;
+        memcpy(&run, delta + i, sizeof(run));
+        i += sizeof(run);
+        pos += (uint64_t)run.skip * sizeof(uint64_t);
+        uint64_t len = (uint64_t)run.words * sizeof(uint64_t);
+        if (pos + len > page_size || i + len > size) return 0;
+        for (uint64_t end = pos + len; pos < end; pos += sizeof(uint64_t)) {
+            uint64_t w, x;
+            memcpy(&w, page + pos, sizeof(w));
+            memcpy(&x, delta + i, sizeof(x));
+            w ^= x;
+            memcpy(page + pos, &w, sizeof(w));
+            i += sizeof(x);
+        }
+    }
+    return i == size;
+}
@@ -0,0 +1,75 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#include "pagestore.h"
+#include "pagefmt.h"
+
+#include "support/check.h"
+#include "support/log.h"
+
+#include <sys/mman.h>
+
+using namespace chopstix;
+
+PageStore::~PageStore() {
+    if (table_ != nullptr) munmap(table_, capacity_ * sizeof(slot));
+}
+
+void PageStore::setup(unsigned long capacity) {
+    checkx((capacity & (capacity - 1)) == 0,
+           "PageStore:: capacity must be a power of 2");
+    capacity_ = capacity;
+    // Untouched slots cost nothing, no need to populate
+    void *mem = mmap(nullptr, capacity_ * sizeof(slot), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    check(mem != MAP_FAILED, "PageStore:: Unable to map hash table");
+    table_ = (slot *)mem;
+    log::verbose("PageStore:: %d entries", capacity_);
+}
+
+bool PageStore::lookup_or_insert(const char *page, long size, uint64_t offset,
+                                 uint64_t &found) {
+    uint64_t hash[2];
+    cx_page_hash(page, size, hash);
+    // All-zero hash marks an empty slot
+    hash[1] |= 1;
+
+    unsigned long mask = capacity_ - 1;
+    for (unsigned long i = hash[0] & mask;; i = (i + 1) & mask) {
+        slot &s = table_[i];
+        if (s.hash[1] == 0) {
+            // Keep a quarter of the table free to bound probe lengths
+            if (used_ >= capacity_ - capacity_ / 4) {
+                ++full_;
+                return false;
+            }
+            s.hash[0] = hash[0];
+            s.hash[1] = hash[1];
+            s.offset = offset;
+            ++used_;
+            return false;
+        }
+        if (s.hash[0] == hash[0] && s.hash[1] == hash[1]) {
+            found = s.offset;
+            return true;
+        }
+    }
+}
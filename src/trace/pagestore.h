@@ -0,0 +1,58 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#pragma once
+
+#include <stdint.h>
+
+namespace chopstix {
+
+// Hash table from page contents to their offset in pages.store. Storage is
+// mapped on setup (before tracing starts) and never grows: once the table is
+// too loaded new pages are still stored, just not deduplicated.
+struct PageStore {
+  public:
+    ~PageStore();
+
+    void setup(unsigned long capacity);
+
+    // Look up the page contents. If an identical page was already stored,
+    // returns true and sets found to its offset. Otherwise records offset
+    // for these contents and returns false.
+    bool lookup_or_insert(const char *page, long size, uint64_t offset,
+                          uint64_t &found);
+
+    unsigned long unique() const { return used_; }
+    unsigned long full() const { return full_; }
+
+  private:
+    struct slot {
+        uint64_t hash[2];
+        uint64_t offset;
+    };
+
+    slot *table_ = nullptr;
+    unsigned long capacity_ = 0;
+    unsigned long used_ = 0;
+    unsigned long full_ = 0;
+};
+
+}  // namespace chopstix
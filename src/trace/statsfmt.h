@@ -0,0 +1,63 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : trace/statsfmt.h
+ * DESCRIPTION : Layout of the per-run tracing statistics file (_stats in the
+ *               trace directory). The tracing support library maps it shared
+ *               and updates the entry of the current trace from the signal
+ *               handler, so the counters survive a crash of the traced
+ *               process. Shared with the tracer and the post-processing
+ *               tools, hence plain C.
+ *
+ *               _stats : header followed by 'capacity' entries, one per
+ *                        trace id. Traces past the capacity only add to the
+ *                        totals in the header.
+ ******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+#define CX_STATS_FILE "_stats"
+#define CX_STATS_MAGIC "CXSTATS"
+#define CX_STATS_VERSION 1
+#define CX_STATS_MAX_TRACES 65536
+
+// Trace entry flags
+#define CX_STATS_DONE 0x1  // Trace stopped, counters are final
+
+struct cx_trace_stats {
+    uint64_t pages;       // Pages accessed for the first time
+    uint64_t faults;      // Faults handled (a page may fault twice)
+    uint64_t handler_ns;  // Time spent in the fault handler
+    uint64_t bytes;       // Bytes of page contents dumped
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct cx_stats_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity;  // Trace entries following the header
+    uint64_t traces;    // Traces started
+    struct cx_trace_stats total;  // Sum over the stopped traces
+};
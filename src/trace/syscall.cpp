@@ -0,0 +1,404 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#include "syscall.h"
+#include "config.h"
+
+#include "support/log.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// Bounds of the section holding syscall(), set by the linker
+extern "C" char __start_cx_syscall[] __attribute__((visibility("hidden")));
+extern "C" char __stop_cx_syscall[] __attribute__((visibility("hidden")));
+
+extern "C" __attribute__((visibility("hidden"), section("cx_syscall"),
+                          noinline)) long
+syscall(long number, ...) __THROW {
+    va_list ap;
+    va_start(ap, number);
+    long a = va_arg(ap, long);
+    long b = va_arg(ap, long);
+    long c = va_arg(ap, long);
+    long d = va_arg(ap, long);
+    long e = va_arg(ap, long);
+    long f = va_arg(ap, long);
+    va_end(ap);
+
+    long ret;
+#if defined(CHOPSTIX_X86_SUPPORT)
+    register long r10 __asm__("r10") = d;
+    register long r8 __asm__("r8") = e;
+    register long r9 __asm__("r9") = f;
+    __asm__ __volatile__("syscall"
+                         : "=a"(ret)
+                         : "a"(number), "D"(a), "S"(b), "d"(c), "r"(r10),
+                           "r"(r8), "r"(r9)
+                         : "rcx", "r11", "memory");
+#elif defined(CHOPSTIX_POWER_SUPPORT) || defined(CHOPSTIX_POWERLE_SUPPORT)
+    register long r0 __asm__("r0") = number;
+    register long r3 __asm__("r3") = a;
+    register long r4 __asm__("r4") = b;
+    register long r5 __asm__("r5") = c;
+    register long r6 __asm__("r6") = d;
+    register long r7 __asm__("r7") = e;
+    register long r8 __asm__("r8") = f;
+    // Errors are flagged in cr0.SO, with a positive errno
+    __asm__ __volatile__("sc; bns+ 1f; neg %1, %1; 1:"
+                         : "+r"(r0), "+r"(r3), "+r"(r4), "+r"(r5), "+r"(r6),
+                           "+r"(r7), "+r"(r8)
+                         :
+                         : "memory", "cr0", "r9", "r10", "r11", "r12");
+    ret = r3;
+#elif defined(CHOPSTIX_SYSZ_SUPPORT)
+    register long r1 __asm__("r1") = number;
+    register long r2 __asm__("r2") = a;
+    register long r3 __asm__("r3") = b;
+    register long r4 __asm__("r4") = c;
+    register long r5 __asm__("r5") = d;
+    register long r6 __asm__("r6") = e;
+    register long r7 __asm__("r7") = f;
+    __asm__ __volatile__("svc 0"
+                         : "+d"(r2)
+                         : "d"(r1), "d"(r3), "d"(r4), "d"(r5), "d"(r6),
+                           "d"(r7)
+                         : "memory");
+    ret = r2;
+#elif defined(CHOPSTIX_RISCV_SUPPORT)
+    register long a7 __asm__("a7") = number;
+    register long a0 __asm__("a0") = a;
+    register long a1 __asm__("a1") = b;
+    register long a2 __asm__("a2") = c;
+    register long a3 __asm__("a3") = d;
+    register long a4 __asm__("a4") = e;
+    register long a5 __asm__("a5") = f;
+    __asm__ __volatile__("ecall"
+                         : "+r"(a0)
+                         : "r"(a7), "r"(a1), "r"(a2), "r"(a3), "r"(a4),
+                           "r"(a5)
+                         : "memory");
+    ret = a0;
+#endif
+    if ((unsigned long)ret > -4096UL) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+using namespace chopstix;
+
+namespace {
+
+#if defined(CHOPSTIX_X86_SUPPORT)
+#define FILTER_ARCH AUDIT_ARCH_X86_64
+#elif defined(CHOPSTIX_POWER_SUPPORT)
+#define FILTER_ARCH AUDIT_ARCH_PPC64
+#elif defined(CHOPSTIX_POWERLE_SUPPORT)
+#define FILTER_ARCH AUDIT_ARCH_PPC64LE
+#elif defined(CHOPSTIX_SYSZ_SUPPORT)
+#define FILTER_ARCH AUDIT_ARCH_S390X
+#elif defined(CHOPSTIX_RISCV_SUPPORT) && defined(AUDIT_ARCH_RISCV64)
+#define FILTER_ARCH AUDIT_ARCH_RISCV64
+#endif
+
+// 32-bit halves of seccomp_data.instruction_pointer
+#define IP_OFFSET offsetof(struct seccomp_data, instruction_pointer)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define IP_LO IP_OFFSET
+#define IP_HI (IP_OFFSET + 4)
+#else
+#define IP_LO (IP_OFFSET + 4)
+#define IP_HI IP_OFFSET
+#endif
+
+// System calls always allowed, wherever they come from. They cannot be
+// issued again from the SIGSYS handler of an untraced thread: returning
+// from a signal, and creating a thread or process on a new stack. Changes
+// of the signal mask are allowed until the thread can trap, the handler
+// emulates them afterwards.
+const long allowed_calls[] = {
+    __NR_rt_sigreturn,
+    __NR_rt_sigprocmask,
+    __NR_clone,
+#ifdef __NR_clone3
+    __NR_clone3,
+#endif
+#ifdef __NR_fork
+    __NR_fork,
+#endif
+#ifdef __NR_vfork
+    __NR_vfork,
+#endif
+    // Thread setup by the C library, before the new thread can trap
+    __NR_set_robust_list,
+#ifdef __NR_rseq
+    __NR_rseq,
+#endif
+    // No memory of the program read or written: the trace goes on
+    __NR_getpid,
+    __NR_getppid,
+    __NR_gettid,
+#ifdef __NR_getpgrp
+    __NR_getpgrp,
+#endif
+    __NR_getuid,
+    __NR_geteuid,
+    __NR_getgid,
+    __NR_getegid,
+    __NR_sched_yield,
+};
+#define ALLOWED_COUNT (sizeof(allowed_calls) / sizeof(allowed_calls[0]))
+
+// Filter state of the calling thread
+#define FILTER_NONE 0
+#define FILTER_TRACE 1  // Traced thread: the tracer sees its system calls
+#define FILTER_TRAP 2   // Inherited: its system calls raise SIGSYS
+__thread int filter_state = FILTER_NONE;
+
+#if defined(FILTER_ARCH) && defined(SECCOMP_RET_TRACE)
+// Installs the filter on the calling thread: system calls from syscall()
+// and the ones allowed above run, the rest get action
+bool load_filter(unsigned int action) {
+    unsigned long begin = (unsigned long)__start_cx_syscall;
+    unsigned long end = (unsigned long)__stop_cx_syscall;
+    if ((begin >> 32) != (end >> 32)) {
+        log::verbose("install_syscall_filter: syscall() crosses a 4 GiB "
+                     "boundary");
+        return false;
+    }
+
+    // Trapping threads keep SIGSYS unblocked, see sigsys_handler
+    long allowed[ALLOWED_COUNT];
+    unsigned k = 0;
+    for (unsigned i = 0; i < ALLOWED_COUNT; ++i) {
+        if (action == SECCOMP_RET_TRAP &&
+            allowed_calls[i] == __NR_rt_sigprocmask) {
+            continue;
+        }
+        allowed[k++] = allowed_calls[i];
+    }
+
+    // Layout: arch and number checks, syscall() range, allow, action.
+    // Jumps are relative to the next instruction.
+    const unsigned allow = 8 + k;
+    const unsigned deny = 9 + k;
+    struct sock_filter code[10 + ALLOWED_COUNT];
+    unsigned n = 0;
+#define TO(target) ((uint8_t)((target) - n - 1))
+    code[n++] = BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                         offsetof(struct seccomp_data, arch));
+    code[n] = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FILTER_ARCH, 0, TO(deny));
+    ++n;
+    code[n++] = BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                         offsetof(struct seccomp_data, nr));
+    for (unsigned i = 0; i < k; ++i, ++n) {
+        code[n] = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)allowed[i],
+                           TO(allow), 0);
+    }
+    code[n++] = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, IP_HI);
+    code[n] = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)(begin >> 32), 0,
+                       TO(deny));
+    ++n;
+    code[n++] = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, IP_LO);
+    code[n] = BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, (uint32_t)begin, 0,
+                       TO(deny));
+    ++n;
+    code[n] = BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, (uint32_t)end, TO(deny),
+                       TO(allow));
+    ++n;
+#undef TO
+    code[n++] = BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    code[n++] = BPF_STMT(BPF_RET | BPF_K, action);
+    struct sock_fprog prog = {(unsigned short)n, code};
+
+    // No new privileges are only required without CAP_SYS_ADMIN
+    if (syscall(SYS_prctl, PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0,
+                0) == 0) {
+        return true;
+    }
+    if (errno == EACCES &&
+        syscall(SYS_prctl, PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0 &&
+        syscall(SYS_prctl, PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0,
+                0) == 0) {
+        return true;
+    }
+    log::verbose("install_syscall_filter: seccomp not available: %s",
+                 strerror(errno));
+    return false;
+}
+
+// Raised in the untraced threads for the system calls of the application:
+// does the call from syscall(), which the filters allow, and returns its
+// result as the kernel would have
+void sigsys_handler(int sig, siginfo_t *si, void *ptr) {
+    ucontext_t *uc = (ucontext_t *)ptr;
+    long a[6];
+#if defined(CHOPSTIX_X86_SUPPORT)
+    greg_t *gregs = uc->uc_mcontext.gregs;
+    a[0] = gregs[REG_RDI];
+    a[1] = gregs[REG_RSI];
+    a[2] = gregs[REG_RDX];
+    a[3] = gregs[REG_R10];
+    a[4] = gregs[REG_R8];
+    a[5] = gregs[REG_R9];
+#elif defined(CHOPSTIX_POWER_SUPPORT) || defined(CHOPSTIX_POWERLE_SUPPORT)
+    for (int i = 0; i < 6; ++i) a[i] = uc->uc_mcontext.gp_regs[3 + i];
+#elif defined(CHOPSTIX_SYSZ_SUPPORT)
+    for (int i = 0; i < 6; ++i) a[i] = uc->uc_mcontext.gregs[2 + i];
+#elif defined(CHOPSTIX_RISCV_SUPPORT)
+    for (int i = 0; i < 6; ++i) a[i] = uc->uc_mcontext.__gregs[10 + i];
+#endif
+    long ret;
+    if (si->si_syscall == __NR_rt_sigprocmask) {
+        // A system call with SIGSYS blocked would kill the process. The
+        // mask is the one restored when the handler returns.
+        uint64_t *mask = (uint64_t *)&uc->uc_sigmask;
+        uint64_t old = *mask;
+        ret = a[3] == sizeof(uint64_t) ? 0 : -EINVAL;
+        if (ret == 0 && a[1] != 0) {
+            uint64_t set = *(const uint64_t *)a[1];
+            if (a[0] == SIG_BLOCK) {
+                *mask |= set;
+            } else if (a[0] == SIG_UNBLOCK) {
+                *mask &= ~set;
+            } else if (a[0] == SIG_SETMASK) {
+                *mask = set;
+            } else {
+                ret = -EINVAL;
+            }
+            *mask &= ~(1UL << (SIGSYS - 1));
+        }
+        if (ret == 0 && a[2] != 0) *(uint64_t *)a[2] = old;
+    } else {
+        int saved_errno = errno;
+        ret = syscall(si->si_syscall, a[0], a[1], a[2], a[3], a[4], a[5]);
+        if (ret == -1) ret = -errno;
+        errno = saved_errno;
+    }
+#if defined(CHOPSTIX_X86_SUPPORT)
+    gregs[REG_RAX] = ret;
+#elif defined(CHOPSTIX_POWER_SUPPORT) || defined(CHOPSTIX_POWERLE_SUPPORT)
+    // Errors are flagged in cr0.SO, with a positive errno
+#ifndef PT_CCR
+#define PT_CCR 38
+#endif
+    const unsigned long so = 0x10000000UL;
+    if (ret < 0) {
+        uc->uc_mcontext.gp_regs[3] = -ret;
+        uc->uc_mcontext.gp_regs[PT_CCR] |= so;
+    } else {
+        uc->uc_mcontext.gp_regs[3] = ret;
+        uc->uc_mcontext.gp_regs[PT_CCR] &= ~so;
+    }
+#elif defined(CHOPSTIX_SYSZ_SUPPORT)
+    uc->uc_mcontext.gregs[2] = ret;
+#elif defined(CHOPSTIX_RISCV_SUPPORT)
+    uc->uc_mcontext.__gregs[10] = ret;
+#endif
+}
+
+void trap_syscalls() {
+    if (filter_state == FILTER_NONE) return;
+    // The inherited filter stops the thread for a tracer it does not have.
+    // SIGSYS takes precedence, so its system calls go through the handler.
+    if (filter_state == FILTER_TRACE) load_filter(SECCOMP_RET_TRAP);
+    filter_state = FILTER_TRAP;
+}
+
+struct thread_start {
+    void *(*routine)(void *);
+    void *arg;
+    int filter_state;  // Of the creating thread
+};
+
+void *filtered_thread(void *ptr) {
+    // Before any system call: the C library has already set up the thread
+    thread_start start = *(thread_start *)ptr;
+    filter_state = start.filter_state;
+    trap_syscalls();
+    free(ptr);
+    return start.routine(start.arg);
+}
+#endif
+
+}  // namespace
+
+bool chopstix::install_syscall_filter() {
+#if defined(FILTER_ARCH) && defined(SECCOMP_RET_TRACE)
+    if (filter_state != FILTER_NONE) return filter_state == FILTER_TRACE;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = &sigsys_handler;
+    if (sigaction(SIGSYS, &sa, NULL) != 0 || !load_filter(SECCOMP_RET_TRACE)) {
+        return false;
+    }
+    filter_state = FILTER_TRACE;
+    // Processes forked afterwards inherit it, not the tracer
+    pthread_atfork(NULL, NULL, &trap_syscalls);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Threads created by the application after the filter is installed inherit
+// it, but not the tracer. They add a filter of their own on start.
+extern "C" int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                              void *(*routine)(void *), void *arg) {
+    typedef int (*create_type)(pthread_t *, const pthread_attr_t *,
+                               void *(*)(void *), void *);
+    static create_type real_create = nullptr;
+    if (!real_create) {
+        real_create = (create_type)dlsym(RTLD_NEXT, "pthread_create");
+    }
+#if defined(FILTER_ARCH) && defined(SECCOMP_RET_TRACE)
+    if (filter_state != FILTER_NONE) {
+        thread_start *start = (thread_start *)malloc(sizeof(thread_start));
+        if (start == nullptr) return EAGAIN;
+        start->routine = routine;
+        start->arg = arg;
+        start->filter_state = filter_state;
+        int ret = real_create(thread, attr, &filtered_thread, start);
+        if (ret != 0) free(start);
+        return ret;
+    }
+#endif
+    return real_create(thread, attr, routine, arg);
+}
@@ -0,0 +1,41 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#pragma once
+
+namespace chopstix {
+
+// The tracing library has its own syscall(), hidden, so every system call it
+// does (e.g. from the SIGSEGV handler) comes from its code instead of libc.
+// The application keeps using the libc one.
+//
+// With -seccomp, install_syscall_filter sets up a seccomp filter on the
+// calling thread, the traced one, when the tracer arms it at the first region
+// of interest. System calls from this library, signal returns, thread or
+// process creation and the few that touch no memory of the program (e.g.
+// getpid) are allowed. Any other one stops the process for the tracer
+// (PTRACE_O_TRACESECCOMP must be set). Threads created afterwards with
+// pthread_create, and processes forked, are not traced: they add a filter
+// raising SIGSYS instead, whose handler does the system call from this
+// library. Returns false if not supported.
+bool install_syscall_filter();
+
+}  // namespace chopstix
@@ -22,21 +22,26 @@
 #include "system.h"
 #include "config.h"
 #include "memory.h"
+#include "syscall.h"
 #include "support/check.h"
 #include "support/filesystem.h"
 #include "support/log.h"
 #include "support/options.h"
+#include "support/safestring.h"
 #include "support/string.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <linux/limits.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <ucontext.h>
 #include <unistd.h>
 #include <dlfcn.h>
@@ -62,17 +67,65 @@ System::System() {
     max_traces = getopt("max-traces").as_int();
     group_iter = getopt("group").as_int(1);
     mem_trace = getopt("memory-access-trace").as_bool();
+    async_dump = save && getopt("async-dump").as_bool();
+    snapshot = getopt("snapshot").as_bool();
 
     filesystem::mkdir(trace_path);
 
     pagesize = sysconf(_SC_PAGESIZE);
 
+    // Mapped before notifying the parent, so it is never protected
+    stats_.setup(trace_path, max_traces);
+
     register_handlers();
 
     Memory::instance();
 
+    if (getopt("in-process").as_bool()) {
+        // Same as the statistics, mapped before notifying the parent
+        std::string module = getopt("module").as_string();
+        long offset = 0;
+        if (module != "" && module != "main") {
+            offset = Memory::instance().module_base(module.c_str());
+        }
+        auto begin = getopt("begin").as_hex_vec();
+        for (auto &addr : begin) addr += offset;
+        trampolines_.setup(trace_path, begin);
+    }
+
     if (drytrace) buf_.setup(trace_path);
     if (mem_trace) membuf_.setup(trace_path);
+    if (save) {
+        archive_.setup(trace_path, pagesize, getopt("page-store").as_bool(),
+                       getopt("page-delta").as_int(0));
+    }
+
+    if (mem_trace && Memory::instance().track_writes()) {
+        // Same as for the dump writer, create it before notifying the parent
+        int ret = pthread_create(&monitor_, NULL, &System::write_monitor, this);
+        checkx(ret == 0, "System:: Unable to create write monitor");
+        log::verbose("System:: Tracking writes with userfaultfd");
+    }
+
+    if (async_dump) {
+        // Ring and writer stack must exist before notifying the parent, so
+        // they are recorded as restricted and never protected
+        ring_.setup(getopt("dump-ring-mb").as_int(64), pagesize);
+        int ret = pthread_create(&writer_, NULL, &System::dump_writer, this);
+        checkx(ret == 0, "System:: Unable to create page dump writer");
+        log::verbose("System:: Asynchronous page dump enabled");
+    }
+
+    int mailbox_fd = getopt("mailbox-fd").as_int(-1);
+    unsetenv("CHOPSTIX_OPT_MAILBOX_FD");
+    if (mailbox_fd != -1 && mailbox_.setup(mailbox_fd)) {
+        // Also created before notifying the parent. Not traced, so its
+        // system calls do not stop the process.
+        int ret = pthread_create(&control_, NULL, &System::control_loop, this);
+        checkx(ret == 0, "System:: Unable to create control thread");
+        mailbox_.set_ready();
+        log::verbose("System:: Trace start/stop through the mailbox");
+    }
 
     sigaltstack(Memory::instance().alt_stack(), NULL);
 
@@ -101,9 +154,87 @@ System::System() {
     log::verbose("System:: End preload library initialization");
 }
 
-System::~System() {}
+System::~System() {
+    if (async_dump) {
+        ring_.drain();
+        ring_.shutdown();
+        pthread_join(writer_, NULL);
+    }
+}
+
+void *System::dump_writer(void *arg) {
+    // Runs concurrently with the traced code: only use the ring, the archive
+    // and raw system calls here, no logging.
+    System *self = (System *)arg;
+    unsigned long page_addr;
+    unsigned int flags;
+    char *data;
+    while (!self->ring_.stopped()) {
+        if (!self->ring_.peek(page_addr, flags, data)) {
+            self->ring_.wait();
+            continue;
+        }
+        char *page = self->archive_.append(page_addr, flags);
+        safe_memcpy(page, data, self->pagesize);
+        self->archive_.commit();
+        self->ring_.release();
+    }
+    return NULL;
+}
+
+void *System::write_monitor(void *arg) {
+    // The faulting thread stays blocked until the page is unprotected, so
+    // the memory trace buffer is not used concurrently
+    System *self = (System *)arg;
+    Memory &mem = Memory::instance();
+    unsigned long addr;
+    while (mem.uffd().wait_write(addr)) {
+        unsigned long page_addr = mem.page_addr(addr);
+        // The PC is only known if the write retries the access that
+        // faulted last (e.g. a store that first faulted as a read)
+        unsigned long pc_addr = 0;
+        if (page_addr == mem.page_addr(self->previous_addr)) {
+            pc_addr = self->previous_pc_addr;
+        }
+        log::debug("System::write_monitor: write at %x", addr);
+        if (self->tracing) {
+            self->membuf_.save_mem_write(pc_addr, addr);
+            ++self->stats_.current()->faults;
+        }
+        mem.uffd().write_protect(page_addr, self->pagesize, false);
+    }
+    return NULL;
+}
+
+void *System::control_loop(void *arg) {
+    // Signals are for the application threads. A fault still has to reach
+    // the handler, blocking it would kill the process.
+    sigset_t mask;
+    sigfillset(&mask);
+    sigdelset(&mask, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    // The traced thread stays stopped by the tracer until the command is
+    // completed. Once a trace starts, only the mailbox, this stack and raw
+    // system calls are touched until the next command.
+    System *self = (System *)arg;
+    for (;;) {
+        unsigned int command = self->mailbox_.wait();
+        const cx_mailbox *box = self->mailbox_.box();
+        if (command == CX_MAILBOX_START) {
+            self->start_trace(box->new_invocation != 0);
+        } else if (command == CX_MAILBOX_STOP) {
+            self->stop_trace();
+        } else {
+            log::info("System::control_loop: Unknown command %d", command);
+        }
+        self->mailbox_.complete();
+    }
+    return NULL;
+}
 
 void System::sigsegv_handler(int sig, siginfo_t *si, void *ptr) {
+    unsigned long start = TraceStats::ticks();
     log::debug("System::sigsegv_handler start");
     unsigned long pc_addr;
     ucontext_t *ctx = (ucontext_t *)ptr;
@@ -133,7 +264,37 @@ void System::sigsegv_handler(int sig, siginfo_t *si, void *ptr) {
 #endif
     log::debug("System::sigsegv_handler: PC Address = 0x%x", pc_addr);
     log::debug("System::sigsegv_handler: From Address = 0x%x", (unsigned long)si->si_addr);
-    sys_.record_segv((unsigned long)si->si_addr, pc_addr);
+
+    // Decode the kind of access from the fault state saved by the kernel.
+    // s390x and RISC-V do not expose it in the signal context.
+    int access = FAULT_UNKNOWN;
+#if defined(CHOPSTIX_POWER_SUPPORT) || defined(CHOPSTIX_POWERLE_SUPPORT)
+#define POWER_TRAP 40
+#define POWER_DSISR 42
+#define POWER_DSISR_ISSTORE 0x02000000
+    // Data storage interrupt: DSISR tells loads from stores. Instruction
+    // storage interrupt: instruction fetch, i.e. a read of the page.
+    unsigned long trap = ctx->uc_mcontext.gp_regs[POWER_TRAP] & ~0xfUL;
+    if (trap == 0x300) {
+        access = (ctx->uc_mcontext.gp_regs[POWER_DSISR] & POWER_DSISR_ISSTORE)
+                     ? FAULT_WRITE : FAULT_READ;
+    } else if (trap == 0x400) {
+        access = FAULT_READ;
+    }
+#elif defined(CHOPSTIX_X86_SUPPORT)
+#define X86_TRAP_PF 14
+#define X86_PF_WRITE 0x2
+    // Page fault error code: bit 1 set on writes
+    if (ctx->uc_mcontext.gregs[REG_TRAPNO] == X86_TRAP_PF) {
+        access = (ctx->uc_mcontext.gregs[REG_ERR] & X86_PF_WRITE)
+                     ? FAULT_WRITE : FAULT_READ;
+    }
+#endif
+    log::debug("System::sigsegv_handler: Access = %d", access);
+    sys_.record_segv((unsigned long)si->si_addr, pc_addr, access);
+
+    ++sys_.stats_.current()->faults;
+    sys_.stats_.add_handler_ticks(TraceStats::ticks() - start);
 }
 
 void System::register_handlers() {
@@ -172,7 +333,29 @@ void System::update_ttys() {
     chopstix::init = true;
 }
 
-void System::record_segv(unsigned long addr, unsigned long pc_addr) {
+bool System::mark_read_only(unsigned long page_addr) {
+    // Keep a quarter free so lookups of missing pages terminate quickly
+    if (read_only_count_ >= MAX_READ_ONLY_PAGES - MAX_READ_ONLY_PAGES / 4) {
+        return false;
+    }
+    unsigned long i = (page_addr / pagesize) % MAX_READ_ONLY_PAGES;
+    while (read_only_[i] != 0) i = (i + 1) % MAX_READ_ONLY_PAGES;
+    read_only_[i] = page_addr;
+    ++read_only_count_;
+    return true;
+}
+
+bool System::was_read_only(unsigned long page_addr) {
+    unsigned long i = (page_addr / pagesize) % MAX_READ_ONLY_PAGES;
+    while (read_only_[i] != 0) {
+        if (read_only_[i] == page_addr) return true;
+        i = (i + 1) % MAX_READ_ONLY_PAGES;
+    }
+    return false;
+}
+
+void System::record_segv(unsigned long addr, unsigned long pc_addr,
+                         int access) {
     log::debug("System::record_segv start");
     log::debug("System::record_segv: segv at %x", addr);
 
@@ -188,7 +371,46 @@ void System::record_segv(unsigned long addr, unsigned long pc_addr) {
     //    previous_addr, previous_pc_addr
     //);
 
-    if (mem_trace) {
+    if (mem_trace && access == FAULT_WRITE) {
+        // Write known from the first fault: no need for read access first
+        Memory::instance().unprotect_page(reg, page_addr);
+        if (reg->perm[2] == 'x') {
+            membuf_.save_code_write(pc_addr, addr);
+        } else {
+            membuf_.save_mem_write(pc_addr, addr);
+        }
+        // Page already dumped when it was first read
+        if (was_read_only(page_addr)) return;
+    } else if (mem_trace && access == FAULT_READ &&
+               (reg->wp || mark_read_only(page_addr))) {
+        // Only read access: a later write faults again (or is reported by
+        // the write monitor)
+        Memory::instance().unprotect_page_for_read(reg, page_addr);
+        previous_addr = addr;
+        previous_pc_addr = pc_addr;
+        if (reg->perm[2] == 'x') {
+            membuf_.save_code_write(pc_addr, addr);
+        } else {
+            membuf_.save_mem_read(pc_addr, addr);
+        }
+    } else if (mem_trace && access == FAULT_READ) {
+        // Read-only set full: a later write would not be told apart from
+        // the first access, so give full access now and count it as a write
+        log::debug("System::record_segv: read-only set full at %x", page_addr);
+        Memory::instance().unprotect_page(reg, page_addr);
+        if (reg->perm[2] == 'x') {
+            membuf_.save_code_write(pc_addr, addr);
+        } else {
+            membuf_.save_mem_write(pc_addr, addr);
+        }
+    } else if (mem_trace && reg->wp) {
+        // First access to the page, a later write is reported by the
+        // write monitor
+        Memory::instance().unprotect_page_for_read(reg, page_addr);
+        previous_addr = addr;
+        previous_pc_addr = pc_addr;
+        membuf_.save_mem_read(pc_addr, addr);
+    } else if (mem_trace) {
         if ((previous_addr == addr) && (previous_pc_addr == pc_addr)) {
             Memory::instance().unprotect_page(reg, page_addr);
             // Write from pc_addr to addr
@@ -221,6 +443,7 @@ void System::record_segv(unsigned long addr, unsigned long pc_addr) {
     }
 
     ++pagecount;
+    ++stats_.current()->pages;
 
     if (max_pages > 0 && pagecount > max_pages) {
         log::verbose("System::record_segv: max. pages reached, not saving");
@@ -228,18 +451,6 @@ void System::record_segv(unsigned long addr, unsigned long pc_addr) {
         if (save) {
             log::verbose("System::record_segv: saving %x", page_addr);
             save_page(page_addr);
-
-            char fname[PATH_MAX];
-            sfmt::format(fname, sizeof(fname), "%s/_page_count.%d", trace_path,
-                         trace_id);
-            int fd = syscall(SYS_openat, AT_FDCWD,fname, O_WRONLY | O_CREAT | O_TRUNC,
-                             PERM_664);
-            check(fd != -1, "System::record_segv: Unable to open %s", fname);
-            int val = syscall(SYS_write, fd, (void *)&pagecount, sizeof(int));
-            check(val == sizeof(int), "System::record_segv: Unable to write bytes");
-            syscall(SYS_close, fd);
-            log::debug("System::record_segv: writing %d to %s", pagecount,
-                       fname);
         }
     }
 
@@ -248,34 +459,42 @@ void System::record_segv(unsigned long addr, unsigned long pc_addr) {
     }
 }
 
-void System::save_page(unsigned long page_addr) {
+void System::save_page(unsigned long page_addr, unsigned int flags) {
     log::debug("System::save_page: start");
-    char fname[PATH_MAX];
     log::debug("System::save_page: saving %x", page_addr);
-    sfmt::format(fname, sizeof(fname), "%s/page.%d.%x", trace_path, trace_id,
-                 page_addr);
 
-    log::debug("System::save_page: opening %s", fname);
-    int fd = syscall(SYS_openat, AT_FDCWD, fname, O_WRONLY | O_CREAT | O_TRUNC,
-                     PERM_664);
-    check(fd != -1, "System::save_page: Unable to save page at '%s'", fname);
-
-    log::debug("System::save_page: writing to %s", fname);
-    ssize_t w = syscall(SYS_write, fd, (void *)page_addr, pagesize);
-    assert(w == pagesize && "System::save_page: Unable to write");
+    // Faulting pages go through the ring when dumping asynchronously, the
+    // writer thread moves them to the archive
+    bool via_ring = async_dump && !(flags & CX_PAGE_RESTRICTED);
+    char *page = via_ring ? ring_.reserve(page_addr, flags)
+                          : archive_.append(page_addr, flags);
+    if (flags & CX_PAGE_RESTRICTED) {
+        // Unprotected regions might not be readable (guard pages, vvar...).
+        // Let the kernel do the copy so those fail gracefully.
+        struct iovec local = {page, (size_t)pagesize};
+        struct iovec remote = {(void *)page_addr, (size_t)pagesize};
+        ssize_t r = syscall(SYS_process_vm_readv, syscall(SYS_getpid), &local,
+                            1, &remote, 1, 0);
+        if (r != pagesize) {
+            log::debug("System::save_page: %x not readable, skipping",
+                       page_addr);
+            archive_.discard();
+            return;
+        }
+    } else {
+        safe_memcpy(page, (void *)page_addr, pagesize);
+    }
 
     unsigned long offset_mask = pagesize - 1;
     unsigned long page_mask = ~offset_mask;
     for (int i = 0; i < breakpoint_count; i++) {
         BreakpointInformation &breakpoint = breakpoints[i];
 
-        unsigned long page = page_addr & page_mask;
         unsigned long breakpoint_page =
             (unsigned long) breakpoint.address & page_mask;
-        if (breakpoint_page == page) {
+        if (breakpoint_page == page_addr) {
             log::verbose("System::save_page: fixing breakpoint at 0x%x",
                        breakpoint.address);
-            syscall(SYS_lseek, fd, breakpoint.address & offset_mask, SEEK_SET);
             ssize_t size = sizeof(long);
             if (((breakpoint.address + size - 1) & page_mask) != (breakpoint.address & page_mask))
             {
@@ -283,13 +502,18 @@ void System::save_page(unsigned long page_addr) {
                 size = size - ((breakpoint.address + size) & offset_mask);
             }
 
-            w = syscall(SYS_write, fd, &breakpoint.original_content, size);
-            assert(w == size &&
-                   "System::save_page: Unable to restore breakpoint contents");
+            safe_memcpy(page + (breakpoint.address & offset_mask),
+                        &breakpoint.original_content, size);
         }
     }
 
-    syscall(SYS_close, fd);
+    if (via_ring) {
+        ring_.commit();
+    } else {
+        archive_.commit();
+    }
+    stats_.current()->bytes += pagesize;
+
     log::debug("System::save_page: finished saving %x", page_addr);
     log::debug("System::save_page: end");
 }
@@ -309,6 +533,10 @@ void System::start_trace(bool isNewInvocation) {
     // shared buffer can be stdout and stderr.
     //
 
+    if (mailbox_.enabled()) {
+        // Also when called in a snapshot, which does not keep the count
+        trace_id = mailbox_.box()->trace_id;
+    }
     log::debug("System: start_trace start (trace %d)", trace_id);
     check(tracing == false, "System: start_trace: Tracing already started");
 
@@ -316,27 +544,46 @@ void System::start_trace(bool isNewInvocation) {
         buf_.start_trace(trace_id, isNewInvocation);
     }
 
-    log::debug("System: start_trace: reading breakpoint information");
-    char fname[PATH_MAX];
-    sfmt::format(fname, sizeof(fname), "%s/_breakpoints", trace_path);
-    FILE *fp = fopen(fname, "rb");
-    fseek(fp, 0L, SEEK_END);
-    size_t size = ftell(fp);
-    unsigned int elements = size / sizeof(BreakpointInformation);
+    if (save) {
+        archive_.start_trace(trace_id);
+        if (async_dump) ring_.reset_stats();
+    }
+    stats_.start_trace(trace_id);
+
+    if (mailbox_.enabled()) {
+        const cx_mailbox *box = mailbox_.box();
+        check(box->breakpoint_count <= MAX_BREAKPOINTS,
+              "System: start_trace: Too many breakpoints enabled");
+        breakpoint_count = box->breakpoint_count;
+        for (int i = 0; i < breakpoint_count; ++i) {
+            breakpoints[i].address = box->breakpoints[i].addr;
+            breakpoints[i].original_content = box->breakpoints[i].original;
+        }
+        log::debug("System: start_trace: %d breakpoints in mailbox",
+                   breakpoint_count);
+    } else {
+        log::debug("System: start_trace: reading breakpoint information");
+        char fname[PATH_MAX];
+        sfmt::format(fname, sizeof(fname), "%s/_breakpoints", trace_path);
+        FILE *fp = fopen(fname, "rb");
+        fseek(fp, 0L, SEEK_END);
+        size_t size = ftell(fp);
+        unsigned int elements = size / sizeof(BreakpointInformation);
 
-    log::debug("System: start_trace: elements %d", elements);
-    check(elements <= MAX_BREAKPOINTS, "System: start_trace: Too many breakpoints enabled");
+        log::debug("System: start_trace: elements %d", elements);
+        check(elements <= MAX_BREAKPOINTS, "System: start_trace: Too many breakpoints enabled");
 
-    rewind(fp);
-    breakpoint_count = elements;
+        rewind(fp);
+        breakpoint_count = elements;
 
-    size_t w = fread(breakpoints, sizeof(BreakpointInformation), elements, fp);
-    log::debug("System: start_trace: elements readed %d", w);
+        size_t w = fread(breakpoints, sizeof(BreakpointInformation), elements, fp);
+        log::debug("System: start_trace: elements readed %d", w);
 
-    assert(w == elements && "System: start_trace: Unable to read all breakpoint information");
+        assert(w == elements && "System: start_trace: Unable to read all breakpoint information");
 
-    fclose(fp);
-    log::debug("System: start_Trace: stored info of %d breakpoints", elements);
+        fclose(fp);
+        log::debug("System: start_Trace: stored info of %d breakpoints", elements);
+    }
 
     log::debug("Tracing: %d", true);
     log::debug("Systen: start_trace end (trace %d)", trace_id);
@@ -347,6 +594,10 @@ void System::start_trace(bool isNewInvocation) {
     pagecount = 0;
     previous_addr = 0;
     previous_pc_addr = 0;
+    if (read_only_count_ > 0) {
+        for (int i = 0; i < MAX_READ_ONLY_PAGES; ++i) read_only_[i] = 0;
+        read_only_count_ = 0;
+    }
 
     // Check the right handler is set
     register_handlers();
@@ -387,11 +638,26 @@ void System::stop_trace() {
     }
 
     if (save) {
+        if (async_dump) {
+            // Restricted pages below go straight to the archive, after
+            // everything the handler queued
+            ring_.drain();
+            log::verbose("System:: stop_trace: async dump: %d pages, peak "
+                         "ring usage %d/%d slots",
+                         ring_.pages(), ring_.peak(), ring_.slots());
+            if (ring_.stalls() > 0) {
+                log::info("System:: stop_trace: async dump: handler stalled "
+                          "%d times (%d waits) on a full ring, consider "
+                          "increasing -dump-ring-mb",
+                          ring_.stalls(), ring_.stall_waits());
+            }
+        }
+
         unsigned long *page = Memory::restricted_pages();
         while (*page != 0) {
             log::verbose("System:: stop_trace: saving unprotected reserved "
                          "symbol pages:%x", *page);
-            save_page(*page);
+            save_page(*page, CX_PAGE_RESTRICTED);
             ++page;
         }
 
@@ -404,20 +670,33 @@ void System::stop_trace() {
             for (unsigned long page = reg->addr[0]; page < reg->addr[1];
                  page += pagesize) {
                 log::debug("System:: stop_trace: saving pages: 0x%x", page);
-                save_page(page);
+                save_page(page, CX_PAGE_RESTRICTED);
             }
             ++reg;
         }
+
+        archive_.stop_trace(trace_id);
     }
+    stats_.stop_trace();
 
     ++trace_id;
 
-    if (trace_id >= max_traces) {
+    if (trace_id >= max_traces || snapshot) {
+        // A snapshot is killed once the trace stops
         buf_.write_back();
     }
+    if (mem_trace && snapshot) membuf_.write_back();
     log::debug("System:: stop_trace end");
 
 }
+
+void System::filter_syscalls() {
+    // The tracer learns it from the mailbox
+    if (mailbox_.enabled() && install_syscall_filter()) {
+        mailbox_.set_syscall_filter();
+        log::verbose("System:: System calls filtered with seccomp");
+    }
+}
 }  // namespace chopstix
 
 void chopstix_start_trace(unsigned long isNewInvocation) {
@@ -435,6 +714,19 @@ void chopstix_stop_trace() {
     __asm__(".long 0x00000000");
     // raise(SIGTRAP);
 }
+void chopstix_filter_syscalls() {
+    chopstix::sys_.filter_syscalls();
+    __asm__(".long 0x00000000");
+    __asm__(".long 0x00000000");
+}
+void chopstix_snapshot() {
+    // Raw fork, without the atfork handlers of the application. The copy is
+    // a child of the tracer, which follows it (PTRACE_O_TRACEFORK) and
+    // resets its registers before running it.
+    syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    __asm__(".long 0x00000000");
+    __asm__(".long 0x00000000");
+}
 
 //
 // Disable printf system calls during tracing
@@ -22,14 +22,26 @@
 #pragma once
 
 #include <linux/limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 
 #include "buffer.h"
+#include "dumpring.h"
+#include "mailbox.h"
 #include "membuffer.h"
+#include "pagearchive.h"
+#include "tracestats.h"
+#include "trampoline.h"
 
 #define MAX_BREAKPOINTS 1024
 #define MAX_FDS 124
+#define MAX_READ_ONLY_PAGES 16384
+
+// Kind of access that caused a fault, if the architecture tells
+#define FAULT_UNKNOWN 0
+#define FAULT_READ 1
+#define FAULT_WRITE 2
 
 namespace chopstix {
 
@@ -47,6 +59,9 @@ struct System {
 
     void start_trace(bool isNewInvocation);
     void stop_trace();
+    // Install the seccomp filter on the calling thread (-seccomp), called by
+    // the tracer at the first region of interest
+    void filter_syscalls();
     volatile bool tracing = false;
 
     int tty_fds[MAX_FDS];
@@ -60,14 +75,19 @@ struct System {
     ~System();
 
     static void sigsegv_handler(int, siginfo_t *, void *);
+    static void *dump_writer(void *);
+    static void *write_monitor(void *);
+    static void *control_loop(void *);
 
     // Settings
     char trace_path[PATH_MAX];
 
     void register_handlers();
     void update_ttys();
-    void record_segv(unsigned long addr, unsigned long pc_addr);
-    void save_page(unsigned long page_addr);
+    void record_segv(unsigned long addr, unsigned long pc_addr, int access);
+    bool mark_read_only(unsigned long page_addr);
+    bool was_read_only(unsigned long page_addr);
+    void save_page(unsigned long page_addr, unsigned int flags = 0);
 
     int trace_id = 0;
     long pagesize;
@@ -81,12 +101,26 @@ struct System {
     bool drytrace;
     TraceBuffer buf_;
     MemBuffer membuf_;
+    PageArchive archive_;
+    TraceStats stats_;
+    Trampolines trampolines_;
+    DumpRing ring_;
+    bool async_dump = false;
+    bool snapshot = false;
+    pthread_t writer_;
+    pthread_t monitor_;
+    Mailbox mailbox_;
+    pthread_t control_;
     BreakpointInformation breakpoints[MAX_BREAKPOINTS];
     int breakpoint_count = 0;
 
     bool mem_trace = false;
     unsigned long previous_addr;
     unsigned long previous_pc_addr;
+    // Pages of the current trace granted read access only, when faults are
+    // classified on the first signal (open addressing, 0 is empty)
+    unsigned long read_only_[MAX_READ_ONLY_PAGES];
+    int read_only_count_ = 0;
 
 };
 }  // namespace chopstix
@@ -94,4 +128,6 @@ struct System {
 extern "C" {
 void chopstix_start_trace(unsigned long isNewInvocation);
 void chopstix_stop_trace();
+void chopstix_filter_syscalls();
+void chopstix_snapshot();
 }
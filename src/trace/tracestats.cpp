@@ -0,0 +1,132 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#include "tracestats.h"
+#include "config.h"
+
+#include "support/check.h"
+#include "support/log.h"
+#include "support/safeformat.h"
+#include "support/safestring.h"
+
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PERM_664 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH
+
+using namespace chopstix;
+
+namespace {
+unsigned long now_ns() {
+    struct timespec ts;
+    syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+}  // namespace
+
+TraceStats::~TraceStats() {
+    if (header_ != nullptr) munmap(header_, map_size_);
+}
+
+void TraceStats::setup(const char *trace_root, long max_traces) {
+    long capacity = CX_STATS_MAX_TRACES;
+    if (max_traces > 0 && max_traces < capacity) capacity = max_traces;
+    map_size_ = sizeof(cx_stats_header) + capacity * sizeof(cx_trace_stats);
+
+    char fpath[PATH_MAX];
+    sfmt::format(fpath, sizeof(fpath), "%s/" CX_STATS_FILE, trace_root);
+    int fd = syscall(SYS_openat, AT_FDCWD, fpath, O_RDWR | O_CREAT | O_TRUNC,
+                     PERM_664);
+    check(fd != -1, "TraceStats:: Unable to open '%s'", fpath);
+    int ret = ftruncate(fd, map_size_);
+    check(ret == 0, "TraceStats:: Unable to size '%s'", fpath);
+    void *mem = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    check(mem != MAP_FAILED, "TraceStats:: Unable to map '%s'", fpath);
+    syscall(SYS_close, fd);
+
+    header_ = (cx_stats_header *)mem;
+    safe_strncpy(header_->magic, CX_STATS_MAGIC, sizeof(header_->magic));
+    header_->version = CX_STATS_VERSION;
+    header_->capacity = capacity;
+    cur_ = (cx_trace_stats *)(header_ + 1);
+}
+
+void TraceStats::start_trace(int trace_id) {
+    if (header_ == nullptr) return;
+    ++header_->traces;
+    if ((unsigned long)trace_id < header_->capacity) {
+        cur_ = (cx_trace_stats *)(header_ + 1) + trace_id;
+    } else {
+        cur_ = &overflow_;
+    }
+    memset(cur_, 0, sizeof(*cur_));
+    handler_ticks_ = 0;
+    start_ns_ = now_ns();
+    start_ticks_ = ticks();
+}
+
+void TraceStats::stop_trace() {
+    if (header_ == nullptr) return;
+    unsigned long trace_ticks = ticks() - start_ticks_;
+    unsigned long trace_ns = now_ns() - start_ns_;
+    if (trace_ticks > 0) {
+        cur_->handler_ns = (double)handler_ticks_ * trace_ns / trace_ticks;
+    }
+    cx_trace_stats &total = header_->total;
+    total.pages += cur_->pages;
+    total.faults += cur_->faults;
+    total.handler_ns += cur_->handler_ns;
+    total.bytes += cur_->bytes;
+    cur_->flags |= CX_STATS_DONE;
+    log::verbose("TraceStats:: %d pages, %d faults, %d us in handler, %d "
+                 "bytes dumped",
+                 cur_->pages, cur_->faults, cur_->handler_ns / 1000,
+                 cur_->bytes);
+}
+
+unsigned long TraceStats::ticks() {
+#if defined(CHOPSTIX_X86_SUPPORT)
+    unsigned int lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long)hi << 32) | lo;
+#elif defined(CHOPSTIX_POWER_SUPPORT) || defined(CHOPSTIX_POWERLE_SUPPORT)
+    unsigned long tb;
+    __asm__ __volatile__("mfspr %0, 268" : "=r"(tb));  // Time base
+    return tb;
+#elif defined(CHOPSTIX_SYSZ_SUPPORT)
+    unsigned long tod;
+    __asm__ __volatile__("stckf %0" : "=Q"(tod) : : "cc");
+    return tod;
+#elif defined(CHOPSTIX_RISCV_SUPPORT)
+    unsigned long time;
+    __asm__ __volatile__("rdtime %0" : "=r"(time));
+    return time;
+#else
+    return now_ns();
+#endif
+}
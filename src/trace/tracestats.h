@@ -0,0 +1,58 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#pragma once
+
+#include "statsfmt.h"
+
+namespace chopstix {
+
+// Shared mapping of the _stats file. Mapped once on setup, before the
+// parent records the restricted regions, so updating it never faults.
+struct TraceStats {
+  public:
+    ~TraceStats();
+
+    void setup(const char *trace_root, long max_traces);
+
+    void start_trace(int trace_id);
+    void stop_trace();
+
+    // Entry of the current trace
+    cx_trace_stats *current() { return cur_; }
+
+    // Time stamp read from the cycle or time base counter, without a system
+    // call, for the fault handler. The ticks added are converted to
+    // nanoseconds on stop_trace, against the monotonic clock over the trace.
+    static unsigned long ticks();
+    void add_handler_ticks(unsigned long ticks) { handler_ticks_ += ticks; }
+
+  private:
+    cx_stats_header *header_ = nullptr;
+    unsigned long map_size_ = 0;
+    cx_trace_stats overflow_ = {};
+    cx_trace_stats *cur_ = &overflow_;
+    unsigned long handler_ticks_ = 0;
+    unsigned long start_ticks_ = 0;
+    unsigned long start_ns_ = 0;
+};
+
+}  // namespace chopstix
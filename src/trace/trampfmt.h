@@ -0,0 +1,63 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : trace/trampfmt.h
+ * DESCRIPTION : Layout of the in-process region trigger file (_trampolines in
+ *               the trace directory), used with -in-process. The tracing
+ *               support library patches a jump to a stub at every -begin
+ *               address. The stubs count the invocations in this file and
+ *               only stop the process (illegal instruction at 'trap') when
+ *               the countdown set by the tracer reaches zero. Both processes
+ *               map it shared, hence plain C.
+ *
+ *               _trampolines : header followed by 'count' entries. A count
+ *                              of 0 means trampolines are not available and
+ *                              the tracer uses breakpoints.
+ ******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+#define CX_TRAMP_FILE "_trampolines"
+#define CX_TRAMP_MAGIC "CXTRAMP"
+#define CX_TRAMP_VERSION 1
+#define CX_TRAMP_MAX 64
+
+struct cx_trampoline {
+    uint64_t addr;      // Begin address, patched with a jump to the stub
+    uint64_t trap;      // Stop address in the stub, reported as SIGILL
+    uint64_t original;  // Word at addr without the jump
+    uint64_t patched;   // Word at addr with the jump
+};
+
+struct cx_tramp_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;     // Trampolines set
+    // Updated by the stubs, in this order: countdown is decremented on each
+    // invocation and the stub traps when it reaches 0. The tracer sets it to
+    // the invocations left before the next trace (INT64_MAX for never).
+    int64_t countdown;
+    uint64_t hits;      // Invocations (executions of a begin address)
+    struct cx_trampoline entries[CX_TRAMP_MAX];
+};
@@ -0,0 +1,388 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#include "trampoline.h"
+#include "config.h"
+#include "memory.h"
+
+#include "support/check.h"
+#include "support/log.h"
+#include "support/safeformat.h"
+#include "support/safestring.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define PERM_664 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH
+
+using namespace chopstix;
+
+namespace {
+
+#if defined(CHOPSTIX_X86_SUPPORT)
+
+#define JMP_SIZE 5     // jmp rel32 patched at each begin address
+#define STUB_SIZE 160  // Stub code plus the displaced instructions
+#define STUB_TRAP 38   // Offset of the ud2 in the stub
+#define RANGE ((1L << 31) - (1L << 20))  // Reach of rel32, with some slack
+
+#define BRANCH_NONE -1
+#define BRANCH_JMP 16  // Otherwise the condition code of a jcc
+
+struct insn {
+    int len;
+    int rip_disp;  // Offset of the RIP-relative displacement, 0 if none
+    int branch;    // Relative jump, its displacement ends the instruction
+    int rel_size;
+};
+
+// Decode the x86-64 instruction at code. Only the usual general purpose,
+// x87 and SSE encodings are known. Returns false for anything else and for
+// relative calls and loops, which cannot be moved.
+bool decode_insn(const unsigned char *code, insn &in) {
+    const unsigned char *p = code;
+    bool opsize = false;
+    bool rex_w = false;
+    in.rip_disp = 0;
+    in.branch = BRANCH_NONE;
+    in.rel_size = 0;
+    for (;; ++p) {
+        if (p - code > 4) return false;
+        if (*p == 0x66) {
+            opsize = true;
+        } else if (*p != 0xf0 && *p != 0xf2 && *p != 0xf3 && *p != 0x26 &&
+                   *p != 0x2e && *p != 0x36 && *p != 0x3e && *p != 0x64 &&
+                   *p != 0x65) {
+            break;
+        }
+    }
+    if ((*p & 0xf0) == 0x40) rex_w = *p++ & 0x08;
+
+    unsigned char op = *p++;
+    int immz = opsize ? 2 : 4;
+    bool modrm = false;
+    int imm = 0;
+    if (op == 0x0f) {
+        op = *p++;
+        if (op == 0x05 || op == 0x0b || op == 0x31 || op == 0xa0 ||
+            op == 0xa1 || op == 0xa2 || op == 0xa8 || op == 0xa9 ||
+            (op >= 0xc8 && op <= 0xcf)) {
+        } else if ((op >= 0x70 && op <= 0x73) || op == 0xa4 || op == 0xac ||
+                   op == 0xba || op == 0xc2 || (op >= 0xc4 && op <= 0xc6)) {
+            modrm = true;
+            imm = 1;
+        } else if (op >= 0x80 && op <= 0x8f && !opsize) {
+            in.branch = op & 0xf;
+            in.rel_size = imm = 4;
+        } else if (op <= 0x01 || op == 0x0d || (op >= 0x10 && op <= 0x1f) ||
+                   (op >= 0x28 && op <= 0x2f) || (op >= 0x40 && op <= 0x6f) ||
+                   (op >= 0x74 && op <= 0x76) || op == 0x7e || op == 0x7f ||
+                   (op >= 0x90 && op <= 0x9f) || op == 0xa3 || op == 0xa5 ||
+                   op == 0xab || (op >= 0xad && op <= 0xb1) || op == 0xb3 ||
+                   op == 0xb6 || op == 0xb7 || (op >= 0xbb && op <= 0xc1) ||
+                   op == 0xc3 || op == 0xc7 || (op >= 0xd0 && op <= 0xfe)) {
+            modrm = true;
+        } else {
+            return false;
+        }
+    } else if (op < 0x40) {
+        switch (op & 7) {
+            case 0: case 1: case 2: case 3: modrm = true; break;
+            case 4: imm = 1; break;
+            case 5: imm = immz; break;
+            default: return false;
+        }
+    } else if ((op >= 0x50 && op <= 0x5f) || (op >= 0x90 && op <= 0x99) ||
+               (op >= 0x9b && op <= 0x9f) || (op >= 0xa4 && op <= 0xa7) ||
+               (op >= 0xaa && op <= 0xaf) || op == 0xc3 || op == 0xc9 ||
+               op == 0xcc || op == 0xf4 || op == 0xf5 ||
+               (op >= 0xf8 && op <= 0xfd)) {
+    } else if (op == 0x63 || (op >= 0x84 && op <= 0x8f) ||
+               (op >= 0xd0 && op <= 0xd3) || (op >= 0xd8 && op <= 0xdf) ||
+               op == 0xfe || op == 0xff) {
+        modrm = true;
+    } else if (op == 0x6a || op == 0xa8 || (op >= 0xb0 && op <= 0xb7)) {
+        imm = 1;
+    } else if (op == 0x68 || op == 0xa9) {
+        imm = immz;
+    } else if (op >= 0xb8 && op <= 0xbf) {
+        imm = rex_w ? 8 : immz;
+    } else if (op == 0x6b || op == 0x80 || op == 0x83 || op == 0xc0 ||
+               op == 0xc1 || op == 0xc6) {
+        modrm = true;
+        imm = 1;
+    } else if (op == 0x69 || op == 0x81 || op == 0xc7) {
+        modrm = true;
+        imm = immz;
+    } else if (((op >= 0x70 && op <= 0x7f) || op == 0xeb) && !opsize) {
+        in.branch = op == 0xeb ? BRANCH_JMP : op & 0xf;
+        in.rel_size = imm = 1;
+    } else if (op == 0xe9 && !opsize) {
+        in.branch = BRANCH_JMP;
+        in.rel_size = imm = 4;
+    } else if (op == 0xc2) {
+        imm = 2;
+    } else if (op == 0xc8) {
+        imm = 3;
+    } else if (op == 0xf6 || op == 0xf7) {
+        modrm = true;
+        // Only test (/0 and /1) has an immediate
+        if (((*p >> 3) & 7) < 2) imm = op == 0xf6 ? 1 : immz;
+    } else {
+        return false;
+    }
+
+    if (modrm) {
+        unsigned char m = *p++;
+        int mod = m >> 6;
+        int rm = m & 7;
+        if (mod != 3 && rm == 4) {
+            unsigned char sib = *p++;
+            if (mod == 0 && (sib & 7) == 5) p += 4;
+        } else if (mod == 0 && rm == 5) {
+            in.rip_disp = p - code;
+            p += 4;
+        }
+        if (mod == 1) p += 1;
+        if (mod == 2) p += 4;
+    }
+    in.len = p + imm - code;
+    return true;
+}
+
+bool in_range(unsigned long from, unsigned long to) {
+    long dist = to - from;
+    return dist < RANGE && dist > -RANGE;
+}
+
+unsigned char *emit(unsigned char *p, const char *bytes, int n) {
+    safe_memcpy(p, bytes, n);
+    return p + n;
+}
+
+unsigned char *emit_rel32(unsigned char *p, unsigned char op,
+                          unsigned long target) {
+    *p++ = op;
+    int32_t rel = target - ((unsigned long)p + 4);
+    return emit(p, (const char *)&rel, sizeof(rel));
+}
+
+// Copy the instructions overwritten by the jump at addr to code, fixing
+// their RIP-relative displacements and turning relative jumps into their
+// rel32 form, followed by a jump back. Returns the end of the copy, nullptr
+// if the code cannot be moved.
+unsigned char *relocate(unsigned long addr, unsigned char *code) {
+    const unsigned char *src = (const unsigned char *)addr;
+    int len = 0;
+    while (len < JMP_SIZE) {
+        insn in;
+        if (!decode_insn(src + len, in)) return nullptr;
+        unsigned long next = addr + len + in.len;
+        if (in.branch != BRANCH_NONE) {
+            long rel;
+            if (in.rel_size == 1) {
+                rel = (int8_t)src[len + in.len - 1];
+            } else {
+                int32_t rel32;
+                safe_memcpy(&rel32, src + len + in.len - 4, sizeof(rel32));
+                rel = rel32;
+            }
+            unsigned long target = next + rel;
+            // Into the bytes replaced by the jump
+            if (target > addr && target < addr + JMP_SIZE) return nullptr;
+            if (!in_range((unsigned long)code, target)) return nullptr;
+            if (in.branch == BRANCH_JMP) {
+                code = emit_rel32(code, 0xe9, target);
+            } else {
+                *code++ = 0x0f;
+                code = emit_rel32(code, 0x80 | in.branch, target);
+            }
+        } else {
+            safe_memcpy(code, src + len, in.len);
+            if (in.rip_disp != 0) {
+                int32_t rel;
+                safe_memcpy(&rel, src + len + in.rip_disp, sizeof(rel));
+                long moved = next + rel - ((long)code + in.len);
+                if (moved != (int32_t)moved) return nullptr;
+                rel = moved;
+                safe_memcpy(code + in.rip_disp, &rel, sizeof(rel));
+            }
+            code += in.len;
+        }
+        len += in.len;
+    }
+    return emit_rel32(code, 0xe9, addr + len);
+}
+
+// Stub for the begin address addr at code. Counts the invocation, traps if
+// the countdown reached 0, otherwise runs the displaced instructions and
+// jumps back. Returns false if the code at addr cannot be moved.
+bool build_stub(unsigned long addr, unsigned char *code, int64_t *countdown) {
+    // Skip the red zone, save flags and %rax
+    unsigned char *p = emit(code, "\x48\x8d\x64\x24\x80\x9c\x50", 7);
+    p = emit(p, "\x48\xb8", 2);  // movabs $countdown, %rax
+    p = emit(p, (const char *)&countdown, sizeof(countdown));
+    p = emit(p, "\xf0\x48\xff\x40\x08", 5);  // lock incq 8(%rax) (hits)
+    p = emit(p, "\xf0\x48\xff\x08", 4);      // lock decq (%rax)
+    p = emit(p, "\x58\x75\x0b", 3);          // pop %rax; jnz skip
+    // Restore flags and stack, stop for the tracer
+    p = emit(p, "\x9d\x48\x8d\xa4\x24\x80\x00\x00\x00", 9);
+    p = emit(p, "\x0f\x0b", 2);  // ud2, at STUB_TRAP
+    // skip: restore flags and stack, run the original code
+    p = emit(p, "\x9d\x48\x8d\xa4\x24\x80\x00\x00\x00", 9);
+    return relocate(addr, p) != nullptr;
+}
+
+// Stub area reachable with a rel32 from all the begin addresses
+unsigned char *map_stubs(std::vector<long> &begin, unsigned long size,
+                         long pagesize) {
+    unsigned long base = begin.front() & ~(pagesize - 1);
+    for (unsigned long step = 1UL << 20; step < (1UL << 31); step <<= 1) {
+        for (int dir = -1; dir <= 1; dir += 2) {
+            unsigned long hint = base + dir * step;
+            void *mem = mmap((void *)hint, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) continue;
+            bool reach = true;
+            for (auto addr : begin) {
+                reach = reach && in_range(addr, (unsigned long)mem) &&
+                        in_range(addr, (unsigned long)mem + size);
+            }
+            if (reach) return (unsigned char *)mem;
+            munmap(mem, size);
+        }
+    }
+    return nullptr;
+}
+
+#endif
+
+}  // namespace
+
+void Trampolines::setup(const char *trace_root, std::vector<long> begin) {
+    char fpath[PATH_MAX];
+    sfmt::format(fpath, sizeof(fpath), "%s/" CX_TRAMP_FILE, trace_root);
+    int fd = syscall(SYS_openat, AT_FDCWD, fpath, O_RDWR | O_CREAT | O_TRUNC,
+                     PERM_664);
+    check(fd != -1, "Trampolines:: Unable to open '%s'", fpath);
+    int ret = ftruncate(fd, sizeof(cx_tramp_header));
+    check(ret == 0, "Trampolines:: Unable to size '%s'", fpath);
+    void *mem = mmap(nullptr, sizeof(cx_tramp_header), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    check(mem != MAP_FAILED, "Trampolines:: Unable to map '%s'", fpath);
+    syscall(SYS_close, fd);
+
+    header_ = (cx_tramp_header *)mem;
+    safe_strncpy(header_->magic, CX_TRAMP_MAGIC, sizeof(header_->magic));
+    header_->version = CX_TRAMP_VERSION;
+    header_->countdown = INT64_MAX;
+
+    std::sort(begin.begin(), begin.end());
+    begin.erase(std::unique(begin.begin(), begin.end()), begin.end());
+    if (build(begin)) {
+        patch();
+        log::verbose("Trampolines:: %d begin addresses patched",
+                     header_->count);
+    }
+}
+
+bool Trampolines::build(std::vector<long> &begin) {
+#if defined(CHOPSTIX_X86_SUPPORT)
+    if (begin.empty()) return false;
+    if (begin.size() > CX_TRAMP_MAX) {
+        log::verbose("Trampolines:: more than %d begin addresses",
+                     CX_TRAMP_MAX);
+        return false;
+    }
+    Memory &mem = Memory::instance();
+    for (size_t i = 0; i < begin.size(); ++i) {
+        // Restoring one jump rewrites the whole word of the tracer
+        if (i > 0 && begin[i] - begin[i - 1] < (long)sizeof(long)) {
+            log::verbose("Trampolines:: begin addresses 0x%x and 0x%x "
+                         "overlap", begin[i - 1], begin[i]);
+            return false;
+        }
+        if (mem.mapping_prot(begin[i]) == -1 ||
+            mem.mapping_prot(begin[i] + sizeof(long) - 1) == -1) {
+            log::verbose("Trampolines:: 0x%x not mapped", begin[i]);
+            return false;
+        }
+    }
+
+    long pagesize = sysconf(_SC_PAGESIZE);
+    stubs_size_ = begin.size() * STUB_SIZE;
+    stubs_size_ = (stubs_size_ + pagesize - 1) / pagesize * pagesize;
+    stubs_ = map_stubs(begin, stubs_size_, pagesize);
+    if (stubs_ == nullptr) {
+        log::verbose("Trampolines:: no stub area within reach");
+        return false;
+    }
+    for (size_t i = 0; i < begin.size(); ++i) {
+        unsigned char *stub = stubs_ + i * STUB_SIZE;
+        if (!build_stub(begin[i], stub, &header_->countdown)) {
+            log::verbose("Trampolines:: code at 0x%x cannot be moved",
+                         begin[i]);
+            munmap(stubs_, stubs_size_);
+            stubs_ = nullptr;
+            return false;
+        }
+        cx_trampoline &entry = header_->entries[i];
+        entry.addr = begin[i];
+        entry.trap = (unsigned long)stub + STUB_TRAP;
+    }
+    int ret = mprotect(stubs_, stubs_size_, PROT_READ | PROT_EXEC);
+    check(ret == 0, "Trampolines:: Unable to protect stubs");
+    header_->count = begin.size();
+    return true;
+#else
+    log::verbose("Trampolines:: not supported on this architecture");
+    return false;
+#endif
+}
+
+void Trampolines::patch() {
+#if defined(CHOPSTIX_X86_SUPPORT)
+    Memory &mem = Memory::instance();
+    long pagesize = sysconf(_SC_PAGESIZE);
+    for (unsigned i = 0; i < header_->count; ++i) {
+        cx_trampoline &entry = header_->entries[i];
+        unsigned long first = mem.page_addr(entry.addr);
+        unsigned long last = mem.page_addr(entry.addr + sizeof(long) - 1);
+        unsigned long len = last + pagesize - first;
+        int prot = mem.mapping_prot(entry.addr);
+        safe_memcpy(&entry.original, (void *)entry.addr, sizeof(long));
+        int ret = mprotect((void *)first, len, prot | PROT_WRITE);
+        check(ret == 0, "Trampolines:: Unable to patch 0x%x", entry.addr);
+        emit_rel32((unsigned char *)entry.addr, 0xe9,
+                   (unsigned long)stubs_ + i * STUB_SIZE);
+        ret = mprotect((void *)first, len, prot);
+        check(ret == 0, "Trampolines:: Unable to patch 0x%x", entry.addr);
+        safe_memcpy(&entry.patched, (void *)entry.addr, sizeof(long));
+    }
+#endif
+}
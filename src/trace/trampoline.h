@@ -0,0 +1,54 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#pragma once
+
+#include <vector>
+
+#include "trampfmt.h"
+
+namespace chopstix {
+
+// In-process detection of the region begin addresses (-in-process). Each
+// begin address jumps to a stub that counts the invocation and only stops
+// the process when the tracer asked for it, so invocations that are not
+// traced run without ptrace stops. Set up before the parent records the
+// restricted regions, so neither the stubs nor the shared file are ever
+// protected. Never unmapped: the patched code may run until the very end.
+struct Trampolines {
+  public:
+    // Patches all the begin addresses (module offset already applied), or
+    // none of them. The _trampolines file is always created, with a count of
+    // 0 in the latter case.
+    void setup(const char *trace_root, std::vector<long> begin);
+
+    int count() const { return header_ != nullptr ? header_->count : 0; }
+
+  private:
+    bool build(std::vector<long> &begin);
+    void patch();
+
+    cx_tramp_header *header_ = nullptr;
+    unsigned char *stubs_ = nullptr;
+    unsigned long stubs_size_ = 0;
+};
+
+}  // namespace chopstix
@@ -0,0 +1,147 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#include "uffd.h"
+
+#include "support/check.h"
+#include "support/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace chopstix;
+
+UffdTracker::~UffdTracker() {
+    if (fd_ != -1) syscall(SYS_close, fd_);
+}
+
+int UffdTracker::open_fd() {
+    int fd = -1;
+#ifdef UFFD_USER_MODE_ONLY
+    // Only user space faults are of interest, which is also what
+    // unprivileged users are allowed to handle
+    fd = syscall(SYS_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+#endif
+    if (fd == -1) fd = syscall(SYS_userfaultfd, O_CLOEXEC);
+    return fd;
+}
+
+bool UffdTracker::setup(long pagesize) {
+#if defined(SYS_userfaultfd) && defined(UFFDIO_WRITEPROTECT_MODE_WP)
+    pagesize_ = pagesize;
+
+    // Query supported features first, the API handshake can only be done
+    // once per descriptor
+    int probe = open_fd();
+    if (probe == -1) {
+        log::warn("UffdTracker:: userfaultfd not available: %s",
+                  strerror(errno));
+        return false;
+    }
+    struct uffdio_api api = {};
+    api.api = UFFD_API;
+    int err = syscall(SYS_ioctl, probe, UFFDIO_API, &api);
+    syscall(SYS_close, probe);
+    if (err || !(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        log::warn("UffdTracker:: write-protect mode not supported");
+        return false;
+    }
+
+    unsigned long long wanted = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+#ifdef UFFD_FEATURE_WP_UNPOPULATED
+    wanted |= UFFD_FEATURE_WP_UNPOPULATED;
+#endif
+#ifdef UFFD_FEATURE_EXACT_ADDRESS
+    wanted |= UFFD_FEATURE_EXACT_ADDRESS;
+#endif
+
+    fd_ = open_fd();
+    check(fd_ != -1, "UffdTracker:: Unable to open userfaultfd");
+    api.api = UFFD_API;
+    api.features = wanted & api.features;
+    err = syscall(SYS_ioctl, fd_, UFFDIO_API, &api);
+    check(!err, "UffdTracker:: userfaultfd handshake failed");
+#ifdef UFFD_FEATURE_WP_UNPOPULATED
+    wp_unpopulated_ = api.features & UFFD_FEATURE_WP_UNPOPULATED;
+#endif
+    log::verbose("UffdTracker:: features %x", (unsigned long)api.features);
+    return true;
+#else
+    log::warn("UffdTracker:: built without userfaultfd write-protect support");
+    return false;
+#endif
+}
+
+bool UffdTracker::register_range(unsigned long start, unsigned long end) {
+#ifdef UFFDIO_WRITEPROTECT_MODE_WP
+    struct uffdio_register reg = {};
+    reg.range.start = start;
+    reg.range.len = end - start;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    if (syscall(SYS_ioctl, fd_, UFFDIO_REGISTER, &reg) != 0) return false;
+    if (!(reg.ioctls & (1UL << _UFFDIO_WRITEPROTECT))) {
+        unregister_range(start, end);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void UffdTracker::unregister_range(unsigned long start, unsigned long end) {
+    struct uffdio_range range;
+    range.start = start;
+    range.len = end - start;
+    syscall(SYS_ioctl, fd_, UFFDIO_UNREGISTER, &range);
+}
+
+void UffdTracker::write_protect(unsigned long start, unsigned long len,
+                                bool enable) {
+#ifdef UFFDIO_WRITEPROTECT_MODE_WP
+    struct uffdio_writeprotect wp;
+    wp.range.start = start;
+    wp.range.len = len;
+    // Removing the protection also wakes up the faulting thread
+    wp.mode = enable ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    int err = syscall(SYS_ioctl, fd_, UFFDIO_WRITEPROTECT, &wp);
+    check(!err, "UffdTracker:: Unable to write-protect %x-%x", start,
+          start + len);
+#endif
+}
+
+bool UffdTracker::wait_write(unsigned long &addr) {
+    struct uffd_msg msg;
+    while (true) {
+        long r = syscall(SYS_read, fd_, &msg, sizeof(msg));
+        if (r == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (r != sizeof(msg)) return false;
+        if (msg.event != UFFD_EVENT_PAGEFAULT) continue;
+        if (!(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) continue;
+        addr = msg.arg.pagefault.address;
+        return true;
+    }
+}
@@ -0,0 +1,56 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+#pragma once
+
+namespace chopstix {
+
+// Write tracking through userfaultfd write-protection. Pages are
+// write-protected once made accessible; writes to them block the faulting
+// thread and are reported to a monitor thread, which unprotects the page.
+struct UffdTracker {
+  public:
+    ~UffdTracker();
+
+    // Open the userfaultfd. Returns false if write-protect mode is not
+    // supported by the kernel (or allowed for this user).
+    bool setup(long pagesize);
+    bool enabled() const { return fd_ != -1; }
+    // Whether untouched pages can be write-protected directly
+    bool wp_unpopulated() const { return wp_unpopulated_; }
+
+    bool register_range(unsigned long start, unsigned long end);
+    void unregister_range(unsigned long start, unsigned long end);
+    void write_protect(unsigned long start, unsigned long len, bool enable);
+
+    // Monitor side: block until the next write fault. Returns false if the
+    // file descriptor is no longer usable.
+    bool wait_write(unsigned long &addr);
+
+  private:
+    int open_fd();
+
+    int fd_ = -1;
+    long pagesize_ = 0;
+    bool wp_unpopulated_ = false;
+};
+
+}  // namespace chopstix
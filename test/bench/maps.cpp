@@ -0,0 +1,91 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : bench/maps.cpp
+ * DESCRIPTION : Cost of refreshing the memory map at the start of each trace
+ *               (Memory::update) as the number of mappings in the process
+ *               grows, with and without changes to the map in between.
+ ******************************************************************************/
+
+#include "memory.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace chopstix;
+
+namespace {
+
+Memory &mem = Memory::instance();
+
+double now() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+void run(long count, long pagesize, long calls) {
+    // Unmap every other page so each remaining page is its own mapping
+    char *base = (char *)mmap(NULL, 2 * count * pagesize,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    for (long i = 0; i < count; ++i) {
+        munmap(base + (2 * i + 1) * pagesize, pagesize);
+    }
+    mem.update();
+
+    double start = now();
+    for (long i = 0; i < calls; ++i) mem.update();
+    double same = (now() - start) / calls;
+
+    // Flip the permissions of one of the pages before each update, so the
+    // map text differs every time: read-only on even passes over the pages,
+    // read-write on odd ones
+    start = now();
+    for (long i = 0; i < calls; ++i) {
+        char *page = base + 2 * (i % count) * pagesize;
+        int prot = (i / count) % 2 ? PROT_READ | PROT_WRITE : PROT_READ;
+        mprotect(page, pagesize, prot);
+        mem.update();
+    }
+    double changed = (now() - start) / calls;
+
+    printf("%6ld mappings: %8.1f us/update unchanged %8.1f us/update changed\n",
+           count, same * 1e6, changed * 1e6);
+
+    for (long i = 0; i < count; ++i) munmap(base + 2 * i * pagesize, pagesize);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    long calls = argc > 1 ? atol(argv[1]) : 2000;
+
+    // Stay below REGIONS_MAX, the process has its own mappings too
+    long counts[] = {16, 64, 256, 512, 896};
+    for (long count : counts) run(count, pagesize, calls);
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : bench/regions.cpp
+ * DESCRIPTION : Page faults per second handled the way the tracing signal
+ *               handler does (region lookup and unprotect) as the number of
+ *               mappings in the process grows.
+ ******************************************************************************/
+
+#include "memory.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace chopstix;
+
+namespace {
+
+Memory &mem = Memory::instance();
+
+void handler(int, siginfo_t *si, void *) {
+    unsigned long page_addr = mem.page_addr((unsigned long)si->si_addr);
+    mem_region *reg = mem.find_region(page_addr);
+    if (reg == NULL) abort();
+    mem.unprotect_page(reg, page_addr);
+}
+
+double now() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+void run(long count, long pagesize) {
+    // Unmap every other page so each remaining page is its own mapping
+    char *base = (char *)mmap(NULL, 2 * count * pagesize,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    for (long i = 0; i < count; ++i) {
+        munmap(base + (2 * i + 1) * pagesize, pagesize);
+        base[2 * i * pagesize] = 1;
+    }
+    mem.update();
+
+    // Visit pages in a scattered order so the last-hit cache does not help
+    const long rounds = 64;
+    double elapsed = 0;
+    unsigned long faults = 0;
+    for (long r = 0; r < rounds; ++r) {
+        for (long i = 0; i < count; ++i) {
+            mprotect(base + 2 * i * pagesize, pagesize, PROT_NONE);
+        }
+        double start = now();
+        for (long i = 0, j = r % count; i < count; ++i, j = (j + 7919) % count) {
+            base[2 * j * pagesize] += 1;
+        }
+        elapsed += now() - start;
+        faults += count;
+    }
+
+    const long lookups = 1 << 20;
+    double start = now();
+    unsigned long found = 0;
+    for (long i = 0, j = 0; i < lookups; ++i, j = (j + 7919) % count) {
+        found += mem.find_region((unsigned long)base + 2 * j * pagesize) != NULL;
+    }
+    double lookup = now() - start;
+
+    printf("%6ld mappings: %10.0f faults/s %8.1f ns/lookup (%lu found)\n",
+           count, faults / elapsed, lookup / lookups * 1e9, found);
+
+    for (long i = 0; i < count; ++i) munmap(base + 2 * i * pagesize, pagesize);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO;
+    sa.sa_sigaction = handler;
+    sigaction(SIGSEGV, &sa, NULL);
+
+    // Stay below REGIONS_MAX, the process has its own mappings too
+    long counts[] = {16, 64, 256, 512, 896};
+    for (long count : counts) run(count, pagesize);
+    return 0;
+}
@@ -0,0 +1,166 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2019 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+/******************************************************************************
+ * NAME        : bench/samples.cpp
+ * DESCRIPTION : Sample records decoded per second from a perf ring filled
+ *               the way the kernel does (wrapping around its end), into a
+ *               SampleBatch and into one Sample per record, as chop sample
+ *               used to.
+ ******************************************************************************/
+
+#include "core/sample.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <unistd.h>
+
+using namespace chopstix;
+
+namespace {
+
+const size_t pages = 32;
+
+double now() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct Ring {
+    std::vector<uint64_t> mem;
+    perf_event_mmap_page *page;
+    char *data;
+    size_t size;
+
+    explicit Ring(size_t pagesize)
+        : mem((pages + 1) * pagesize / sizeof(uint64_t)),
+          page((perf_event_mmap_page *)mem.data()),
+          data((char *)mem.data() + pagesize),
+          size(pages * pagesize) {}
+
+    void write(const void *src, size_t len) {
+        size_t offset = page->data_head & (size - 1);
+        size_t part = std::min(len, size - offset);
+        memcpy(data + offset, src, part);
+        memcpy(data, (const char *)src + part, len - part);
+        page->data_head += len;
+    }
+
+    // Samples of nr events, until half of the ring is used (watermark)
+    long fill(long nr, long &seq) {
+        uint64_t rec[64] = {};
+        auto *hdr = (perf_event_header *)rec;
+        hdr->type = PERF_RECORD_SAMPLE;
+        hdr->size = (7 + nr) * sizeof(uint64_t);
+        long count = 0;
+        while (page->data_head - page->data_tail + hdr->size <= size / 2) {
+            rec[1] = 0x10000000 + (seq % 4096) * 4;
+            rec[2] = ((uint64_t)1235 << 32) | 1234;
+            rec[3] = seq;
+            rec[4] = nr;
+            rec[5] = rec[6] = seq + 1;
+            for (long i = 0; i < nr; ++i) rec[7 + i] = seq * (i + 1);
+            write(rec, hdr->size);
+            ++seq;
+            ++count;
+        }
+        return count;
+    }
+};
+
+// The previous decoding: each field copied out of the ring on its own into
+// a Sample with its own vector of values
+void read_ring(Ring &ring, void *dst, size_t len) {
+    size_t offset = ring.page->data_tail & (ring.size - 1);
+    size_t part = std::min(len, ring.size - offset);
+    memcpy(dst, ring.data + offset, part);
+    memcpy((char *)dst + part, ring.data, len - part);
+    ring.page->data_tail += len;
+}
+
+std::vector<Sample> decode_copies(Ring &ring) {
+    std::vector<Sample> samples;
+    while (ring.page->data_head - ring.page->data_tail >=
+           sizeof(perf_event_header)) {
+        perf_event_header hdr;
+        read_ring(ring, &hdr, sizeof(hdr));
+        Sample smp;
+        read_ring(ring, &smp, Sample::header_size);
+        uint64_t nr;
+        read_ring(ring, &nr, sizeof(nr));
+        smp.data.resize(nr);
+        uint64_t timing[2];
+        read_ring(ring, timing, sizeof(timing));
+        read_ring(ring, smp.data.data(), nr * sizeof(uint64_t));
+        for (auto &dat : smp.data) dat *= timing[0] / timing[1];
+        samples.push_back(smp);
+    }
+    return samples;
+}
+
+void run(long nr, long records, long pagesize) {
+    Ring ring(pagesize);
+    SampleBatch batch;
+    long seq = 0, done = 0;
+    uint64_t sum = 0;
+    double spent = 0;
+    while (done < records) {
+        ring.fill(nr, seq);
+        double start = now();
+        batch.clear();
+        done += batch.decode(ring.page, ring.size);
+        spent += now() - start;
+        sum += batch.ip.back();
+    }
+    double batched = done / spent;
+
+    seq = done = 0;
+    spent = 0;
+    while (done < records) {
+        ring.fill(nr, seq);
+        double start = now();
+        auto samples = decode_copies(ring);
+        spent += now() - start;
+        done += samples.size();
+        sum += samples.back().ip;
+    }
+    double copies = done / spent;
+
+    printf("%2ld events: %8.1f M records/s batch %8.1f M records/s copies"
+           " (%lx)\n",
+           nr, batched / 1e6, copies / 1e6, (unsigned long)(sum & 0xf));
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    long records = argc > 1 ? atol(argv[1]) : 10000000;
+
+    long nrs[] = {1, 2, 4, 8};
+    for (long nr : nrs) run(nr, records, pagesize);
+    return 0;
+}
@@ -21,3 +21,5 @@
 
 #           size_kb  time_s
 test_sample 100 time 10
+test_sample_raw 100 time 10
+test_sample_aggregate 100 time 10
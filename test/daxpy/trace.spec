@@ -68,8 +68,13 @@ check_content() {
 
     it=0;
     while [ "$it" -lt "$num_iter" ]; do
-        # shellcheck disable=SC2012
-        count=$(ls "$CHOPSTIX_OPT_TRACE_DIR"/page.$it.* | wc -l)
+        index="$CHOPSTIX_OPT_TRACE_DIR/pages.$it.idx"
+        test -f "$index" || \
+            die "Error: no page index for iteration $it"
+        test -f "$CHOPSTIX_OPT_TRACE_DIR/pages.$it.data" || \
+            die "Error: no page data for iteration $it"
+        # 32-byte header followed by 24-byte entries (see src/trace/pagefmt.h)
+        count=$(( ($(wc -c < "$index") - 32) / 24 ))
         test "$count" -ge $num_pages || \
             die "Error: expected $num_pages pages for iteration $it (found $count)"
         test -f "$CHOPSTIX_OPT_TRACE_DIR/maps.$it" || \
@@ -83,9 +88,59 @@ check_content() {
     echo "> check content ok"
 }
 
+check_backend() {
+    # The write monitor only runs if userfaultfd could be set up
+    if grep -qe 'System:: Tracking writes with userfaultfd' cxtrace.log; then
+        test "$1" = uffd || die "Error: uffd used instead of $1"
+    else
+        test "$1" = mprotect || die "Error: uffd not selected"
+    fi
+    echo "> check backend $1 ok"
+}
+
+trace_pages() {
+    # Pages recorded in every trace, as unpacked by chop-trace2mpt: their
+    # number, and the contents of the pages of both vectors by page number.
+    # Other addresses move with the mappings of the tracing library.
+    "$trace2mpt" --export-pages --trace-dir "$CHOPSTIX_OPT_TRACE_DIR" \
+        > /dev/null || die "Error: unable to export pages"
+    num_pages=$(get_value "$1" num_pages)
+    num_iter=$(get_value "$1" num_iter)
+    pagesize=$(getconf PAGESIZE)
+
+    it=0
+    while [ "$it" -lt "$num_iter" ]; do
+        # shellcheck disable=SC2012
+        count=$(ls "$CHOPSTIX_OPT_TRACE_DIR"/page.$it.* | wc -l)
+        echo "trace $it: $count pages"
+        for vec in vec_x vec_y; do
+            base=$(get_value "$1" $vec)
+            p=0
+            while [ "$p" -lt "$num_pages" ]; do
+                addr=$(printf '%x' $((0x$base + p * pagesize)))
+                page="$CHOPSTIX_OPT_TRACE_DIR/page.$it.$addr"
+                if [ -f "$page" ]; then
+                    echo "trace $it: $vec page $p $(cksum < "$page")"
+                else
+                    echo "trace $it: $vec page $p missing"
+                fi
+                p=$((p+1))
+            done
+        done
+        it=$((it+1))
+    done
+}
+
+count_faults() {
+    # Faults handled in all the traces, SIGSEGV and userfaultfd alike
+    "$tracestats" --trace-dir "$CHOPSTIX_OPT_TRACE_DIR" | \
+        awk '$1 == "total" {print $3}'
+}
+
 test_daxpy() {
     export CHOPSTIX_OPT_LOG_PATH=cxtrace.log
-    export CHOPSTIX_OPT_LOG_LEVEL=verbose
+    # check_trace counts the segv debug messages
+    export CHOPSTIX_OPT_LOG_LEVEL=debug
     export CHOPSTIX_OPT_TRACE_DIR=cxtrace_data
 
 
@@ -99,8 +154,58 @@ test_daxpy() {
     validate_output normal $name
     check_trace $name
     check_content $name
+    trace_pages $name > "pages.$name"
     mv cxtrace.log cxtrace.$name
 
+    # Page encodings: the pages rebuilt by chop-trace2mpt (from deltas, the
+    # shared store or zero page markers) must match the plain dump
+    for encoding in page-delta page-store async-dump; do
+        echo "> test $encoding"
+        case $encoding in
+            page-delta) export CHOPSTIX_OPT_PAGE_DELTA=4 ;;
+            page-store) export CHOPSTIX_OPT_PAGE_STORE=yes ;;
+            async-dump) export CHOPSTIX_OPT_ASYNC_DUMP=yes ;;
+        esac
+        name=trace-$encoding
+        test_trace_function func_daxpy $name "$1" iter "$2"
+        validate_output normal $name
+        check_trace $name
+        trace_pages $name > "pages.$name"
+        diff pages.trace-default "pages.$name" || \
+            die "Error: pages with $encoding differ from the plain dump"
+        mv cxtrace.log cxtrace.$name
+        unset CHOPSTIX_OPT_PAGE_DELTA
+        unset CHOPSTIX_OPT_PAGE_STORE
+        unset CHOPSTIX_OPT_ASYNC_DUMP
+    done
+    echo "> check page encodings ok"
+
+    # Memory access trace with each page tracking backend. Both must record
+    # the same pages; report the fault rate to compare them.
+    for backend in mprotect uffd; do
+        echo "> test memory access trace ($backend)"
+        export CHOPSTIX_OPT_MEMORY_ACCESS_TRACE=yes
+        export CHOPSTIX_OPT_PAGE_TRACKING=$backend
+        name=trace-memtrace-$backend
+        start=$(date +%s%N)
+        test_trace_function func_daxpy $name "$1" iter "$2"
+        end=$(date +%s%N)
+        validate_output normal $name
+        check_trace $name
+        check_backend $backend
+        trace_pages $name > "pages.$name"
+        faults=$(count_faults)
+        test -n "$faults" || die "Error: no trace statistics"
+        elapsed=$(( (end - start) / 1000000 + 1 ))
+        echo "> $backend: $faults faults in ${elapsed}ms ($(( faults * 1000 / elapsed )) faults/s)"
+        mv cxtrace.log cxtrace.$name
+    done
+    diff pages.trace-memtrace-mprotect pages.trace-memtrace-uffd || \
+        die "Error: uffd and mprotect recorded different pages"
+    echo "> check uffd pages ok"
+    unset CHOPSTIX_OPT_MEMORY_ACCESS_TRACE
+    unset CHOPSTIX_OPT_PAGE_TRACKING
+
     # Test no dump pages
     echo "> test no dump pages"
     export CHOPSTIX_OPT_SAVE=no
@@ -0,0 +1,344 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2020 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pagefmt.h"
+
+#define PATH_LEN 512
+
+typedef struct {
+    char *data;
+    size_t size;
+} MappedFile;
+
+typedef struct {
+    unsigned int id;
+    struct cx_page_header header;
+    struct cx_page_entry *entries;
+    MappedFile data;  // pages.<id>.data, if any entry uses it
+} TraceIndex;
+
+typedef struct {
+    uint64_t hash[2];
+    const char *contents;  // Source of the page, to confirm matches
+    uint64_t size;
+    uint64_t offset;       // Offset in the new store
+    bool used;
+} StoreSlot;
+
+typedef struct {
+    StoreSlot *slots;
+    size_t capacity;
+    size_t used;
+} StoreTable;
+
+void error(const char *msg, const char *path) {
+    fprintf(stderr, "chop-page-store: Error: %s '%s'\n", msg, path);
+    if (errno != 0) fprintf(stderr, "chop-page-store: Error: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+bool mapFile(const char *path, MappedFile *file) {
+    memset(file, 0, sizeof(*file));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) error("Unable to stat", path);
+    file->size = st.st_size;
+    if (file->size > 0) {
+        file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->data == MAP_FAILED) error("Unable to map", path);
+    }
+    close(fd);
+    return true;
+}
+
+void unmapFile(MappedFile *file) {
+    if (file->data != NULL) munmap(file->data, file->size);
+    file->data = NULL;
+    file->size = 0;
+}
+
+bool loadIndex(const char *trace_dir, unsigned int id, TraceIndex *trace) {
+    char path[PATH_LEN];
+    memset(trace, 0, sizeof(*trace));
+    trace->id = id;
+
+    sprintf(path, "%s/pages.%u.idx", trace_dir, id);
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) error("Unable to open", path);
+    if (fread(&trace->header, sizeof(trace->header), 1, fp) != 1 ||
+        strncmp(trace->header.magic, CX_PAGE_MAGIC, sizeof(trace->header.magic)) != 0 ||
+        trace->header.version > CX_PAGE_VERSION) {
+        fprintf(stderr, "chop-page-store: Skipping '%s': not a valid page index\n", path);
+        fclose(fp);
+        return false;
+    }
+    size_t count = trace->header.count;
+    trace->entries = malloc((count > 0 ? count : 1) * sizeof(struct cx_page_entry));
+    if (fread(trace->entries, sizeof(struct cx_page_entry), count, fp) != count) {
+        error("Truncated page index", path);
+    }
+    fclose(fp);
+
+    for (size_t i = 0; i < count; i++) {
+        if (trace->entries[i].flags & (CX_PAGE_STORED | CX_PAGE_ZERO)) continue;
+        sprintf(path, "%s/pages.%u.data", trace_dir, id);
+        if (!mapFile(path, &trace->data)) error("Missing page data", path);
+        break;
+    }
+    return true;
+}
+
+const char *entryContents(TraceIndex *trace, struct cx_page_entry *entry,
+                          MappedFile *store) {
+    MappedFile *file = (entry->flags & CX_PAGE_STORED) ? store : &trace->data;
+    if (entry->offset + entry->size > file->size) {
+        fprintf(stderr, "chop-page-store: Error: Page 0x%lx of trace %u out of bounds\n",
+                (unsigned long) entry->addr, trace->id);
+        exit(EXIT_FAILURE);
+    }
+    return file->data + entry->offset;
+}
+
+void growTable(StoreTable *table);
+
+// Returns the slot holding these contents, or the empty slot to fill
+StoreSlot *findSlot(StoreTable *table, const char *contents, uint64_t size) {
+    if (table->used * 4 >= table->capacity * 3) growTable(table);
+    uint64_t hash[2];
+    cx_page_hash(contents, size, hash);
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash[0] & mask;; i = (i + 1) & mask) {
+        StoreSlot *slot = &table->slots[i];
+        if (!slot->used) {
+            slot->hash[0] = hash[0];
+            slot->hash[1] = hash[1];
+            slot->contents = contents;
+            slot->size = size;
+            return slot;
+        }
+        if (slot->hash[0] == hash[0] && slot->hash[1] == hash[1] &&
+            slot->size == size && memcmp(slot->contents, contents, size) == 0) {
+            return slot;
+        }
+    }
+}
+
+void growTable(StoreTable *table) {
+    StoreTable old = *table;
+    table->capacity = old.capacity ? old.capacity * 2 : 4096;
+    table->slots = calloc(table->capacity, sizeof(StoreSlot));
+    table->used = 0;
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (!old.slots[i].used) continue;
+        StoreSlot *slot = findSlot(table, old.slots[i].contents, old.slots[i].size);
+        *slot = old.slots[i];
+        table->used++;
+    }
+    free(old.slots);
+}
+
+void print_usage() {
+    printf(
+        "Usage: chop-page-store [--trace-dir <dir>] [--gc] [-h]\n"
+        "Options:\n"
+        "  -h,--help            Display this help and exit\n"
+        "  --trace-dir <dir>    Path to trace directory (default: ./trace_data)\n"
+        "  --gc                 Compact the page store: drop pages no longer referenced\n"
+        "                       by any trace, merge identical contents and move pages\n"
+        "                       of per-trace archives (pages.<id>.data) into the store.\n"
+        "                       Delta-encoded pages are moved but not merged.\n"
+        "Without --gc, only report the space used by the pages of the traces.\n");
+}
+
+int main(int argc, const char **argv) {
+    const char *trace_dir = "./trace_data";
+    bool gc = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage();
+            return 0;
+        } else if (strcmp(arg, "--trace-dir") == 0 && i + 1 < argc) {
+            trace_dir = argv[++i];
+        } else if (strcmp(arg, "--gc") == 0) {
+            gc = true;
+        } else {
+            fprintf(stderr, "chop-page-store: Unknown option: %s\n", arg);
+            print_usage();
+            return 2;
+        }
+    }
+
+    char path[PATH_LEN];
+    char tmp_path[PATH_LEN];
+
+    struct dirent **namelist;
+    int n = scandir(trace_dir, &namelist, NULL, alphasort);
+    if (n == -1) error("Unable to open dir", trace_dir);
+
+    TraceIndex *traces = malloc((n > 0 ? n : 1) * sizeof(TraceIndex));
+    unsigned int num_traces = 0;
+    for (int i = 0; i < n; i++) {
+        const char *name = namelist[i]->d_name;
+        size_t len = strlen(name);
+        if (strncmp(name, "pages.", 6) == 0 && len > 10 &&
+            strcmp(name + len - 4, ".idx") == 0) {
+            unsigned int id = strtoul(name + 6, NULL, 10);
+            if (loadIndex(trace_dir, id, &traces[num_traces])) num_traces++;
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    MappedFile store;
+    sprintf(path, "%s/pages.store", trace_dir);
+    bool has_store = mapFile(path, &store);
+
+    // Report current usage
+    size_t refs = 0, stored_refs = 0, zero_refs = 0, delta_refs = 0;
+    size_t data_bytes = 0, live_bytes = 0;
+    StoreTable table = {NULL, 0, 0};
+    for (unsigned int t = 0; t < num_traces; t++) {
+        TraceIndex *trace = &traces[t];
+        data_bytes += trace->data.size;
+        for (size_t i = 0; i < trace->header.count; i++) {
+            struct cx_page_entry *entry = &trace->entries[i];
+            refs++;
+            if (entry->flags & CX_PAGE_ZERO) {
+                zero_refs++;
+                continue;
+            }
+            if (entry->flags & CX_PAGE_STORED) {
+                if (!has_store) error("Missing page store", path);
+                stored_refs++;
+            }
+            const char *contents = entryContents(trace, entry, &store);
+            if (entry->flags & CX_PAGE_DELTA) {
+                // Only meaningful on top of its base, kept as is
+                delta_refs++;
+                live_bytes += entry->size;
+                continue;
+            }
+            StoreSlot *slot = findSlot(&table, contents, entry->size);
+            if (!slot->used) {
+                slot->used = true;
+                slot->offset = live_bytes;
+                table.used++;
+                live_bytes += entry->size;
+            }
+        }
+    }
+
+    printf("chop-page-store: Traces: %u\n", num_traces);
+    printf("chop-page-store: Page references: %zu (%zu in store, %zu zero-filled, "
+           "%zu delta-encoded)\n", refs, stored_refs, zero_refs, delta_refs);
+    printf("chop-page-store: Distinct pages: %zu\n", table.used);
+    printf("chop-page-store: Store size: %zu bytes\n", store.size);
+    printf("chop-page-store: Per-trace data size: %zu bytes\n", data_bytes);
+    printf("chop-page-store: Size after compaction: %zu bytes\n", live_bytes);
+
+    if (!gc) exit(EXIT_SUCCESS);
+
+    // Write the compacted store. Slot offsets were assigned in first
+    // reference order above, write the contents in that same order.
+    sprintf(tmp_path, "%s/pages.store.tmp", trace_dir);
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL) error("Unable to write", tmp_path);
+    size_t written = 0;
+    for (unsigned int t = 0; t < num_traces; t++) {
+        TraceIndex *trace = &traces[t];
+        for (size_t i = 0; i < trace->header.count; i++) {
+            struct cx_page_entry *entry = &trace->entries[i];
+            if (entry->flags & CX_PAGE_ZERO) continue;
+            const char *contents = entryContents(trace, entry, &store);
+            if (entry->flags & CX_PAGE_DELTA) {
+                if (entry->size > 0 && fwrite(contents, entry->size, 1, out) != 1) {
+                    error("Unable to write", tmp_path);
+                }
+                entry->offset = written;
+                entry->flags |= CX_PAGE_STORED;
+                written += entry->size;
+                continue;
+            }
+            StoreSlot *slot = findSlot(&table, contents, entry->size);
+            if (slot->offset == written) {
+                if (fwrite(contents, entry->size, 1, out) != 1) {
+                    error("Unable to write", tmp_path);
+                }
+                written += entry->size;
+            }
+            entry->offset = slot->offset;
+            entry->flags |= CX_PAGE_STORED;
+        }
+    }
+    fclose(out);
+
+    // Rewrite the indices to point to the new store
+    for (unsigned int t = 0; t < num_traces; t++) {
+        TraceIndex *trace = &traces[t];
+        sprintf(tmp_path, "%s/pages.%u.idx.tmp", trace_dir, trace->id);
+        FILE *fp = fopen(tmp_path, "wb");
+        if (fp == NULL) error("Unable to write", tmp_path);
+        trace->header.version = CX_PAGE_VERSION;
+        if (fwrite(&trace->header, sizeof(trace->header), 1, fp) != 1 ||
+            fwrite(trace->entries, sizeof(struct cx_page_entry), trace->header.count, fp) !=
+            trace->header.count) {
+            error("Unable to write", tmp_path);
+        }
+        fclose(fp);
+    }
+
+    // Nothing refers to the old contents anymore, swap files in
+    for (unsigned int t = 0; t < num_traces; t++) {
+        TraceIndex *trace = &traces[t];
+        sprintf(tmp_path, "%s/pages.%u.idx.tmp", trace_dir, trace->id);
+        sprintf(path, "%s/pages.%u.idx", trace_dir, trace->id);
+        if (rename(tmp_path, path) != 0) error("Unable to rename", tmp_path);
+        sprintf(path, "%s/pages.%u.data", trace_dir, trace->id);
+        unlink(path);
+        unmapFile(&trace->data);
+        free(trace->entries);
+    }
+    unmapFile(&store);
+    sprintf(tmp_path, "%s/pages.store.tmp", trace_dir);
+    sprintf(path, "%s/pages.store", trace_dir);
+    if (rename(tmp_path, path) != 0) error("Unable to rename", tmp_path);
+
+    printf("chop-page-store: Compacted store: %zu bytes\n", written);
+    free(traces);
+    free(table.slots);
+    exit(EXIT_SUCCESS);
+}
@@ -36,6 +36,14 @@
 #endif
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/hw_breakpoint.h>
+
+#ifndef TRAP_PERF
+#define TRAP_PERF 6
+#endif
 
 // Breakpoint size, in bytes. Should be the smallest amount of bytes required
 // for a breakpoint by a given architecture.
@@ -100,12 +108,19 @@ struct RiscVRegs {
 #define RISCV_FPR_SIZE sizeof(((struct  RiscVRegs *)0)->fp)
 #endif
 
+int hw_breakpoints = 0;
 unsigned long long base_address = 0;
 unsigned int base_address_set = 0;
 unsigned long long basemain_address[2] = {0,0};
 
 void setBreakpoint(unsigned long pid, unsigned long long address,
                    Breakpoint *breakpoint) {
+    if (hw_breakpoints) {
+        debug_print("setBreakpoint (hw) 0x%016llX\n", breakpoint->address);
+        long ret = ioctl(breakpoint->fd, PERF_EVENT_IOC_ENABLE, 0);
+        if (ret != 0) { perror("ERROR: while enabling hardware breakpoint"); kill(pid, SIGKILL); exit(EXIT_FAILURE);};
+        return;
+    }
     address = address + base_address;
     breakpoint->address = address;
     debug_print("setBreakpoint 0x%016llX to 0x%08X (orig 0x%08llX)\n", address, 0, breakpoint->originalData);
@@ -156,12 +171,63 @@ void setBreakpoint(unsigned long pid, unsigned long long address,
 }
 
 void resetBreakpoint(unsigned long pid, Breakpoint *breakpoint) {
+    if (hw_breakpoints) {
+        debug_print("resetBreakpoint (hw) 0x%016llX\n", breakpoint->address);
+        long ret = ioctl(breakpoint->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (ret != 0) { perror("ERROR: while disabling hardware breakpoint"); kill(pid, SIGKILL); exit(EXIT_FAILURE);};
+        return;
+    }
     debug_print("resetBreakpoint 0x%016llX to 0x%08llX\n", breakpoint->address, breakpoint->originalData);
     errno = 0;
     long ret = ptrace(PTRACE_POKEDATA, pid, breakpoint->address, breakpoint->originalData);
     if (ret != 0) { perror("ERROR: while restoring breakpoint"); kill(pid, SIGKILL); exit(EXIT_FAILURE);};
 }
 
+int openHwBreakpoint(unsigned long pid, unsigned long long address,
+                     Breakpoint *breakpoint) {
+    breakpoint->address = address + base_address;
+    breakpoint->fd = -1;
+#ifdef PERF_ATTR_SIZE_VER7
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_BREAKPOINT;
+    attr.size = sizeof(attr);
+    attr.bp_type = HW_BREAKPOINT_X;
+    attr.bp_addr = breakpoint->address;
+    attr.bp_len = sizeof(long);
+    attr.sample_period = 1;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.sigtrap = 1;
+    attr.remove_on_exec = 1;
+    breakpoint->fd = syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+    if (breakpoint->fd == -1) {
+        debug_print("openHwBreakpoint 0x%016llX: %s\n", breakpoint->address, strerror(errno));
+        return 0;
+    }
+    debug_print("openHwBreakpoint 0x%016llX: fd %d\n", breakpoint->address, breakpoint->fd);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void closeHwBreakpoint(Breakpoint *breakpoint) {
+    if (breakpoint->fd > 0) close(breakpoint->fd);
+    breakpoint->fd = -1;
+}
+
+int isBreakpointStop(unsigned long pid, int status) {
+    if (!WIFSTOPPED(status)) return 0;
+    if (!hw_breakpoints) return WSTOPSIG(status) == SIGILL;
+    if (WSTOPSIG(status) != SIGTRAP) return 0;
+    siginfo_t info;
+    long ret = ptrace(PTRACE_GETSIGINFO, pid, NULL, &info);
+    if (ret != 0) { perror("ERROR: while PTRACE_GETSIGINFO"); kill(pid, SIGKILL); exit(EXIT_FAILURE);};
+    return info.si_code == TRAP_PERF;
+}
+
 void compute_base_address(unsigned long pid, char* module, char* mainmodule) {
     debug_print("parent: Computing base address... %ld\n", pid);
     if (base_address_set == 1) return;
@@ -24,11 +24,20 @@ typedef struct {
     unsigned long long address;
     unsigned long long originalData;
     unsigned int init;
+    int fd; // Hardware breakpoint perf event (-hw-breakpoints)
 } Breakpoint;
 
+// Set by -hw-breakpoints. Breakpoints are then perf_event execute breakpoints
+// that stop the process with a SIGTRAP instead of patching the code.
+extern int hw_breakpoints;
+
 void setBreakpoint(unsigned long pid, unsigned long long address,
                    Breakpoint *breakpoint);
 void resetBreakpoint(unsigned long pid, Breakpoint *breakpoint);
+int openHwBreakpoint(unsigned long pid, unsigned long long address,
+                     Breakpoint *breakpoint);
+void closeHwBreakpoint(Breakpoint *breakpoint);
+int isBreakpointStop(unsigned long pid, int status);
 void compute_base_address(unsigned long pid, char* module, char* mainmodule);
 
 #if defined(__s390x__)
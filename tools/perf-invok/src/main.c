@@ -78,7 +78,7 @@ void help(FILE *fd) {
     }
     fprintf(fd, "Usage:\n");
     fprintf(fd, "\n");
-    fprintf(fd, "chop-perf-invok -o output [-begin addr] [-begin addr] ...] [-end addr [-end addr ...]] [-timeout seconds] [-max samples] [-module] [-cpu cpu] [-level level] [-h] -- command-to-execute\n");
+    fprintf(fd, "chop-perf-invok -o output [-begin addr] [-begin addr] ...] [-end addr [-end addr ...]] [-timeout seconds] [-max samples] [-module] [-cpu cpu] [-level level] [-hw-breakpoints] [-h] -- command-to-execute\n");
     fprintf(fd, "\n");
     fprintf(fd, "-o name          output file name\n");
     fprintf(fd, "-begin addr      start address of the region to measure (can be specified multiple times)\n");
@@ -88,6 +88,7 @@ void help(FILE *fd) {
     fprintf(fd, "-max samples     stop measuring after the specified number of measurements(default: no limit)\n");
     fprintf(fd, "-cpu cpu         pin process to the specified CPU (default: 0)\n");
     fprintf(fd, "-level level     call level to trace, in case of recursion (default: 0, tot level)\n");
+    fprintf(fd, "-hw-breakpoints  use hardware breakpoints, code is not modified (at most 4 -begin/-end addresses in total)\n");
     fprintf(fd, "-h               print this help message\n");
     fprintf(fd, "\n");
 
@@ -147,6 +148,18 @@ int perInvocationPerformance( double timeout,
     static Breakpoint Endbp[MAX_BREAKPOINTS];
     int max_level_seen = -1;
 
+    if (hw_breakpoints) {
+        int available = 1;
+        for(int i=0; i<startpoint_count && available; i++) available = openHwBreakpoint(pid, addrStart[i], &Startbp[i]);
+        for(int i=0; i<endpoint_count && available; i++) available = openHwBreakpoint(pid, addrEnd[i], &Endbp[i]);
+        if (!available) {
+            fprintf(stderr, "WARNING: Hardware breakpoints not available, using software breakpoints\n");
+            for(int i=0; i<startpoint_count; i++) closeHwBreakpoint(&Startbp[i]);
+            for(int i=0; i<endpoint_count; i++) closeHwBreakpoint(&Endbp[i]);
+            hw_breakpoints = 0;
+        }
+    }
+
     for(int i=0; i<startpoint_count; i++) setBreakpoint(pid, addrStart[i], &Startbp[i]);
 
     long ret = ptrace(PTRACE_CONT, pid, 0, 0);
@@ -170,7 +183,7 @@ int perInvocationPerformance( double timeout,
 
         if (WIFSTOPPED(status)) {
             debug_print("%s\n", strsignal(WSTOPSIG(status)));
-            while (((WSTOPSIG(status) != SIGILL) && WIFSTOPPED(status)) && !(WIFEXITED(status))) {
+            while ((!isBreakpointStop(pid, status) && WIFSTOPPED(status)) && !(WIFEXITED(status))) {
                 check_child(ret, pid, status);
                 ret = ptrace(PTRACE_CONT, pid, 0, WSTOPSIG(status));
                 if (ret != 0) { perror("ERROR: during signal tracing (out of sample)"); kill(pid, SIGKILL); exit(EXIT_FAILURE);};
@@ -271,7 +284,7 @@ int perInvocationPerformance( double timeout,
 
         if (WIFSTOPPED(status)) {
             while (!(WIFEXITED(status))) {
-                if ((WSTOPSIG(status) == SIGILL) && WIFSTOPPED(status)) {
+                if (isBreakpointStop(pid, status)) {
 
                     // Check for recursive calls
 
@@ -504,6 +517,7 @@ int main(int argc, char **argv) {
                 else if (strcmp(arg, "-cpu") == 0) state = EXPECTING_CPU;
                 else if (strcmp(arg, "-module") == 0) state = EXPECTING_MODULE;
                 else if (strcmp(arg, "-level") == 0) state = EXPECTING_LEVEL;
+                else if (strcmp(arg, "-hw-breakpoints") == 0) hw_breakpoints = 1;
                 else if (strcmp(arg, "-h") == 0) help(stdout);
                 else if (strcmp(arg, "--") == 0) {
                     state = EXPECTING_PROGRAM;
@@ -564,6 +578,11 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (hw_breakpoints && startpoint_count + endpoint_count > 4) {
+        fprintf(stderr, "WARNING: More than 4 -begin/-end addresses, hardware breakpoints disabled\n");
+        hw_breakpoints = 0;
+    }
+
     if (output == NULL) {
         fprintf(stderr, "Output is required. ");
         help(stderr);
@@ -23,6 +23,9 @@ csv_file=$(mktemp)
 log_file=$(mktemp)
 header="Cycles, Time Elapsed (us), Retired Instructions, Retired Memory Instructions, Data Cache Misses, Instructions Per Cycle, Miss Percentage"
 
+# Exit code reported to ctest when the host cannot run the test
+skip_code=77
+
 cleanup() {
     rm "$csv_file" "$log_file"
 }
@@ -35,6 +38,10 @@ if [ $# -ne 0 ]; then
     marks_cmd=$1/$marks_cmd
 fi
 
+# Remaining arguments are passed to chop-perf-invok
+[ $# -ne 0 ] && shift
+extra_opts="$*"
+
 if ! hash "$marks_cmd" > /dev/null 2> /dev/null; then
     echo "ChopStiX marks command ($marks_cmd) not found"
     cleanup
@@ -42,9 +49,24 @@ if ! hash "$marks_cmd" > /dev/null 2> /dev/null; then
 fi
 
 echo "Testing basic functionality using a function with two distinct alternate behaviours (this might take a while)..."
-echo "Command: ./chop-perf-invok -o $csv_file $("$marks_cmd" ./vector_add add) -- ./vector_add"
-# shellcheck disable=SC2046
-if ! ./chop-perf-invok -o "$csv_file" $("$marks_cmd" ./vector_add add) -- ./vector_add > "$log_file" 2> "$log_file" ; then
+echo "Command: ./chop-perf-invok -o $csv_file $extra_opts $("$marks_cmd" ./vector_add add) -- ./vector_add"
+# shellcheck disable=SC2046,SC2086
+./chop-perf-invok -o "$csv_file" $extra_opts $("$marks_cmd" ./vector_add add) -- ./vector_add > "$log_file" 2> "$log_file"
+ret=$?
+
+if grep -q "^ERROR while setting PERF_COUNT_.*: \(No such file or directory\|Operation not supported\)" "$log_file"; then
+    echo "Hardware performance counters not supported on this host, skipping"
+    cleanup
+    exit $skip_code
+fi
+
+if grep -q "Hardware breakpoints not available" "$log_file"; then
+    echo "perf_event_open(PERF_TYPE_BREAKPOINT) not supported on this host, skipping"
+    cleanup
+    exit $skip_code
+fi
+
+if [ $ret -ne 0 ]; then
     echo "chop-perf-invok returned an error exit code"
     echo "logs:"
     cat "$log_file"
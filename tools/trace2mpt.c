@@ -29,6 +29,12 @@
 #include <string.h>
 #include <zlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pagefmt.h"
 
 #define PATH_LEN 512
 
@@ -175,6 +181,292 @@ void readFile(char *path, char **data, size_t *data_size, bool text) {
     }
 }
 
+typedef struct {
+    char *data;
+    size_t size;
+    bool mapped;
+} MappedFile;
+
+// Map a file produced by the tracer into memory. Falls back to reading
+// (and decompressing) the file if only a gzipped version is available.
+bool mapFile(char *path, MappedFile *file) {
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            fprintf(stderr, "chop-trace2mpt: Error: Unable to stat %s\n", path);
+            fprintf(stderr, "chop-trace2mpt: Error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        file->size = st.st_size;
+        file->mapped = true;
+        file->data = NULL;
+        if (file->size > 0) {
+            file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (file->data == MAP_FAILED) {
+                fprintf(stderr, "chop-trace2mpt: Error: Unable to map %s\n", path);
+                fprintf(stderr, "chop-trace2mpt: Error: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        close(fd);
+        return true;
+    }
+
+    strcat(path, ".gz");
+    if (access(path, R_OK) != 0) return false;
+    readCompressedFile(path, &file->data, &file->size);
+    file->mapped = false;
+    return true;
+}
+
+void unmapFile(MappedFile *file) {
+    if (file->mapped) {
+        if (file->data != NULL) munmap(file->data, file->size);
+    } else {
+        free(file->data);
+    }
+    file->data = NULL;
+    file->size = 0;
+}
+
+typedef struct {
+    unsigned long address;
+    const char *data;
+    size_t size;
+    bool zero;   // All zero, data points to a shared zero page
+    char *name;  // Legacy layout only, contents loaded lazily
+} PageRef;
+
+int comparePageRefs(const void *a, const void *b) {
+    const PageRef *pa = a;
+    const PageRef *pb = b;
+    if (pa->address < pb->address) return -1;
+    return pa->address > pb->address;
+}
+
+typedef struct {
+    struct cx_page_entry entry;
+    size_t position;  // Position in the index file, later wins
+} IndexedEntry;
+
+int compareIndexedEntries(const void *a, const void *b) {
+    const IndexedEntry *ea = a;
+    const IndexedEntry *eb = b;
+    if (ea->entry.addr != eb->entry.addr) return ea->entry.addr < eb->entry.addr ? -1 : 1;
+    if (ea->position != eb->position) return ea->position < eb->position ? -1 : 1;
+    return 0;
+}
+
+typedef struct {
+    MappedFile index;
+    MappedFile data;
+    MappedFile store;
+    struct cx_page_entry *sorted; // Only if the index had to be re-sorted
+    char *zero;                   // Contents of the zero-filled pages
+    char *decoded;                // Contents of the delta-encoded pages
+    PageRef *pages;
+    unsigned int num_pages;
+} PageSet;
+
+void freePages(PageSet *set);
+
+// Collect the pages of a trace from the page archive (pages.<id>.idx and
+// pages.<id>.data and/or the shared pages.store). Returns false if the trace
+// has no archive.
+bool loadPageArchive(const char *trace_dir, unsigned int index, PageSet *set) {
+    char path[PATH_LEN];
+    memset(set, 0, sizeof(*set));
+
+    sprintf(path, "%s/pages.%d.idx", trace_dir, index);
+    if (!mapFile(path, &set->index)) return false;
+
+    struct cx_page_header *hdr = (struct cx_page_header *) set->index.data;
+    if (set->index.size < sizeof(*hdr) ||
+        strncmp(hdr->magic, CX_PAGE_MAGIC, sizeof(hdr->magic)) != 0) {
+        fprintf(stderr, "chop-trace2mpt: Error: Bad page index for trace %d\n", index);
+        fprintf(stderr, "chop-trace2mpt: Error: Trace might not have finished.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (hdr->version > CX_PAGE_VERSION) {
+        fprintf(stderr, "chop-trace2mpt: Error: Unsupported page index version %u\n", hdr->version);
+        exit(EXIT_FAILURE);
+    }
+
+    struct cx_page_entry *entries = (struct cx_page_entry *) (hdr + 1);
+    size_t count = hdr->count;
+    if (sizeof(*hdr) + count * sizeof(*entries) > set->index.size) {
+        fprintf(stderr, "chop-trace2mpt: Error: Truncated page index for trace %d\n", index);
+        exit(EXIT_FAILURE);
+    }
+
+    if (hdr->flags & CX_PAGE_INDEX_UNSORTED) {
+        IndexedEntry *tmp = malloc((count > 0 ? count : 1) * sizeof(IndexedEntry));
+        for (size_t i = 0; i < count; i++) {
+            tmp[i].entry = entries[i];
+            tmp[i].position = i;
+        }
+        qsort(tmp, count, sizeof(IndexedEntry), compareIndexedEntries);
+        set->sorted = malloc((count > 0 ? count : 1) * sizeof(*entries));
+        for (size_t i = 0; i < count; i++) set->sorted[i] = tmp[i].entry;
+        free(tmp);
+        entries = set->sorted;
+    }
+
+    // Contents live in the per-trace data file or in the shared store
+    bool need_data = false, need_store = false;
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].flags & CX_PAGE_ZERO) continue;
+        if (entries[i].flags & CX_PAGE_STORED) need_store = true;
+        else need_data = true;
+    }
+    sprintf(path, "%s/pages.%d.data", trace_dir, index);
+    if (need_data && !mapFile(path, &set->data)) {
+        fprintf(stderr, "chop-trace2mpt: Error: Missing page data for trace %d\n", index);
+        exit(EXIT_FAILURE);
+    }
+    sprintf(path, "%s/pages.store", trace_dir);
+    if (need_store && !mapFile(path, &set->store)) {
+        fprintf(stderr, "chop-trace2mpt: Error: Missing page store for trace %d\n", index);
+        exit(EXIT_FAILURE);
+    }
+
+    // Delta-encoded pages are rebuilt on top of the pages of the base trace,
+    // which might need its own base (up to the -page-delta interval)
+    size_t num_deltas = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].flags & CX_PAGE_DELTA) num_deltas++;
+    }
+    PageSet base;
+    if (num_deltas > 0) {
+        if (!loadPageArchive(trace_dir, hdr->base, &base)) {
+            fprintf(stderr, "chop-trace2mpt: Error: Missing base trace %u of trace %d\n",
+                    hdr->base, index);
+            exit(EXIT_FAILURE);
+        }
+        set->decoded = malloc(num_deltas * hdr->page_size);
+        num_deltas = 0;
+    }
+
+    set->pages = malloc((count > 0 ? count : 1) * sizeof(PageRef));
+    for (size_t i = 0; i < count; i++) {
+        // Keep only the latest contents of a page dumped more than once
+        if (i + 1 < count && entries[i + 1].addr == entries[i].addr) continue;
+        PageRef *page = &set->pages[set->num_pages++];
+        page->address = entries[i].addr;
+        page->size = entries[i].size;
+        page->name = NULL;
+        page->zero = (entries[i].flags & CX_PAGE_ZERO) != 0;
+        if (page->zero) {
+            if (set->zero == NULL) set->zero = calloc(1, hdr->page_size);
+            page->data = set->zero;
+            continue;
+        }
+        MappedFile *file = (entries[i].flags & CX_PAGE_STORED) ? &set->store : &set->data;
+        if (entries[i].offset + entries[i].size > file->size) {
+            fprintf(stderr, "chop-trace2mpt: Error: Page 0x%lx out of data file bounds\n",
+                    (unsigned long) entries[i].addr);
+            exit(EXIT_FAILURE);
+        }
+        page->data = file->data + entries[i].offset;
+        if (entries[i].flags & CX_PAGE_DELTA) {
+            PageRef key = { .address = page->address };
+            PageRef *prev = bsearch(&key, base.pages, base.num_pages,
+                                    sizeof(PageRef), comparePageRefs);
+            if (prev == NULL || prev->size != hdr->page_size) {
+                fprintf(stderr, "chop-trace2mpt: Error: Page 0x%lx missing in base trace %u\n",
+                        page->address, hdr->base);
+                exit(EXIT_FAILURE);
+            }
+            char *decoded = set->decoded + num_deltas++ * hdr->page_size;
+            memcpy(decoded, prev->data, hdr->page_size);
+            if (!cx_page_delta_apply(decoded, hdr->page_size, page->data, page->size)) {
+                fprintf(stderr, "chop-trace2mpt: Error: Bad delta for page 0x%lx\n",
+                        page->address);
+                exit(EXIT_FAILURE);
+            }
+            page->data = decoded;
+            page->size = hdr->page_size;
+        }
+    }
+    if (set->decoded != NULL) freePages(&base);
+    return true;
+}
+
+// Collect the pages of a trace stored one file per page
+// (page.<id>.<addr>), as generated by older versions of the tracer.
+void loadLegacyPages(const char *trace_dir, unsigned int index, PageSet *set) {
+    memset(set, 0, sizeof(*set));
+    unsigned int _num_alloced_pages = 64;
+    set->pages = malloc(_num_alloced_pages * sizeof(PageRef));
+    DIR *dir;
+    dir = opendir(trace_dir);
+    if (dir == NULL) {
+        fprintf(stderr, "chop-trace2mpt: Error: Unable to open %s\n", trace_dir);
+        fprintf(stderr, "chop-trace2mpt: Error: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    char filter[16];
+    sprintf(filter, "page.%d.", index);
+    unsigned int filter_length = strlen(filter);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned int name_length = strlen(entry->d_name);
+        if (strncmp(filter, entry->d_name, filter_length) == 0) {
+            if (set->num_pages == _num_alloced_pages) {
+                _num_alloced_pages *= 2;
+                set->pages = realloc(set->pages, _num_alloced_pages * sizeof(PageRef));
+            }
+
+            char *name = malloc(name_length + 1);
+            memcpy(name, entry->d_name, name_length + 1);
+            PageRef *page = &set->pages[set->num_pages++];
+            page->address = strtoul(name + filter_length, NULL, 16);
+            page->data = NULL;
+            page->size = 0;
+            page->zero = false;
+            page->name = name;
+        }
+    }
+    closedir(dir);
+    qsort(set->pages, set->num_pages, sizeof(PageRef), comparePageRefs);
+}
+
+void loadPages(const char *trace_dir, unsigned int index, PageSet *set) {
+    if (!loadPageArchive(trace_dir, index, set)) {
+        loadLegacyPages(trace_dir, index, set);
+    }
+}
+
+void freePages(PageSet *set) {
+    for (unsigned int i = 0; i < set->num_pages; i++) free(set->pages[i].name);
+    free(set->pages);
+    free(set->sorted);
+    free(set->zero);
+    free(set->decoded);
+    unmapFile(&set->index);
+    unmapFile(&set->data);
+    unmapFile(&set->store);
+}
+
+// Contents of a page. Legacy pages are read from their own file; the result
+// must be released with releasePageData.
+const char *pageData(const char *trace_dir, PageRef *page, size_t *size) {
+    if (page->name == NULL) {
+        *size = page->size;
+        return page->data;
+    }
+    char path[PATH_LEN];
+    char *data;
+    sprintf(path, "%s/%s", trace_dir, page->name);
+    readFile(path, &data, size, false);
+    return data;
+}
+
+void releasePageData(PageRef *page, const char *data) {
+    if (page->name != NULL) free((char *) data);
+}
+
 void format_data(FILE *mps, const char *data, size_t data_size,
                  unsigned long address) {
     fprintf(mps, "M %016lx ", address);
@@ -182,6 +474,20 @@ void format_data(FILE *mps, const char *data, size_t data_size,
     fwrite("\n", 1, 1, mps);
 }
 
+// Zero-filled range (consecutive zero pages), as a single memory entry
+void format_zero(FILE *mps, size_t size, unsigned long address) {
+    static const char zeros[] =
+        "0000000000000000000000000000000000000000000000000000000000000000";
+    size_t chunk = sizeof(zeros) - 1;
+    fprintf(mps, "M %016lx ", address);
+    for (size_t digits = 2 * size; digits > 0;) {
+        size_t n = digits < chunk ? digits : chunk;
+        fwrite(zeros, n, 1, mps);
+        digits -= n;
+    }
+    fwrite("\n", 1, 1, mps);
+}
+
 void format_code(FILE *mpt, const char *data, size_t data_size,
                  unsigned long address) {
     if ((data_size % 16) != 0) {
@@ -265,72 +571,58 @@ void trace2mpt(const char *output_base, const char *trace_dir,
     printf("chop-trace2mpt: Read %d registers.\n", register_count);
 
     // Find memory pages
-    unsigned int _num_alloced_pages = 64;
-    char **pages = malloc(_num_alloced_pages * sizeof(char *));
-    unsigned int num_pages = 0;
-    DIR *dir;
-    dir = opendir(trace_dir);
-    if (dir == NULL) {
-        fprintf(stderr, "chop-trace2mpt: Error: Unable to open %s\n", trace_dir);
-        fprintf(stderr, "chop-trace2mpt: Error: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-    char filter[16];
-    sprintf(filter, "page.%d.", index);
-    unsigned int filter_length = strlen(filter);
-    struct dirent *entry;
-    // TODO: Use scandir to get sorted/filteres results
-    while ((entry = readdir(dir)) != NULL) {
-        unsigned int name_length = strlen(entry->d_name);
-        if (strncmp(filter, entry->d_name, filter_length) == 0) {
-            if (num_pages == _num_alloced_pages) {
-                _num_alloced_pages *= 2;
-                pages = realloc(pages, _num_alloced_pages * sizeof(char *));
-            }
-
-            char *name = malloc(name_length + 1);
-            memcpy(name, entry->d_name, name_length + 1);
-            pages[num_pages++] = name;
-        }
-    }
-    closedir(dir);
+    PageSet set;
+    loadPages(trace_dir, index, &set);
+    unsigned int num_pages = set.num_pages;
 
     // Process memory pages
     bool default_address_found = false;
     for (unsigned int i = 0; i < num_pages; i++) {
         printf("\rchop-trace2mpt: Processing page %d/%d", i + 1, num_pages);
         fflush(stdout);
-        unsigned long address = strtol(pages[i] + filter_length, NULL, 16);
+        PageRef *page = &set.pages[i];
+        unsigned long address = page->address;
 
         if (max_address != 0 && address >= max_address) {
-            if (default_address < address && default_address >= (address + data_size)) {
+            if (default_address < address && default_address >= (address + page->size)) {
                 printf("\rchop-trace2mpt: Processing page %d/%d skip\n", i + 1, num_pages);
                 fflush(stdout);
                 continue;
             }
         }
 
-        sprintf(path, "%s/%s", trace_dir, pages[i]);
-        readFile(path, &data, &data_size, false);
+        const char *page_data = pageData(trace_dir, page, &data_size);
         MemorySegment *segment =
             findSegment(address, segments, segment_count);
 
         if (segment != NULL) {
 	    if (segment->type == SEGMENT_CODE) {
-		format_code(mpt, data, data_size, address);
+		format_code(mpt, page_data, data_size, address);
                 if (default_address >= address && default_address < (address + data_size)) {
                     printf("%ld, %lx\n", data_size, address);
                     default_address_found = true;
                 }
+	    } else if (segment->type == SEGMENT_DATA && page->zero) {
+                // Merge the following zero pages of the same segment
+                size_t range_size = page->size;
+                while (i + 1 < num_pages && set.pages[i + 1].zero &&
+                       set.pages[i + 1].address == address + range_size &&
+                       (max_address == 0 || address + range_size < max_address) &&
+                       findSegment(set.pages[i + 1].address, segments,
+                                   segment_count) == segment) {
+                    range_size += set.pages[++i].size;
+                }
+                format_zero(mps, range_size, address);
 	    } else if (segment->type == SEGMENT_DATA) {
-            	format_data(mps, data, data_size, address);
+            	format_data(mps, page_data, data_size, address);
 	    } else {
 		printf("Page at address %lx has unknown contents\n", address);
 		printf("Skipping...\n");
 	    }
         }
-        free(data);
+        releasePageData(page, page_data);
     }
+    freePages(&set);
 
     fclose(mpt);
     fclose(mps);
@@ -363,16 +655,49 @@ void trace2mpt(const char *output_base, const char *trace_dir,
 
 }
 
+// Write the pages of an archived trace using the old one-file-per-page
+// layout (page.<id>.<addr>) for tools that still expect it.
+void exportLegacyPages(const char *trace_dir, unsigned int index) {
+    char path[PATH_LEN];
+    PageSet set;
+    if (!loadPageArchive(trace_dir, index, &set)) {
+        printf("chop-trace2mpt: No page archive for trace %u, skipping\n", index);
+        return;
+    }
+
+    for (unsigned int i = 0; i < set.num_pages; i++) {
+        PageRef *page = &set.pages[i];
+        sprintf(path, "%s/page.%d.%lx", trace_dir, index, page->address);
+        FILE *fp = fopen(path, "wb");
+        if (fp == NULL) {
+            fprintf(stderr, "chop-trace2mpt: Unable to write to '%s'\n", path);
+            fprintf(stderr, "chop-trace2mpt: Error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (fwrite(page->data, page->size, 1, fp) != 1) {
+            fprintf(stderr, "chop-trace2mpt: Unable to write to '%s'\n", path);
+            exit(EXIT_FAILURE);
+        }
+        fclose(fp);
+    }
+    printf("chop-trace2mpt: Exported %u pages of trace %u\n", set.num_pages, index);
+    freePages(&set);
+}
+
 void print_usage() {
     printf(
         "Usage: chop-trace2mpt [-i <id>] -o <out> [-h] [--trace-dir <dir>] [--gzip]\n"
+        "       chop-trace2mpt [-i <id>] --export-pages [--trace-dir <dir>]\n"
         "Options:\n"
         "  -h,--help            Display this help and exit\n"
         "  -i,--id <id>         Trace id. If not provided all id in the directory will be processed.\n"
         "  -o,--output <out>    Output base path. i.e. (<out>.<id>.mpt <out>.<id>.mps will be generated)\n"
         "  --trace-dir <dir>    Path to trace directory (default: ./trace_data)\n"
         "  --max-address value  Pages above this address will not be dumped to the generated MPT\n"
-        "  --gzip               Zip trace output files\n");
+        "  --gzip               Zip trace output files\n"
+        "  --export-pages       Do not generate MPTs. Unpack the page archive of the\n"
+        "                       traces into one file per page (page.<id>.<addr>),\n"
+        "                       the layout used by older versions of chop trace.\n");
 }
 
 int main(int argc, const char **argv) {
@@ -389,6 +714,7 @@ int main(int argc, const char **argv) {
     const char *output_base = NULL;
     const char *trace_dir = "./trace_data";
     bool compressed = false;
+    bool export_pages = false;
     unsigned long long int max_address = 0;
 
     enum {
@@ -411,6 +737,7 @@ int main(int argc, const char **argv) {
                 else if (strcmp(arg, "--trace-dir") == 0) state = EXPECTING_TRACE_DIR;
                 else if (strcmp(arg, "--max-address") == 0) state = EXPECTING_ADDRESS;
                 else if (strcmp(arg, "--gzip") == 0) compressed = true;
+                else if (strcmp(arg, "--export-pages") == 0) export_pages = true;
                 else {
                     fprintf(stderr, "chop-trace2mpt: Unknown option: %s\n", arg);
                     print_usage();
@@ -437,7 +764,7 @@ int main(int argc, const char **argv) {
         }
     }
 
-    if (output_base == NULL) {
+    if (output_base == NULL && !export_pages) {
         fprintf(stderr, "chop-trace2mpt: Missing required option(s): -o\n");
         print_usage();
         return 2;
@@ -445,7 +772,8 @@ int main(int argc, const char **argv) {
 
     if (id_provided) {
         printf("chop-trace2mpt: Processing trace id: %d\n", id);
-        trace2mpt(output_base, trace_dir, id, max_address, compressed);
+        if (export_pages) exportLegacyPages(trace_dir, id);
+        else trace2mpt(output_base, trace_dir, id, max_address, compressed);
     } else {
         struct dirent **namelist;
         int n;
@@ -462,7 +790,8 @@ int main(int argc, const char **argv) {
             if (strncmp("info.", namelist[count]->d_name, 5) == 0) {
                unsigned int index = strtoul(namelist[count]->d_name + 5, NULL, 10);
                printf("chop-trace2mpt: Processing trace id: %d\n", index);
-               trace2mpt(output_base, trace_dir, index, max_address, compressed);
+               if (export_pages) exportLegacyPages(trace_dir, index);
+               else trace2mpt(output_base, trace_dir, index, max_address, compressed);
             }
             free(namelist[count]);
             ++count;
@@ -0,0 +1,106 @@
+/*
+#
+# ----------------------------------------------------------------------------
+#
+# Copyright 2020 IBM Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# ----------------------------------------------------------------------------
+#
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "statsfmt.h"
+
+#define PATH_LEN 512
+
+void print_usage() {
+    printf(
+        "Usage: chop-trace-stats [--trace-dir <dir>] [-h]\n"
+        "Options:\n"
+        "  -h,--help            Display this help and exit\n"
+        "  --trace-dir <dir>    Path to trace directory (default: ./trace_data)\n"
+        "Print the tracing overhead of each trace: pages accessed, faults\n"
+        "handled, time spent in the fault handler and bytes dumped.\n");
+}
+
+int main(int argc, const char **argv) {
+    const char *trace_dir = "./trace_data";
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage();
+            return 0;
+        } else if (strcmp(arg, "--trace-dir") == 0 && i + 1 < argc) {
+            trace_dir = argv[++i];
+        } else {
+            fprintf(stderr, "chop-trace-stats: Unknown option: %s\n", arg);
+            print_usage();
+            return 2;
+        }
+    }
+
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s/" CX_STATS_FILE, trace_dir);
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "chop-trace-stats: Error: Unable to open '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    struct cx_stats_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        strncmp(hdr.magic, CX_STATS_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version > CX_STATS_VERSION) {
+        fprintf(stderr, "chop-trace-stats: Error: '%s' is not a stats file\n",
+                path);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%8s %10s %10s %12s %10s %14s  %s\n", "trace", "pages", "faults",
+           "handler_us", "us/fault", "bytes", "status");
+    uint64_t count = hdr.traces < hdr.capacity ? hdr.traces : hdr.capacity;
+    for (uint64_t i = 0; i < count; i++) {
+        struct cx_trace_stats stats;
+        if (fread(&stats, sizeof(stats), 1, fp) != 1) {
+            fprintf(stderr, "chop-trace-stats: Error: Truncated '%s'\n", path);
+            exit(EXIT_FAILURE);
+        }
+        double per_fault = stats.faults ? stats.handler_ns * 1e-3 / stats.faults : 0;
+        printf("%8lu %10lu %10lu %12lu %10.2f %14lu  %s\n", (unsigned long) i,
+               (unsigned long) stats.pages, (unsigned long) stats.faults,
+               (unsigned long) (stats.handler_ns / 1000), per_fault,
+               (unsigned long) stats.bytes,
+               (stats.flags & CX_STATS_DONE) ? "done" : "not stopped");
+    }
+    fclose(fp);
+
+    if (hdr.traces > hdr.capacity) {
+        printf("(%lu traces beyond the first %u only counted in the totals)\n",
+               (unsigned long) (hdr.traces - hdr.capacity), hdr.capacity);
+    }
+    const struct cx_trace_stats *total = &hdr.total;
+    printf("%8s %10lu %10lu %12lu %10.2f %14lu\n", "total",
+           (unsigned long) total->pages, (unsigned long) total->faults,
+           (unsigned long) (total->handler_ns / 1000),
+           total->faults ? total->handler_ns * 1e-3 / total->faults : 0,
+           (unsigned long) total->bytes);
+    exit(EXIT_SUCCESS);
+}